@@ -6,11 +6,63 @@
 #include <optional>
 #include <fstream>
 #include <sstream>
+#include <iomanip>
 #include <cstdlib>
 #include <filesystem>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <array>
+#include <algorithm>
+#include <random>
+#include <limits>
+#include <numeric>
+#include <tuple>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <memory_resource>
+#include <condition_variable>
+#include <atomic>
+#include <string_view>
+#include <csignal>
+#include <csetjmp>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 
 namespace fs = std::filesystem;
 
+// Heap allocations made through operator new, for --compile-stats,
+// which counts them from the start of a compilation to its report.
+// Otherwise an allocation only pays for testing the flag.
+std::atomic<bool> countingAllocations{false};
+std::atomic<unsigned long long> heapAllocations{0};
+
+void *operator new(size_t size)
+{
+    if (countingAllocations.load(std::memory_order_relaxed))
+    {
+        heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (void *p = std::malloc(size == 0 ? 1 : size))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
 enum Instruction
 {
     RIGHT,
@@ -20,7 +72,16 @@ enum Instruction
     PUT,
     GET,
     LOOP,
-    JMP
+    JMP,
+    // produced by the optimizer
+    BODY,
+    CLEAR,
+    SET,
+    ADD,
+    MULADD,
+    DIVMOD,
+    MUL,
+    CMP
 };
 
 std::ostream &operator<<(std::ostream &os, const Instruction &inst)
@@ -51,6 +112,30 @@ std::ostream &operator<<(std::ostream &os, const Instruction &inst)
     case JMP:
         os << "]";
         break;
+    case BODY:
+        os << "|";
+        break;
+    case CLEAR:
+        os << "[-]";
+        break;
+    case SET:
+        os << "=";
+        break;
+    case ADD:
+        os << "+=";
+        break;
+    case MULADD:
+        os << "*";
+        break;
+    case DIVMOD:
+        os << "/";
+        break;
+    case MUL:
+        os << "x";
+        break;
+    case CMP:
+        os << "?";
+        break;
     }
     return os;
 }
@@ -59,86 +144,711 @@ struct Command
 {
     Command(Instruction inst, size_t jumpTo)
         : inst(inst), jumpTo(jumpTo) {}
+    Command(Instruction inst, int offset, int value)
+        : inst(inst), jumpTo(0), offset(offset), value(value) {}
     Instruction inst;
     size_t jumpTo;
+    // cell operand relative to the pointer, and an immediate.
+    // LOOP sets value to 1 when its cell is known nonzero on entry, and
+    // BODY when the code between it and its LOOP left the cell alone.
+    // Commands on the current cell only carry an offset once the tape
+    // is transposed.
+    int offset = 0;
+    int value = 0;
+    // extra cell operands of idiom ops (DIVMOD, MUL, CMP), and the
+    // source cell of MULADD
+    std::array<int, 3> args{};
+    // index of the instruction the command was built from
+    size_t source = 0;
 };
 
 class LoopMismatch : public std::runtime_error
 {
 public:
-    LoopMismatch(const std::string &what) : std::runtime_error(what) {}
+    LoopMismatch(const std::string &what, size_t instruction)
+        : std::runtime_error(what), instruction(instruction) {}
+    // index of the unmatched bracket
+    size_t instruction;
 };
 
-std::vector<Command>
-buildProgram(const std::vector<Instruction> &insts)
+// Work smaller than this stays on the calling thread, where starting
+// threads would cost more than they save.
+const size_t parallelGrain = 1 << 20;
+
+size_t chunkCount(size_t n)
 {
-    std::stack<size_t> loopstack;
-    std::vector<Command> cmds;
+    const size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    return std::clamp(n / parallelGrain, size_t(1), cores);
+}
+
+// Splits [0, n) into chunks and runs work(chunk, begin, end) on each
+// in a thread of its own. work must not throw.
+template <typename Work>
+void forChunks(size_t n, size_t chunks, const Work &work)
+{
+    if (chunks == 1)
+    {
+        work(0, 0, n);
+        return;
+    }
+    std::vector<std::thread> threads;
+    for (size_t c = 0; c < chunks; c++)
+    {
+        threads.emplace_back([&, c]()
+                             { work(c, n * c / chunks, n * (c + 1) / chunks); });
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+}
+
+// Fixed set of threads that runs batches of independent tasks. Each
+// thread has a deque of its own: it takes from the back of its own and,
+// when that runs dry, steals from the front of another's, so one slow
+// task does not hold up those queued behind it. The caller's thread
+// works too. Tasks put their results in slots of their own, so what a
+// batch computes does not depend on which thread ran what.
+class WorkPool
+{
+public:
+    explicit WorkPool(int threads) : queues(std::max(threads, 1))
+    {
+        for (size_t w = 1; w < queues.size(); w++)
+        {
+            workers.emplace_back([this, w]() { work(w); });
+        }
+    }
+    WorkPool(const WorkPool &) = delete;
+    WorkPool &operator=(const WorkPool &) = delete;
 
-    for (size_t i = 0; i < insts.size(); i++)
+    ~WorkPool()
     {
-        const auto &inst = insts.at(i);
-        switch (inst)
         {
-        case JMP:
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        started.notify_all();
+        for (auto &worker : workers)
         {
-            size_t jmpto = loopstack.top();
-            loopstack.pop();
-            cmds.emplace_back(inst, jmpto);
-            cmds.at(jmpto).jumpTo = i;
-            break;
+            worker.join();
         }
-        case LOOP:
-            loopstack.push(i);
-            cmds.emplace_back(inst, 0);
-            break;
-        default:
-            cmds.emplace_back(inst, 0);
-            break;
+    }
+
+    // runs task(k) for k in [0, count) and waits for all of them; the
+    // first exception a task throws is rethrown here
+    void run(size_t count, const std::function<void(size_t)> &task)
+    {
+        if (workers.empty() || count < 2)
+        {
+            for (size_t k = 0; k < count; k++)
+            {
+                task(k);
+            }
+            return;
+        }
+        {
+            // set before any task can be taken, even by a thread still
+            // looking for work from the last batch
+            std::lock_guard<std::mutex> lock(mutex);
+            current = &task;
+            pending = count;
+            error = nullptr;
+            for (size_t w = 0; w < queues.size(); w++)
+            {
+                std::lock_guard<std::mutex> queueLock(queues[w].mutex);
+                for (size_t k = count * w / queues.size(); k < count * (w + 1) / queues.size(); k++)
+                {
+                    queues[w].tasks.push_back(k);
+                }
+            }
+            batch++;
+        }
+        started.notify_all();
+        drain(0);
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [this]() { return pending == 0; });
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+
+    void work(size_t w)
+    {
+        size_t seen = 0;
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                started.wait(lock, [&]() { return stopping || batch != seen; });
+                if (stopping)
+                {
+                    return;
+                }
+                seen = batch;
+            }
+            drain(w);
         }
     }
 
+    // runs tasks until none are left to take or steal
+    void drain(size_t w)
+    {
+        while (const auto k = take(w))
+        {
+            try
+            {
+                (*current)(k.value());
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error)
+                {
+                    error = std::current_exception();
+                }
+            }
+            if (--pending == 0)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                finished.notify_all();
+            }
+        }
+    }
+
+    std::optional<size_t> take(size_t w)
+    {
+        {
+            auto &own = queues[w];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty())
+            {
+                const auto k = own.tasks.back();
+                own.tasks.pop_back();
+                return k;
+            }
+        }
+        for (size_t v = 1; v < queues.size(); v++)
+        {
+            auto &other = queues[(w + v) % queues.size()];
+            std::lock_guard<std::mutex> lock(other.mutex);
+            if (!other.tasks.empty())
+            {
+                const auto k = other.tasks.front();
+                other.tasks.pop_front();
+                return k;
+            }
+        }
+        return std::nullopt;
+    }
+
+    std::vector<Queue> queues;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable started;
+    std::condition_variable finished;
+    const std::function<void(size_t)> *current = nullptr;
+    std::atomic<size_t> pending{0};
+    std::exception_ptr error;
+    size_t batch = 0;
+    bool stopping = false;
+};
+
+// Brackets are matched per chunk in parallel, each chunk pairing what it
+// can with a stack of its own. What is left in a chunk is some ] followed
+// by some [, at depths that follow from the depth the chunk starts at;
+// those are paired across chunks by depth, which takes one stack over
+// the leftovers alone.
+std::vector<Command>
+buildProgram(const std::vector<Instruction> &insts)
+{
+    const auto chunks = chunkCount(insts.size());
+    std::vector<Command> cmds(insts.size(), Command(RIGHT, 0));
+    std::vector<std::vector<size_t>> opens(chunks), closes(chunks);
+    const auto link = [&](size_t loop, size_t jmp)
+    {
+        cmds[loop].jumpTo = jmp;
+        cmds[jmp].jumpTo = loop;
+    };
+    forChunks(insts.size(), chunks,
+              [&](size_t c, size_t begin, size_t end)
+              {
+                  auto &open = opens[c];
+                  for (size_t i = begin; i < end; i++)
+                  {
+                      cmds[i].inst = insts[i];
+                      cmds[i].source = i;
+                      if (insts[i] == LOOP)
+                      {
+                          open.push_back(i);
+                      }
+                      else if (insts[i] == JMP && open.empty())
+                      {
+                          closes[c].push_back(i);
+                      }
+                      else if (insts[i] == JMP)
+                      {
+                          link(open.back(), i);
+                          open.pop_back();
+                      }
+                  }
+              });
+
+    // the stack's size is the depth at the start of each chunk
+    std::vector<size_t> loopstack;
+    for (size_t c = 0; c < chunks; c++)
+    {
+        for (const auto jmp : closes[c])
+        {
+            if (loopstack.empty())
+            {
+                throw LoopMismatch("unmatched ]", jmp);
+            }
+            link(loopstack.back(), jmp);
+            loopstack.pop_back();
+        }
+        loopstack.insert(loopstack.end(), opens[c].begin(), opens[c].end());
+    }
+    if (!loopstack.empty())
+    {
+        throw LoopMismatch("unmatched [", loopstack.front());
+    }
     return cmds;
 }
 
+std::string cell(int offset)
+{
+    if (offset == 0)
+        return "byte [rsp+r8]";
+    if (offset < 0)
+        return "byte [rsp+r8-" + std::to_string(-offset) + "]";
+    return "byte [rsp+r8+" + std::to_string(offset) + "]";
+}
+
 std::string asm_right() { return "inc r8"; }
 std::string asm_left() { return "dec r8"; }
 std::string asm_incr() { return "inc byte [rsp+r8]"; }
 std::string asm_decr() { return "dec byte [rsp+r8]"; }
-std::vector<std::string> asm_put()
+// Buffered I/O for generated code.
+//
+// Input and output each have two 64 KiB buffers. Output fills one while
+// the other is being written; input is read from one while the next
+// chunk is read into the other. The reads and writes in flight go
+// through an io_uring, so the program runs on while the kernel moves
+// its bytes. Without io_uring, a full buffer is written and an empty one
+// read with plain syscalls. Output is flushed before waiting for input,
+// so prompts still show, and at exit.
+//
+// The runtime routines cannot use the stack, which may hold the tape or
+// sit against a guard page, so they return through a register: r15 from
+// the ones the program jumps to, r14 and r12 from those they use. r13
+// keeps the tape pointer while syscalls take r8.
+const long long ioBufferSize = 65536;
+
+std::vector<std::string> asm_io_data()
 {
+    const auto size = std::to_string(ioBufferSize);
     return {
-        "mov rax, 1",
-        "mov rdi, 1",
-        "mov rsi, buf",
-        "mov rdx, 1",
-        "mov r9b, byte [rsp+r8]",
-        "mov byte [buf], r9b",
-        "syscall"};
+        "section .bss",
+        "alignb 4096",
+        "io_bufs: resb " + std::to_string(4 * ioBufferSize),
+        "io_params: resb 120",
+        "section .data",
+        "ring_fd: dq -1",
+        "io_ring: dq 0",
+        "io_sqes: dq 0",
+        "in_buf: dq io_bufs",
+        "in_next: dq io_bufs+" + size,
+        "in_pos: dq 0",
+        "in_len: dq 0",
+        "in_last: dq 0",
+        "in_eof: dq 0",
+        // where in the input in_buf starts, and how much was written out
+        "in_base: dq 0",
+        "out_total: dq 0",
+        // no read, a read in flight, or a read done but not yet used
+        "read_state: dq 0",
+        "read_res: dq 0",
+        "out_buf: dq io_bufs+" + std::to_string(2 * ioBufferSize),
+        "out_next: dq io_bufs+" + std::to_string(3 * ioBufferSize),
+        "out_len: dq 0",
+        "write_busy: dq 0",
+        "write_res: dq 0",
+        "write_addr: dq 0",
+        "write_len: dq 0"};
+}
+
+// Sets up the ring, once the tape is; on any failure ring_fd stays -1
+// and I/O uses plain syscalls. Needs one mapping for both rings, and
+// reads and writes at the current file position.
+std::vector<std::string> asm_io_init()
+{
+    return {
+        "mov r13, r8",
+        "mov rax, 425",
+        "mov rdi, 4",
+        "mov rsi, io_params",
+        "syscall",
+        "test rax, rax",
+        "js io_init_done",
+        "mov [ring_fd], rax",
+        "mov eax, [io_params+20]",
+        "and eax, 9",
+        "cmp eax, 9",
+        "jne io_init_fail",
+        "mov esi, [io_params]",
+        "shl esi, 2",
+        "add esi, [io_params+64]",
+        "mov edx, [io_params+4]",
+        "shl edx, 4",
+        "add edx, [io_params+100]",
+        "cmp esi, edx",
+        "cmovb esi, edx",
+        "xor rdi, rdi",
+        "mov rdx, 3",
+        "mov r10, 0x8001",
+        "mov r8, [ring_fd]",
+        "xor r9, r9",
+        "mov rax, 9",
+        "syscall",
+        "test rax, rax",
+        "js io_init_fail",
+        "mov [io_ring], rax",
+        "mov esi, [io_params]",
+        "shl esi, 6",
+        "xor rdi, rdi",
+        "mov rdx, 3",
+        "mov r10, 0x8001",
+        "mov r8, [ring_fd]",
+        "mov r9, 0x10000000",
+        "mov rax, 9",
+        "syscall",
+        "test rax, rax",
+        "js io_init_fail",
+        "mov [io_sqes], rax",
+        "jmp io_init_done",
+        "io_init_fail:",
+        "mov rdi, [ring_fd]",
+        "mov rax, 3",
+        "syscall",
+        "mov qword [ring_fd], -1",
+        "io_init_done:",
+        "mov r8, r13"};
 }
-std::vector<std::string> asm_get()
+
+std::vector<std::string> asm_io_runtime()
 {
+    const auto size = std::to_string(ioBufferSize);
     return {
-        "mov rax, 0",
-        "mov rdi, 0",
-        "mov rsi, buf",
-        "mov rdx, 1",
+        // io_flush: writes out the output buffer
+        "io_flush:",
+        "mov r13, r8",
+        "mov r14, io_restore",
+        "jmp io_write_out",
+        "io_restore:",
+        "mov r8, r13",
+        "jmp r15",
+
+        // io_finish: writes out the output buffer and waits for it
+        "io_finish:",
+        "mov r13, r8",
+        "mov r14, io_finish_wait",
+        "jmp io_write_out",
+        "io_finish_wait:",
+        "mov r14, io_restore",
+        "jmp io_write_out",
+
+        // io_refill: the next input chunk, or at end of input the last
+        // byte read again
+        "io_refill:",
+        "mov r13, r8",
+        "cmp qword [in_eof], 0",
+        "jne io_refill_eof",
+        "mov rdx, [in_len]",
+        "add [in_base], rdx",
+        "test rdx, rdx",
+        "jz io_refill_flush",
+        "mov rsi, [in_buf]",
+        "movzx eax, byte [rsi+rdx-1]",
+        "mov [in_last], rax",
+        "io_refill_flush:",
+        "mov r14, io_refill_read",
+        "jmp io_write_out",
+        "io_refill_read:",
+        "cmp qword [ring_fd], 0",
+        "jl io_refill_sync",
+        "cmp qword [read_state], 0",
+        "jne io_refill_wait",
+        "mov r9, [in_next]",
+        "mov r10, " + size,
+        "mov r11, 1",
+        "mov qword [read_state], 1",
+        "mov r12, io_refill_wait",
+        "jmp io_submit",
+        "io_refill_wait:",
+        "cmp qword [read_state], 1",
+        "jne io_refill_swap",
+        "mov r12, io_refill_wait",
+        "jmp io_reap",
+        "io_refill_swap:",
+        "mov qword [read_state], 0",
+        "mov rax, [in_buf]",
+        "mov rdx, [in_next]",
+        "mov [in_buf], rdx",
+        "mov [in_next], rax",
+        "mov rax, [read_res]",
+        "test rax, rax",
+        "jle io_refill_end",
+        "mov [in_len], rax",
+        "mov qword [in_pos], 0",
+        // read ahead into the buffer just used up
+        "mov r9, [in_next]",
+        "mov r10, " + size,
+        "mov r11, 1",
+        "mov qword [read_state], 1",
+        "mov r12, io_restore",
+        "jmp io_submit",
+        "io_refill_sync:",
+        "xor eax, eax",
+        "xor edi, edi",
+        "mov rsi, [in_buf]",
+        "mov rdx, " + size,
+        "syscall",
+        "test rax, rax",
+        "jle io_refill_end",
+        "mov [in_len], rax",
+        "mov qword [in_pos], 0",
+        "jmp io_restore",
+        "io_refill_end:",
+        "mov qword [in_eof], 1",
+        "io_refill_eof:",
+        "mov rsi, [in_buf]",
+        "mov rax, [in_last]",
+        "mov [rsi], al",
+        "mov qword [in_len], 1",
+        "mov qword [in_pos], 0",
+        "jmp io_restore",
+
+        // io_write_out: waits for the write in flight, finishing it if
+        // it came up short, then starts writing the output buffer
+        "io_write_out:",
+        "cmp qword [ring_fd], 0",
+        "jl io_write_sync",
+        "io_write_wait:",
+        "cmp qword [write_busy], 0",
+        "je io_write_check",
+        "mov r12, io_write_wait",
+        "jmp io_reap",
+        "io_write_check:",
+        "mov rax, [write_res]",
+        "mov rdx, [write_len]",
+        "mov qword [write_res], 0",
+        "mov qword [write_len], 0",
+        "cmp rax, rdx",
+        "jge io_write_submit",
+        "test rax, rax",
+        "jle io_write_submit",
+        "mov rsi, [write_addr]",
+        "add rsi, rax",
+        "sub rdx, rax",
+        "mov r12, io_write_submit",
+        "jmp io_write_all",
+        "io_write_submit:",
+        "mov r10, [out_len]",
+        "test r10, r10",
+        "jz io_write_done",
+        "add [out_total], r10",
+        "mov r9, [out_buf]",
+        "mov [write_addr], r9",
+        "mov [write_len], r10",
+        "mov qword [write_busy], 1",
+        "mov r11, 2",
+        "mov r12, io_write_swap",
+        "jmp io_submit",
+        "io_write_swap:",
+        "mov rax, [out_buf]",
+        "mov rdx, [out_next]",
+        "mov [out_buf], rdx",
+        "mov [out_next], rax",
+        "mov qword [out_len], 0",
+        "io_write_done:",
+        "jmp r14",
+        "io_write_sync:",
+        "mov rsi, [out_buf]",
+        "mov rdx, [out_len]",
+        "add [out_total], rdx",
+        "mov qword [out_len], 0",
+        "mov r12, io_write_done",
+        "jmp io_write_all",
+
+        // io_write_all: writes rdx bytes at rsi with plain syscalls
+        "io_write_all:",
+        "test rdx, rdx",
+        "jle io_write_all_done",
+        "mov rdi, 1",
+        "mov rax, 1",
+        "syscall",
+        "test rax, rax",
+        "jle io_write_all_done",
+        "add rsi, rax",
+        "sub rdx, rax",
+        "jmp io_write_all",
+        "io_write_all_done:",
+        "jmp r12",
+
+        // io_submit: queues a read (r11 = 1) into or a write (r11 = 2)
+        // from r10 bytes at r9, at the current file position
+        "io_submit:",
+        "mov rsi, [io_ring]",
+        "mov eax, [io_params+44]",
+        "mov ecx, [rsi+rax]",
+        "mov edx, [io_params+48]",
+        "mov edx, [rsi+rdx]",
+        "and edx, ecx",
+        "mov edi, [io_params+64]",
+        "add rdi, rsi",
+        "mov [rdi+rdx*4], edx",
+        "shl rdx, 6",
+        "add rdx, [io_sqes]",
+        "pxor xmm0, xmm0",
+        "movdqu [rdx], xmm0",
+        "movdqu [rdx+16], xmm0",
+        "movdqu [rdx+32], xmm0",
+        "movdqu [rdx+48], xmm0",
+        "lea edi, [r11+21]",
+        "mov [rdx], dil",
+        "lea edi, [r11-1]",
+        "mov [rdx+4], edi",
+        "mov qword [rdx+8], -1",
+        "mov [rdx+16], r9",
+        "mov [rdx+24], r10d",
+        "mov [rdx+32], r11",
+        "inc ecx",
+        "mov [rsi+rax], ecx",
+        "mov rdi, [ring_fd]",
+        "mov esi, 1",
+        "xor edx, edx",
+        "xor r10d, r10d",
+        "xor r8d, r8d",
+        "xor r9d, r9d",
+        "mov eax, 426",
+        "syscall",
+        "jmp r12",
+
+        // io_reap: waits for a completion and records its result
+        "io_reap:",
+        "mov rsi, [io_ring]",
+        "mov eax, [io_params+80]",
+        "mov ecx, [rsi+rax]",
+        "mov edx, [io_params+84]",
+        "cmp ecx, [rsi+rdx]",
+        "jne io_reap_take",
+        "mov rdi, [ring_fd]",
+        "xor esi, esi",
+        "mov edx, 1",
+        "mov r10d, 1",
+        "xor r8d, r8d",
+        "xor r9d, r9d",
+        "mov eax, 426",
         "syscall",
-        "mov r9b, [buf]",
-        "mov byte [rsp+r8], r9b"};
+        "jmp io_reap",
+        "io_reap_take:",
+        "mov edx, [io_params+88]",
+        "mov edx, [rsi+rdx]",
+        "and edx, ecx",
+        "shl edx, 4",
+        "mov edi, [io_params+100]",
+        "add rdi, rsi",
+        "add rdi, rdx",
+        "mov rdx, [rdi]",
+        "movsxd rdi, dword [rdi+8]",
+        "inc ecx",
+        "mov [rsi+rax], ecx",
+        "cmp rdx, 1",
+        "jne io_reap_write",
+        "mov [read_res], rdi",
+        "mov qword [read_state], 2",
+        "jmp r12",
+        "io_reap_write:",
+        "mov [write_res], rdi",
+        "mov qword [write_busy], 0",
+        "jmp r12"};
+}
+
+std::vector<std::string> asm_put(const std::string &label, int offset)
+{
+    return {
+        "mov r9b, " + cell(offset),
+        "mov rdi, [out_len]",
+        "mov rsi, [out_buf]",
+        "mov [rsi+rdi], r9b",
+        "inc rdi",
+        "mov [out_len], rdi",
+        "mov r15, " + label,
+        "cmp rdi, " + std::to_string(ioBufferSize),
+        "jae io_flush",
+        label + ":"};
+}
+std::vector<std::string> asm_get(const std::string &label, int offset)
+{
+    return {
+        "mov r15, " + label,
+        label + ":",
+        "mov rdi, [in_pos]",
+        "cmp rdi, [in_len]",
+        "jae io_refill",
+        "mov rsi, [in_buf]",
+        "mov r9b, [rsi+rdi]",
+        "inc rdi",
+        "mov [in_pos], rdi",
+        "mov " + cell(offset) + ", r9b"};
 }
-std::vector<std::string> asm_loop(const std::string &label, const std::string &jmpTo)
+// Loops test at the bottom, so an iteration costs one branch. The test
+// on entry can be left out when the cell is known to be nonzero. Code
+// between a LOOP and its BODY runs once, before the body label.
+std::vector<std::string> asm_loop(const std::string &label, const std::string &jmpTo,
+                                  int offset, bool tested)
 {
+    if (!tested)
+    {
+        return {
+            label + ":"};
+    }
     return {
         label + ":",
-        "mov r10b, byte [rsp+r8]",
+        "mov r10b, " + cell(offset),
         "test r10b, r10b",
         "jz " + jmpTo};
 }
-std::vector<std::string> asm_jmp(const std::string &label, const std::string &jmpTo)
+std::vector<std::string> asm_body(const std::string &label, const std::string &jmpTo,
+                                  int offset, bool tested)
+{
+    if (!tested)
+    {
+        return {
+            label + "_body:"};
+    }
+    return {
+        "mov r10b, " + cell(offset),
+        "test r10b, r10b",
+        "jz " + jmpTo,
+        label + "_body:"};
+}
+std::vector<std::string> asm_jmp(const std::string &label, const std::string &jmpTo,
+                                 int offset)
 {
     return {
-        "jmp " + jmpTo,
+        "mov r10b, " + cell(offset),
+        "test r10b, r10b",
+        "jnz " + jmpTo + "_body",
         label + ":"};
 }
 
@@ -147,162 +857,8542 @@ std::string int_to_label(int n)
     return "LP" + std::to_string(n);
 }
 
-std::vector<std::string> asm_init()
+std::string asm_clear() { return "mov " + cell(0) + ", 0"; }
+std::string asm_set(int offset, int value) { return "mov " + cell(offset) + ", " + std::to_string(value & 0xff); }
+std::string asm_add(int offset, int value) { return "add " + cell(offset) + ", " + std::to_string(value & 0xff); }
+std::vector<std::string> asm_muladd(int offset, int factor, int source)
 {
+    if (factor == 1 || factor == -1)
+    {
+        return {
+            "mov al, " + cell(source),
+            (factor == 1 ? "add " : "sub ") + cell(offset) + ", al"};
+    }
     return {
-        "global _start",
-        "section .data",
-        "buf: db 0",
-        "section .text",
-        "_start:",
-        "xor r8, r8",
-        "sub rsp, 30000"};
+        "movzx eax, " + cell(source),
+        "imul eax, eax, " + std::to_string(factor),
+        "add " + cell(offset) + ", al"};
 }
 
-std::vector<std::string> asm_tail()
+// The idiom ops below sit in front of their original loop, which is the
+// fallback when a guard fails. On success they jump past the loop.
+std::vector<std::string> asm_divmod(const std::string &label, const std::string &fallback,
+                                    const std::string &end, int d, int copy)
+{
+    std::vector<std::string> asms = {
+        "movzx eax, " + cell(0),
+        "test al, al",
+        "jz " + end,
+        "movzx ecx, " + cell(d),
+        "cmp cl, 1",
+        "je " + fallback,
+        "mov r9d, dword" + cell(d + 1).substr(4),
+        "test r9d, r9d",
+        "jnz " + fallback,
+        "mov r11d, eax",
+        "mov edx, eax",
+        "xor eax, eax",
+        "test ecx, ecx",
+        "jz " + label + "_store",
+        "mov eax, r11d",
+        "xor edx, edx",
+        "div ecx",
+        label + "_store:",
+        "mov " + cell(0) + ", 0",
+        "sub cl, dl",
+        "mov " + cell(d) + ", cl",
+        "mov " + cell(d + 1) + ", dl",
+        "mov " + cell(d + 2) + ", al"};
+    if (copy != 0)
+    {
+        asms.push_back("add " + cell(copy) + ", r11b");
+    }
+    asms.push_back("jmp " + end);
+    return asms;
+}
+std::vector<std::string> asm_mul(const std::string &fallback, const std::string &end,
+                                 int t, int y, int x, int s)
 {
     return {
-        "add rsp, 30000",
-        "mov rax, 60",
-        "xor rdi, rdi",
-        "syscall"};
+        "cmp " + cell(s) + ", 0",
+        "jne " + fallback,
+        "mov al, " + cell(t),
+        "mul " + cell(y),
+        "add " + cell(x) + ", al",
+        "mov " + cell(t) + ", 0",
+        "jmp " + end};
+}
+std::vector<std::string> asm_cmp(const std::string &label, const std::string &fallback,
+                                 const std::string &end, int b, int x, int sign)
+{
+    return {
+        "cmp word" + cell(b + 1).substr(4) + ", 1",
+        "jne " + fallback,
+        "mov al, " + cell(0),
+        "mov " + cell(0) + ", 0",
+        "mov cl, " + cell(b),
+        "test cl, cl",
+        "jz " + label + "_else",
+        "cmp cl, al",
+        "ja " + label + "_else",
+        (sign > 0 ? "inc " : "dec ") + cell(x),
+        "mov " + cell(b) + ", 0",
+        "jmp " + end,
+        label + "_else:",
+        "sub " + cell(b) + ", al",
+        "jmp " + end};
 }
 
-template <typename T>
-void extend(std::vector<T> &vec, const std::vector<T> &ext)
+template <typename T, typename Alloc, typename Ext = std::vector<T>>
+void extend(std::vector<T, Alloc> &vec, const Ext &ext)
 {
-    for (const auto &elem : ext)
-    {
-        vec.push_back(elem);
-    }
+    vec.insert(vec.end(), ext.begin(), ext.end());
 }
 
-std::vector<std::string> assembly(const std::vector<Command> &cmds)
+// a temporary's elements are moved over instead of copied
+template <typename T, typename Alloc>
+void extend(std::vector<T, Alloc> &vec, std::vector<T> &&ext)
 {
-    std::vector<std::string> asms = asm_init();
-    for (size_t i = 0; i < cmds.size(); i++)
-    {
-        const auto &cmd = cmds.at(i);
-        switch (cmd.inst)
-        {
-        case RIGHT:
-            asms.push_back(asm_right());
-            break;
-        case LEFT:
-            asms.push_back(asm_left());
-            break;
-        case PLUS:
-            asms.push_back(asm_incr());
-            break;
-        case MINUS:
-            asms.push_back(asm_decr());
-            break;
-        case PUT:
-            extend(asms, asm_put());
-            break;
-        case GET:
-            extend(asms, asm_get());
-            break;
-        case LOOP:
-            extend(asms, asm_loop(
-                             int_to_label(i),
-                             int_to_label(cmd.jumpTo)));
-            break;
-        case JMP:
-            extend(asms, asm_jmp(
-                             int_to_label(i),
-                             int_to_label(cmd.jumpTo)));
-            break;
-        }
-    }
-    extend(asms, asm_tail());
-    return asms;
+    vec.insert(vec.end(), std::make_move_iterator(ext.begin()), std::make_move_iterator(ext.end()));
 }
 
-std::optional<Instruction> readChar(char c)
+// Where the tape lives. A tape whose extent is proven sits on the stack,
+// sized to the cells the program can touch, with the pointer starting at
+// origin. Otherwise it is mapped with an inaccessible page on each side,
+// so running off either end faults instead of corrupting memory.
+//
+// A sparse tape reserves a huge range without committing it and starts
+// the pointer in the middle. The kernel backs each 4 KiB page on first
+// touch, so cells far apart or left of the start cost only the pages
+// actually used.
+//
+// A tape with a record stride above one is field-major: cell L lives in
+// field L % stride at record L / stride, and r8 holds the record.
+struct TapeLayout
 {
-    switch (c)
+    long long cells = 30000;
+    long long origin = 0;
+    bool guarded = false;
+    bool sparse = false;
+    int stride = 1;
+};
+
+const long long sparseTapeCells = 1LL << 36;
+
+long long roundUp(long long n, long long to)
+{
+    return (n + to - 1) / to * to;
+}
+
+long long tapeRecords(const TapeLayout &tape)
+{
+    return (tape.cells + tape.stride - 1) / tape.stride;
+}
+
+// Distance between fields. A guarded tape keeps an inaccessible page
+// after each field.
+long long fieldSpan(const TapeLayout &tape)
+{
+    return tape.guarded ? roundUp(tapeRecords(tape), 4096) + 4096 : tapeRecords(tape);
+}
+
+// The tape's usable bytes as [start, start + length) ranges from its
+// base: one per field, leaving out the guard pages between them.
+std::vector<std::pair<long long, long long>> tapeRegions(const TapeLayout &tape)
+{
+    if (tape.sparse)
     {
-    case '+':
-        return std::make_optional(PLUS);
-    case '-':
-        return std::make_optional(MINUS);
-    case '>':
-        return std::make_optional(RIGHT);
-    case '<':
-        return std::make_optional(LEFT);
-    case '.':
-        return std::make_optional(PUT);
-    case ',':
-        return std::make_optional(GET);
-    case '[':
-        return std::make_optional(LOOP);
-    case ']':
-        return std::make_optional(JMP);
+        return {{0, roundUp(tape.cells, 4096)}};
     }
-    return std::optional<Instruction>();
+    if (!tape.guarded)
+    {
+        return {{0, tape.stride * fieldSpan(tape)}};
+    }
+    std::vector<std::pair<long long, long long>> regions;
+    for (int field = 0; field < tape.stride; field++)
+    {
+        regions.emplace_back(field * fieldSpan(tape), fieldSpan(tape) - 4096);
+    }
+    return regions;
 }
 
-std::vector<Instruction> readInstructions(const std::string &text)
+std::vector<std::string> asm_init(const TapeLayout &tape, bool keepArgs)
 {
-    std::vector<Instruction> insts;
-    for (const char c : text)
+    std::vector<std::string> asms = {"global _start"};
+    extend(asms, asm_io_data());
+    extend(asms, {"section .text", "_start:"});
+    if (keepArgs)
+    {
+        asms.push_back("mov [ckpt_args], rsp");
+    }
+    const auto record = tape.origin / tape.stride;
+    const auto origin = record == 0 ? "xor r8, r8" : "mov r8, " + std::to_string(record);
+    if (!tape.guarded && !tape.sparse)
+    {
+        extend(asms, {
+                         "sub rsp, " + std::to_string(roundUp(tape.stride * fieldSpan(tape), 16)),
+                         origin});
+        return asms;
+    }
+
+    // mmap, then mprotect all but the guard pages
+    const long long page = 4096;
+    const long long mapped = tape.sparse ? roundUp(tape.cells, page) : tape.stride * fieldSpan(tape) + page;
+    extend(asms, {
+                     "mov rax, 9",
+                     "xor rdi, rdi",
+                     "mov rsi, " + std::to_string(mapped),
+                     tape.sparse ? "mov rdx, 3" : "xor rdx, rdx",
+                     tape.sparse ? "mov r10, 0x4022" : "mov r10, 0x22",
+                     "mov r8, -1",
+                     "xor r9, r9",
+                     "syscall",
+                     "test rax, rax",
+                     "js tape_fail"});
+    if (tape.sparse)
     {
-        auto i = readChar(c);
-        if (i.has_value())
+        asms.push_back("mov rsp, rax");
+    }
+    else
+    {
+        asms.push_back("lea rsp, [rax+" + std::to_string(page) + "]");
+        for (int field = 0; field < tape.stride; field++)
         {
-            insts.push_back(std::move(i.value()));
+            extend(asms, {
+                             "lea rdi, [rsp+" + std::to_string(field * fieldSpan(tape)) + "]",
+                             "mov rsi, " + std::to_string(fieldSpan(tape) - page),
+                             "mov rdx, 3",
+                             "mov rax, 10",
+                             "syscall"});
         }
     }
-    return insts;
+    asms.push_back(origin);
+    return asms;
 }
 
-int main(int argc, char **argv)
+std::vector<std::string> asm_tail(const TapeLayout &tape)
 {
-    if (argc != 2)
+    std::vector<std::string> asms;
+    if (!tape.guarded && !tape.sparse)
     {
-        std::cerr << "usage: bfc <filename>" << std::endl;
-        return 2;
+        asms.push_back("add rsp, " + std::to_string(roundUp(tape.stride * fieldSpan(tape), 16)));
     }
-
-    std::ifstream in(argv[1]);
-    if (!in.is_open())
+    extend(asms, {
+                     "mov r15, io_exit",
+                     "jmp io_finish",
+                     "io_exit:",
+                     "mov rax, 60",
+                     "xor rdi, rdi",
+                     "syscall"});
+    if (tape.guarded || tape.sparse)
     {
-        std::cerr << "could not read " << argv[1] << std::endl;
-        return 1;
+        extend(asms, {
+                         "tape_fail:",
+                         "mov rax, 60",
+                         "mov rdi, 1",
+                         "syscall"});
     }
-    std::stringstream buffer;
-    buffer << in.rdbuf();
-    const auto programText = buffer.str();
+    extend(asms, asm_io_runtime());
+    return asms;
+}
 
-    const auto insts = readInstructions(programText);
-    const auto program = buildProgram(insts);
-    const auto asmcode = assembly(program);
+// How a program is run: compiled to an executable, or in this process.
+enum Engine
+{
+    ENGINE_NATIVE,
+    ENGINE_INTERPRETER,
+    ENGINE_STENCIL,
+    ENGINE_TRACING,
+    ENGINE_SPECULATIVE
+};
 
-    const auto asmName = std::string(argv[1]) + "_out.asm.tmp";
-    const auto objName = std::string(argv[1]) + "_obj.o";
+struct Options
+{
+    std::string filename;
+    bool superopt = false;
+    std::string superoptDb;
+    bool sparseTape = false;
+    bool verifyLayout = false;
+    Engine engine = ENGINE_NATIVE;
+    bool batch = false;
+    int lanes = 16;
+    bool sessions = false;
+    int threads = 0;
+    bool pipe = false;
+    std::vector<std::string> stages;
+    bool forkServer = false;
+    std::string checkpoint;
+    int checkpointEvery = 0;
+    bool resume = false;
+    size_t memoBudget = 0;
+    long long maxSteps = 0;
+    double timeLimit = 0;
+    std::string emitBytecode;
+    // compiler threads; 0 for one per core
+    int jobs = 0;
+    // where units of an incremental build are cached
+    std::string incremental;
+    bool compileStats = false;
+    // --compile-budget: seconds for the build, or 0 for no budget, and
+    // how large the optimizer may grow the program, or 0 for no cap
+    double compileSeconds = 0;
+    size_t compileBytes = 0;
+};
 
-    std::ofstream out(asmName);
-    if (!out.is_open())
+int jobCount(const Options &options)
+{
+    return options.jobs > 0 ? options.jobs : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+}
+
+// Time and heap allocations spent in each stage of a compilation, for
+// --compile-stats. A stage runs from the previous mark to its own.
+class CompileStats
+{
+public:
+    void mark(const std::string &stage)
     {
-        std::cerr << "could not open out.asm" << std::endl;
-        return 1;
+        const auto now = std::chrono::steady_clock::now();
+        const auto allocations = heapAllocations.load();
+        stages.push_back({stage, std::chrono::duration<double, std::milli>(now - last).count(),
+                          allocations - lastAllocations});
+        last = now;
+        lastAllocations = allocations;
     }
 
-    for (const auto &sasm : asmcode)
+    // ends the counting, as what runs next is not compilation
+    void report(std::ostream &os) const
     {
-        out << sasm << std::endl;
+        countingAllocations = false;
+        const auto flags = os.flags();
+        const auto precision = os.precision();
+        double ms = 0;
+        unsigned long long allocations = 0;
+        os << std::left << std::setw(12) << "stage" << std::right << std::setw(12) << "ms"
+           << std::setw(14) << "allocations" << std::endl;
+        for (const auto &stage : stages)
+        {
+            os << std::left << std::setw(12) << stage.name << std::right << std::fixed << std::setprecision(1)
+               << std::setw(12) << stage.ms << std::setw(14) << stage.allocations << std::endl;
+            ms += stage.ms;
+            allocations += stage.allocations;
+        }
+        os << std::left << std::setw(12) << "total" << std::right << std::setw(12) << ms
+           << std::setw(14) << allocations << std::endl;
+        os.flags(flags);
+        os.precision(precision);
     }
 
-    const auto nasmCmd = "nasm -felf64 -o \"" + objName + "\" \"" + asmName + "\"";
-    std::cout << nasmCmd << std::endl;
-    int nasmCode = system(nasmCmd.c_str());
-    if (nasmCode != 0) {
-        std::cerr << "NASM failed." << std::endl;
+private:
+    struct Stage
+    {
+        std::string name;
+        double ms;
+        unsigned long long allocations;
+    };
+
+    std::vector<Stage> stages;
+    std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+    unsigned long long lastAllocations = heapAllocations.load();
+};
+
+// Thrown by an analysis that finds the compile budget spent part way.
+class BudgetSpent : public std::runtime_error
+{
+public:
+    BudgetSpent() : std::runtime_error("compile budget spent") {}
+};
+
+// Bounds for --compile-budget on build time and on how far the
+// optimizer may grow the program.
+//
+// Each pass comes with an estimate of its work. Once a pass has run,
+// later ones are estimated at the time per unit of work taken so far,
+// and a pass that would not fit in the time left is skipped. A pass
+// that runs out of time part way leaves the loop nests it has not got
+// to as they were. A run of nests whose output outgrows its share of
+// the memory cap is also left as it was, which does not depend on
+// timing. What was left out is reported at the end.
+class CompileBudget
+{
+public:
+    CompileBudget(double seconds, size_t bytes)
+        : deadline(std::chrono::steady_clock::now() +
+                   std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                       std::chrono::duration<double>(seconds))),
+          bytes(bytes) {}
+
+    bool spent() const { return std::chrono::steady_clock::now() >= deadline; }
+
+    // Starts the pass if it is expected to fit.
+    bool admit(const std::string &pass, double work)
+    {
+        const double left = std::chrono::duration<double>(deadline - std::chrono::steady_clock::now()).count();
+        const double estimate = work * secondsPerWork;
+        if (left <= 0 || estimate > left)
+        {
+            std::ostringstream reason;
+            reason << std::fixed << std::setprecision(2) << "estimated " << estimate << " s with "
+                   << std::max(left, 0.0) << " s left";
+            skip(pass, left <= 0 ? "out of time" : reason.str());
+            return false;
+        }
+        current = pass;
+        started = std::chrono::steady_clock::now();
+        startedWork = work;
+        return true;
+    }
+
+    // Ends the pass admitted last, refining the time per unit of work.
+    void charge()
+    {
+        totalWork += startedWork;
+        totalSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        secondsPerWork = totalWork > 0 ? totalSeconds / totalWork : 0;
+    }
+
+    // the pass admitted last
+    const std::string &pass() const { return current; }
+
+    // Whether a run of in of total commands may become out commands.
+    bool fits(size_t out, size_t in, size_t total) const
+    {
+        return bytes == 0 || out <= in ||
+               static_cast<double>(out) * sizeof(Command) * total <= static_cast<double>(bytes) * in;
+    }
+
+    void skip(const std::string &pass, const std::string &reason)
+    {
+        notes.push_back({pass, reason, 0, 0, ""});
+    }
+
+    void leftOut(const std::string &pass, const std::string &reason, size_t count, size_t of, const std::string &what)
+    {
+        notes.push_back({pass, reason, count, of, what});
+    }
+
+    // Reports what was left out since the last report.
+    void report(std::ostream &os)
+    {
+        for (; reported < notes.size(); reported++)
+        {
+            const auto &note = notes.at(reported);
+            os << "compile budget: ";
+            if (note.of == 0)
+            {
+                os << "skipped " << note.pass << ", " << note.reason << std::endl;
+            }
+            else
+            {
+                os << note.pass << " left " << note.count << " of " << note.of << " " << note.what << ", "
+                   << note.reason << std::endl;
+            }
+        }
+    }
+
+private:
+    struct Note
+    {
+        std::string pass;
+        std::string reason;
+        size_t count;
+        size_t of;
+        std::string what;
+    };
+
+    std::chrono::steady_clock::time_point deadline;
+    size_t bytes;
+    std::string current;
+    std::chrono::steady_clock::time_point started;
+    double startedWork = 0;
+    double totalWork = 0;
+    double totalSeconds = 0;
+    double secondsPerWork = 0;
+    std::vector<Note> notes;
+    size_t reported = 0;
+};
+
+// Superoptimizer for straight-line segments.
+//
+// A run of +-<> CLEAR SET ADD and MULADD is reduced to its effect, with offsets
+// relative to the pointer on entry. Candidate x86 lowerings of that
+// effect are enumerated (exhaustively when there are few, by random
+// sampling otherwise) and ranked by a cost model. The cheapest one that
+// agrees with the effect on enumerated cell values is used, and kept in
+// an on-disk database keyed by the effect.
+
+enum SegmentKind
+{
+    SEG_ADD,
+    SEG_SET,
+    SEG_MULADD
+};
+
+struct SegmentOp
+{
+    SegmentKind kind;
+    int offset;
+    int src;
+    int value;
+};
+
+struct Segment
+{
+    std::vector<SegmentOp> ops;
+    int move = 0;
+};
+
+bool isStraightLine(Instruction inst)
+{
+    return inst == RIGHT || inst == LEFT || inst == PLUS || inst == MINUS ||
+           inst == CLEAR || inst == SET || inst == ADD || inst == MULADD;
+}
+
+int wrapByte(int value)
+{
+    value = ((value % 256) + 256) % 256;
+    return value > 127 ? value - 256 : value;
+}
+
+// Cells no MULADD reads or writes only need their final value, so they
+// are folded and sorted to the end. The rest keep program order.
+Segment canonicalSegment(const std::vector<Command> &cmds, size_t begin, size_t end)
+{
+    std::vector<SegmentOp> ordered;
+    std::vector<int> linked;
+    int pos = 0;
+    for (size_t i = begin; i < end; i++)
+    {
+        const auto &cmd = cmds.at(i);
+        switch (cmd.inst)
+        {
+        case RIGHT:
+            pos++;
+            break;
+        case LEFT:
+            pos--;
+            break;
+        case PLUS:
+            ordered.push_back({SEG_ADD, pos, 0, 1});
+            break;
+        case MINUS:
+            ordered.push_back({SEG_ADD, pos, 0, -1});
+            break;
+        case CLEAR:
+            ordered.push_back({SEG_SET, pos, 0, 0});
+            break;
+        case SET:
+            ordered.push_back({SEG_SET, pos + cmd.offset, 0, cmd.value});
+            break;
+        case ADD:
+            ordered.push_back({SEG_ADD, pos + cmd.offset, 0, cmd.value});
+            break;
+        case MULADD:
+            ordered.push_back({SEG_MULADD, pos + cmd.offset, pos + cmd.args.at(0), cmd.value});
+            linked.push_back(pos + cmd.args.at(0));
+            linked.push_back(pos + cmd.offset);
+            break;
+        default:
+            break;
+        }
+    }
+
+    Segment seg;
+    seg.move = pos;
+    std::map<int, SegmentOp> folded;
+    for (const auto &op : ordered)
+    {
+        const bool free = std::find(linked.begin(), linked.end(), op.offset) == linked.end();
+        auto &ops = seg.ops;
+        if (free)
+        {
+            auto it = folded.find(op.offset);
+            if (it == folded.end() || op.kind == SEG_SET)
+                folded[op.offset] = op;
+            else
+                it->second.value += op.value;
+        }
+        else if (op.kind != SEG_MULADD && !ops.empty() &&
+                 ops.back().kind != SEG_MULADD && ops.back().offset == op.offset)
+        {
+            if (op.kind == SEG_SET)
+                ops.back() = op;
+            else
+                ops.back().value += op.value;
+        }
+        else
+        {
+            ops.push_back(op);
+        }
+    }
+    for (const auto &[offset, op] : folded)
+    {
+        seg.ops.push_back(op);
+    }
+
+    std::vector<SegmentOp> kept;
+    for (auto op : seg.ops)
+    {
+        op.value = op.kind == SEG_SET ? (op.value % 256 + 256) % 256 : wrapByte(op.value);
+        if (op.kind == SEG_SET || op.value != 0)
+        {
+            kept.push_back(op);
+        }
+    }
+    seg.ops = kept;
+    return seg;
+}
+
+std::string segmentKey(const Segment &seg)
+{
+    std::ostringstream key;
+    key << "m" << seg.move;
+    for (const auto &op : seg.ops)
+    {
+        switch (op.kind)
+        {
+        case SEG_ADD:
+            key << " a" << op.offset << "," << op.value;
+            break;
+        case SEG_SET:
+            key << " s" << op.offset << "," << op.value;
+            break;
+        case SEG_MULADD:
+            key << " x" << op.offset << "," << op.src << "," << op.value;
+            break;
+        }
+    }
+    return key.str();
+}
+
+void applySegment(const Segment &seg, std::map<int, uint8_t> &tape)
+{
+    for (const auto &op : seg.ops)
+    {
+        switch (op.kind)
+        {
+        case SEG_ADD:
+            tape[op.offset] += op.value;
+            break;
+        case SEG_SET:
+            tape[op.offset] = op.value;
+            break;
+        case SEG_MULADD:
+            tape[op.offset] += tape[op.src] * op.value;
+            break;
+        }
+    }
+}
+
+enum X86Kind
+{
+    X_INC,
+    X_DEC,
+    X_ADDI,
+    X_MOVB,
+    X_MOVW,
+    X_MOVD,
+    X_LOAD,
+    X_ADDAL,
+    X_SUBAL,
+    X_MULC,
+    X_ADDCL,
+    X_SUBCL,
+    X_MOVE
+};
+
+struct X86Op
+{
+    X86Kind kind;
+    int offset;
+    long long imm;
+};
+
+bool isLeaFactor(long long factor)
+{
+    return factor == 2 || factor == 3 || factor == 4 || factor == 5 || factor == 8 || factor == 9;
+}
+
+int x86Cost(const X86Op &op)
+{
+    switch (op.kind)
+    {
+    case X_INC:
+    case X_DEC:
+    case X_ADDI:
+    case X_ADDAL:
+    case X_SUBAL:
+    case X_ADDCL:
+    case X_SUBCL:
+        return 3;
+    case X_MULC:
+        return isLeaFactor(op.imm) ? 1 : 3;
+    default:
+        return 1;
+    }
+}
+
+std::string renderX86(const X86Op &op)
+{
+    const auto mem = cell(op.offset);
+    const auto imm = std::to_string(op.imm);
+    switch (op.kind)
+    {
+    case X_INC:
+        return "inc " + mem;
+    case X_DEC:
+        return "dec " + mem;
+    case X_ADDI:
+        return op.imm < 0 ? "sub " + mem + ", " + std::to_string(-op.imm) : "add " + mem + ", " + imm;
+    case X_MOVB:
+        return "mov " + mem + ", " + imm;
+    case X_MOVW:
+        return "mov word" + mem.substr(4) + ", " + imm;
+    case X_MOVD:
+        return "mov dword" + mem.substr(4) + ", " + imm;
+    case X_LOAD:
+        return "movzx eax, " + mem;
+    case X_ADDAL:
+        return "add " + mem + ", al";
+    case X_SUBAL:
+        return "sub " + mem + ", al";
+    case X_MULC:
+        switch (op.imm)
+        {
+        case 2:
+            return "lea ecx, [eax+eax]";
+        case 3:
+            return "lea ecx, [eax+eax*2]";
+        case 4:
+            return "lea ecx, [eax*4]";
+        case 5:
+            return "lea ecx, [eax+eax*4]";
+        case 8:
+            return "lea ecx, [eax*8]";
+        case 9:
+            return "lea ecx, [eax+eax*8]";
+        }
+        return "imul ecx, eax, " + imm;
+    case X_ADDCL:
+        return "add " + mem + ", cl";
+    case X_SUBCL:
+        return "sub " + mem + ", cl";
+    case X_MOVE:
+        if (op.imm == 1)
+            return "inc r8";
+        if (op.imm == -1)
+            return "dec r8";
+        return op.imm < 0 ? "sub r8, " + std::to_string(-op.imm) : "add r8, " + imm;
+    }
+    return "";
+}
+
+void simulateX86(const std::vector<X86Op> &code, std::map<int, uint8_t> &tape, int &move)
+{
+    uint32_t eax = 0, ecx = 0;
+    for (const auto &op : code)
+    {
+        auto &mem = tape[op.offset];
+        switch (op.kind)
+        {
+        case X_INC:
+            mem++;
+            break;
+        case X_DEC:
+            mem--;
+            break;
+        case X_ADDI:
+            mem += op.imm;
+            break;
+        case X_MOVB:
+            mem = op.imm;
+            break;
+        case X_MOVW:
+        case X_MOVD:
+            for (int k = 0; k < (op.kind == X_MOVW ? 2 : 4); k++)
+            {
+                tape[op.offset + k] = (op.imm >> (8 * k)) & 0xff;
+            }
+            break;
+        case X_LOAD:
+            eax = mem;
+            break;
+        case X_ADDAL:
+            mem += eax & 0xff;
+            break;
+        case X_SUBAL:
+            mem -= eax & 0xff;
+            break;
+        case X_MULC:
+            ecx = eax * op.imm;
+            break;
+        case X_ADDCL:
+            mem += ecx & 0xff;
+            break;
+        case X_SUBCL:
+            mem -= ecx & 0xff;
+            break;
+        case X_MOVE:
+            move += op.imm;
+            break;
+        }
+    }
+}
+
+bool verifySegment(const Segment &seg, const std::vector<X86Op> &code)
+{
+    std::vector<int> cells, srcs;
+    for (const auto &op : seg.ops)
+    {
+        cells.push_back(op.offset);
+        if (op.kind == SEG_MULADD)
+        {
+            cells.push_back(op.src);
+            srcs.push_back(op.src);
+        }
+    }
+    for (const auto &op : code)
+    {
+        for (int k = 0; k < (op.kind == X_MOVD ? 4 : op.kind == X_MOVW ? 2 : 1); k++)
+        {
+            cells.push_back(op.offset + k);
+        }
+    }
+
+    std::mt19937 rng(0);
+    auto check = [&](std::optional<std::pair<int, int>> fixed) {
+        std::map<int, uint8_t> expected;
+        for (const int c : cells)
+        {
+            expected[c] = rng() & 0xff;
+        }
+        if (fixed.has_value())
+        {
+            expected[fixed->first] = fixed->second;
+        }
+        auto actual = expected;
+        int move = 0;
+        applySegment(seg, expected);
+        simulateX86(code, actual, move);
+        return expected == actual && move == seg.move;
+    };
+
+    // every value of each cell a MULADD reads, with the rest random
+    for (const int src : srcs)
+    {
+        for (int v = 0; v < 256; v++)
+        {
+            if (!check(std::make_pair(src, v)))
+                return false;
+        }
+    }
+    for (int trial = 0; trial < 64; trial++)
+    {
+        if (!check(std::nullopt))
+            return false;
+    }
+    return true;
+}
+
+// Ways to store a run of adjacent constant cells with 1, 2 and 4 byte
+// moves, listed as the piece sizes in order.
+std::vector<std::vector<int>> storeSplits(int length)
+{
+    if (length == 0)
+        return {{}};
+    std::vector<std::vector<int>> splits;
+    for (const int piece : {4, 2, 1})
+    {
+        if (piece > length)
+            continue;
+        for (auto rest : storeSplits(length - piece))
+        {
+            rest.insert(rest.begin(), piece);
+            splits.push_back(rest);
+        }
+    }
+    return splits;
+}
+
+// A unit is one op, or a run of SETs to adjacent cells, with the
+// alternative lowerings the search chooses from.
+struct SegmentUnit
+{
+    std::vector<SegmentOp> ops;
+    std::vector<std::vector<int>> splits;
+    size_t alternatives;
+};
+
+std::vector<SegmentUnit> segmentUnits(const Segment &seg)
+{
+    std::vector<SegmentUnit> units;
+    for (const auto &op : seg.ops)
+    {
+        if (op.kind == SEG_SET && !units.empty() && units.back().ops.back().kind == SEG_SET &&
+            units.back().ops.back().offset + 1 == op.offset)
+        {
+            units.back().ops.push_back(op);
+            continue;
+        }
+        units.push_back({{op}, {}, 1});
+    }
+    for (auto &unit : units)
+    {
+        const auto &op = unit.ops.front();
+        if (op.kind == SEG_SET)
+        {
+            unit.splits = storeSplits(unit.ops.size());
+            unit.alternatives = unit.splits.size();
+        }
+        else if (op.kind == SEG_ADD)
+        {
+            // add/sub immediate, or inc/dec when it is one step
+            unit.alternatives = std::abs(op.value) == 1 ? 2 : 1;
+        }
+        else if (std::abs(op.value) != 1)
+        {
+            // multiply into ecx, or add al repeatedly
+            unit.alternatives = std::abs(op.value) <= 4 ? 2 : 1;
+        }
+    }
+    return units;
+}
+
+std::vector<X86Op> lowerSegment(const Segment &seg, const std::vector<SegmentUnit> &units,
+                                const std::vector<size_t> &choice)
+{
+    std::vector<X86Op> code;
+    // the cell eax holds, if any
+    bool haveLoaded = false;
+    int loaded = 0;
+    auto written = [&](int offset, int width) {
+        if (loaded >= offset && loaded < offset + width)
+            haveLoaded = false;
+    };
+    for (size_t u = 0; u < units.size(); u++)
+    {
+        const auto &unit = units.at(u);
+        const auto &op = unit.ops.front();
+        if (op.kind == SEG_SET)
+        {
+            size_t k = 0;
+            for (const int piece : unit.splits.at(choice.at(u)))
+            {
+                long long imm = 0;
+                for (int b = piece - 1; b >= 0; b--)
+                {
+                    imm = (imm << 8) | unit.ops.at(k + b).value;
+                }
+                const auto kind = piece == 4 ? X_MOVD : piece == 2 ? X_MOVW : X_MOVB;
+                code.push_back({kind, unit.ops.at(k).offset, imm});
+                written(unit.ops.at(k).offset, piece);
+                k += piece;
+            }
+        }
+        else if (op.kind == SEG_ADD)
+        {
+            if (choice.at(u) == 1)
+                code.push_back({op.value > 0 ? X_INC : X_DEC, op.offset, 0});
+            else
+                code.push_back({X_ADDI, op.offset, op.value});
+            written(op.offset, 1);
+        }
+        else
+        {
+            if (!haveLoaded || loaded != op.src)
+            {
+                code.push_back({X_LOAD, op.src, 0});
+                haveLoaded = true;
+                loaded = op.src;
+            }
+            const int factor = std::abs(op.value);
+            if (factor == 1)
+            {
+                code.push_back({op.value > 0 ? X_ADDAL : X_SUBAL, op.offset, 0});
+            }
+            else if (choice.at(u) == 1)
+            {
+                for (int k = 0; k < factor; k++)
+                {
+                    code.push_back({op.value > 0 ? X_ADDAL : X_SUBAL, op.offset, 0});
+                }
+            }
+            else
+            {
+                code.push_back({X_MULC, 0, factor});
+                code.push_back({op.value > 0 ? X_ADDCL : X_SUBCL, op.offset, 0});
+            }
+            written(op.offset, 1);
+        }
+    }
+    if (seg.move != 0)
+    {
+        code.push_back({X_MOVE, 0, seg.move});
+    }
+    return code;
+}
+
+class SuperoptDb
+{
+public:
+    explicit SuperoptDb(const std::string &path) : path(path)
+    {
+        std::ifstream in(path);
+        std::string line;
+        while (std::getline(in, line))
+        {
+            const auto tab = line.find('\t');
+            if (tab == std::string::npos)
+                continue;
+            std::vector<std::string> asms;
+            std::istringstream rest(line.substr(tab + 1));
+            std::string sasm;
+            while (std::getline(rest, sasm, '|'))
+            {
+                asms.push_back(sasm);
+            }
+            entries[line.substr(0, tab)] = asms;
+        }
+    }
+
+    // safe to call from several threads at once, like insert
+    std::optional<std::vector<std::string>> lookup(const std::string &key) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto it = entries.find(key);
+        if (it == entries.end())
+            return std::nullopt;
+        return it->second;
+    }
+
+    void insert(const std::string &key, const std::vector<std::string> &asms)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries[key] = asms;
+        dirty = true;
+    }
+
+    // Written to a temporary and renamed, so concurrent compiles never
+    // see a torn file.
+    void save() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!dirty)
+            return;
+        const fs::path target(path);
+        if (target.has_parent_path())
+        {
+            std::error_code ec;
+            fs::create_directories(target.parent_path(), ec);
+        }
+        const auto tmp = path + ".tmp" + std::to_string(getpid());
+        std::ofstream out(tmp);
+        if (!out.is_open())
+        {
+            std::cerr << "could not write " << path << std::endl;
+            return;
+        }
+        for (const auto &[key, asms] : entries)
+        {
+            out << key << '\t';
+            for (size_t i = 0; i < asms.size(); i++)
+            {
+                out << (i == 0 ? "" : "|") << asms.at(i);
+            }
+            out << '\n';
+        }
+        out.close();
+        std::error_code ec;
+        fs::rename(tmp, path, ec);
+    }
+
+private:
+    std::string path;
+    std::map<std::string, std::vector<std::string>> entries;
+    bool dirty = false;
+    mutable std::mutex mutex;
+};
+
+std::string defaultSuperoptDb()
+{
+    if (const char *cache = std::getenv("XDG_CACHE_HOME"))
+        return (fs::path(cache) / "bfc" / "superopt.db").string();
+    if (const char *home = std::getenv("HOME"))
+        return (fs::path(home) / ".cache" / "bfc" / "superopt.db").string();
+    return "bfc-superopt.db";
+}
+
+std::optional<std::vector<std::string>> superoptimize(const Segment &seg, SuperoptDb &db)
+{
+    const auto key = segmentKey(seg);
+    if (const auto cached = db.lookup(key))
+    {
+        return cached;
+    }
+
+    const auto units = segmentUnits(seg);
+    size_t space = 1;
+    for (const auto &unit : units)
+    {
+        space = std::min<size_t>(space * unit.alternatives, 1 << 20);
+    }
+
+    const size_t budget = 4096;
+    std::vector<std::pair<int, std::vector<size_t>>> candidates;
+    auto consider = [&](const std::vector<size_t> &choice) {
+        int cost = 0;
+        for (const auto &op : lowerSegment(seg, units, choice))
+        {
+            cost += x86Cost(op);
+        }
+        candidates.emplace_back(cost, choice);
+    };
+    std::vector<size_t> choice(units.size(), 0);
+    if (space <= budget)
+    {
+        for (size_t n = 0; n < space; n++)
+        {
+            size_t rest = n;
+            for (size_t u = 0; u < units.size(); u++)
+            {
+                choice.at(u) = rest % units.at(u).alternatives;
+                rest /= units.at(u).alternatives;
+            }
+            consider(choice);
+        }
+    }
+    else
+    {
+        std::mt19937 rng(std::hash<std::string>()(key));
+        consider(choice);
+        for (size_t n = 0; n < budget; n++)
+        {
+            for (size_t u = 0; u < units.size(); u++)
+            {
+                choice.at(u) = rng() % units.at(u).alternatives;
+            }
+            consider(choice);
+        }
+    }
+
+    std::stable_sort(candidates.begin(), candidates.end(),
+                     [](const auto &a, const auto &b) { return a.first < b.first; });
+    for (const auto &[cost, best] : candidates)
+    {
+        const auto code = lowerSegment(seg, units, best);
+        if (!verifySegment(seg, code))
+        {
+            continue;
+        }
+        std::vector<std::string> asms;
+        for (const auto &op : code)
+        {
+            asms.push_back(renderX86(op));
+        }
+        db.insert(key, asms);
+        return asms;
+    }
+    return std::nullopt;
+}
+
+// Fork server, driven as AFL drives one: control on fd 198, status on
+// fd 199. Once the tape is set up and the I/O-free prefix has run, the
+// program says hello on the status pipe, then for each 4-byte request
+// on the control pipe forks a child to run the rest, reports its pid,
+// waits for it and reports its wait status. Without the pipes the hello
+// fails and the program just runs. Each child sets up its own I/O, so
+// none of it is shared with the server or other runs.
+std::vector<std::string> asm_fork_server()
+{
+    return {
+        "section .data",
+        "fs_word: dq 0",
+        "fs_pid: dq 0",
+        "section .text",
+        "mov rax, 1",
+        "mov rdi, 199",
+        "mov rsi, fs_word",
+        "mov rdx, 4",
+        "syscall",
+        "cmp rax, 4",
+        "jne fs_child",
+        "fs_loop:",
+        "xor eax, eax",
+        "mov rdi, 198",
+        "mov rsi, fs_word",
+        "mov rdx, 4",
+        "syscall",
+        "cmp rax, 4",
+        "jne fs_exit",
+        "mov rax, 57",
+        "syscall",
+        "test rax, rax",
+        "js fs_exit",
+        "jz fs_close",
+        "mov [fs_pid], rax",
+        "mov [fs_word], eax",
+        "mov rax, 1",
+        "mov rdi, 199",
+        "mov rsi, fs_word",
+        "mov rdx, 4",
+        "syscall",
+        "mov rdi, [fs_pid]",
+        "mov rsi, fs_word",
+        "xor edx, edx",
+        "xor r10d, r10d",
+        "mov rax, 61",
+        "syscall",
+        "mov rax, 1",
+        "mov rdi, 199",
+        "mov rsi, fs_word",
+        "mov rdx, 4",
+        "syscall",
+        "jmp fs_loop",
+        "fs_exit:",
+        "mov rax, 60",
+        "xor rdi, rdi",
+        "syscall",
+        "fs_close:",
+        "mov rdi, 198",
+        "mov rax, 3",
+        "syscall",
+        "mov rdi, 199",
+        "mov rax, 3",
+        "syscall",
+        "fs_child:"};
+}
+
+// Where a fork server can wait: the first top-level command from which
+// the program may read or write. A loop, with an idiom op in front of
+// it, counts as a whole.
+size_t forkPoint(const std::vector<Command> &cmds)
+{
+    for (size_t i = 0; i < cmds.size(); i++)
+    {
+        const auto inst = cmds.at(i).inst;
+        const bool spans = inst == LOOP || inst == DIVMOD || inst == MUL || inst == CMP;
+        const auto end = spans ? cmds.at(i).jumpTo : i;
+        for (size_t j = i; j <= end; j++)
+        {
+            if (cmds.at(j).inst == PUT || cmds.at(j).inst == GET)
+            {
+                return i;
+            }
+        }
+        i = end;
+    }
+    return cmds.size();
+}
+
+std::string asm_bytes(const std::string &text)
+{
+    std::string bytes = "db ";
+    for (const auto c : text)
+    {
+        bytes += std::to_string(static_cast<uint8_t>(c)) + ", ";
+    }
+    return bytes + "0";
+}
+
+// Signal handlers for generated code run on a stack of their own, since
+// the tape may be where the stack would be, and return through
+// sig_restorer. An action is handler, flags, restorer and mask; the
+// flags are SA_RESTORER | SA_ONSTACK | SA_RESTART.
+const std::string signalFlags = "0x1c000000";
+
+std::vector<std::string> asm_signals()
+{
+    return {
+        "section .bss",
+        "alignb 16",
+        "sig_stack_area: resb 16384",
+        "section .data",
+        "sig_stack: dq sig_stack_area, 0, 16384",
+        "section .text",
+        "sig_restorer:",
+        "mov rax, 15",
+        "syscall"};
+}
+
+std::vector<std::string> asm_signals_init()
+{
+    return {
+        "mov rax, 131",
+        "mov rdi, sig_stack",
+        "xor esi, esi",
+        "syscall"};
+}
+
+// Run budgets for generated code. Every back edge taken takes the length
+// of its loop off budget_left, and the run ends once that goes negative:
+// output is flushed, the reason written to stderr, and the exit status
+// is 3. A time limit is a timer on the monotonic clock whose SIGXCPU
+// handler sets budget_left negative, so the same check catches it.
+const int budgetExitStatus = 3;
+
+// A loop's back edge with the charge between the exit test and the
+// jump, so leaving the loop costs nothing, as in the interpreter.
+std::vector<std::string> asm_budget_check(const std::string &label, const std::string &jmpTo,
+                                          int offset, long long cost)
+{
+    return {
+        "mov r10b, " + cell(offset),
+        "test r10b, r10b",
+        "jz " + label,
+        "sub qword [budget_left], " + std::to_string(cost),
+        "jl budget_out",
+        "jmp " + jmpTo + "_body",
+        label + ":"};
+}
+
+std::vector<std::string> asm_budget_init(double seconds)
+{
+    if (seconds <= 0)
+    {
+        return {};
+    }
+    const auto whole = static_cast<long long>(seconds);
+    const auto nanos = static_cast<long long>((seconds - whole) * 1e9);
+    return {
+        "section .data",
+        "budget_timer: dq 0",
+        // SIGEV_SIGNAL with SIGXCPU
+        "budget_event: dq 0",
+        "dd 24, 0",
+        "dq 0, 0, 0, 0, 0, 0",
+        "budget_expiry: dq 0, 0, " + std::to_string(whole) + ", " + std::to_string(nanos),
+        "budget_action: dq budget_handler, " + signalFlags + ", sig_restorer, 0",
+        "section .text",
+        "mov rax, 13",
+        "mov rdi, 24",
+        "mov rsi, budget_action",
+        "xor edx, edx",
+        "mov r10, 8",
+        "syscall",
+        "mov rax, 222",
+        "mov rdi, 1",
+        "mov rsi, budget_event",
+        "mov rdx, budget_timer",
+        "syscall",
+        "mov rax, 223",
+        "mov edi, [budget_timer]",
+        "xor esi, esi",
+        "mov rdx, budget_expiry",
+        "xor r10d, r10d",
+        "syscall"};
+}
+
+std::vector<std::string> asm_budget(long long steps)
+{
+    const std::string stepsOut = "step budget exceeded\n";
+    const std::string timeOut = "time limit exceeded\n";
+    return {
+        "section .data",
+        "budget_left: dq " + std::to_string(steps > 0 ? steps : std::numeric_limits<long long>::max()),
+        "budget_timed_out: dq 0",
+        "budget_steps_message: " + asm_bytes(stepsOut),
+        "budget_time_message: " + asm_bytes(timeOut),
+        "section .text",
+        "budget_handler:",
+        "mov qword [budget_timed_out], 1",
+        "mov qword [budget_left], -1",
+        "ret",
+        "budget_out:",
+        "mov r15, budget_report",
+        "jmp io_finish",
+        "budget_report:",
+        "mov rsi, budget_steps_message",
+        "mov rdx, " + std::to_string(stepsOut.size()),
+        "cmp qword [budget_timed_out], 0",
+        "je budget_write",
+        "mov rsi, budget_time_message",
+        "mov rdx, " + std::to_string(timeOut.size()),
+        "budget_write:",
+        "mov rax, 1",
+        "mov rdi, 2",
+        "syscall",
+        // exit_group: io_uring may have worker threads
+        "mov rax, 231",
+        "mov rdi, " + std::to_string(budgetExitStatus),
+        "syscall"};
+}
+
+// Checkpoints.
+//
+// A snapshot holds what it takes to pick a run up again: the command it
+// stopped at, always a loop's back edge, the pointer, how much input was
+// read and output written, and then the tape as runs of offset, length
+// and bytes. Generated code and the interpreter write the same format,
+// so either resumes the other's snapshot of the same program. A resumed
+// run seeks its input and output back to where the snapshot left them;
+// pipes cannot seek, so there it reads and writes on from where they are.
+// Its output should be the file the stopped run wrote, opened without
+// truncating it (1<>file): a > redirect empties the file, and the output
+// from before the snapshot then reads back as zero bytes.
+const uint32_t snapshotMagic = 0x4b434642;
+const uint32_t snapshotVersion = 1;
+
+struct SnapshotHeader
+{
+    uint32_t magic = snapshotMagic;
+    uint32_t version = snapshotVersion;
+    uint64_t pc = 0;
+    int64_t pointer = 0;
+    uint64_t input = 0;
+    uint64_t output = 0;
+    uint64_t last = 0;
+    uint64_t eof = 0;
+    uint64_t program = 0;
+};
+
+// Tells programs and tape layouts apart, so a snapshot is only resumed
+// by what took it.
+uint64_t programFingerprint(const std::vector<Command> &cmds, const TapeLayout &tape)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    const auto mix = [&](long long value)
+    {
+        hash = (hash ^ static_cast<uint64_t>(value)) * 0x100000001b3;
+    };
+    for (const auto &cmd : cmds)
+    {
+        mix(cmd.inst);
+        mix(cmd.jumpTo);
+        mix(cmd.offset);
+        mix(cmd.value);
+        for (const auto arg : cmd.args)
+        {
+            mix(arg);
+        }
+    }
+    for (const auto &[start, length] : tapeRegions(tape))
+    {
+        mix(start);
+        mix(length);
+    }
+    mix(tape.origin);
+    mix(tape.stride);
+    return hash;
+}
+
+// Generated code checks a flag at every loop back edge, set from a
+// SIGUSR1 or SIGALRM handler. ckpt_save flushes
+// output, writes the snapshot to a temporary file and renames it over
+// the last one. Run with --resume, the program loads the snapshot once
+// its I/O is set up and jumps to the back edge it was taken at, through
+// a table of safepoints by command index.
+std::vector<std::string> asm_safepoint(const std::string &label, size_t index)
+{
+    return {
+        "cmp qword [ckpt_flag], 0",
+        "je " + label + "_safe",
+        "mov qword [ckpt_pc], " + std::to_string(index),
+        "mov r15, " + label + "_safe",
+        "jmp ckpt_save",
+        label + "_safe:"};
+}
+
+std::vector<std::string> asm_checkpoint_init(int every)
+{
+    const auto seconds = std::to_string(every);
+    std::vector<std::string> asms = {
+        "section .data",
+        "ckpt_timer: dq " + seconds + ", 0, " + seconds + ", 0",
+        "section .text",
+        "mov rax, 13",
+        "mov rdi, 10",
+        "mov rsi, ckpt_action",
+        "xor edx, edx",
+        "mov r10, 8",
+        "syscall"};
+    if (every > 0)
+    {
+        extend(asms, {
+                         "mov rax, 13",
+                         "mov rdi, 14",
+                         "mov rsi, ckpt_action",
+                         "xor edx, edx",
+                         "mov r10, 8",
+                         "syscall",
+                         "mov rax, 38",
+                         "xor edi, edi",
+                         "mov rsi, ckpt_timer",
+                         "xor edx, edx",
+                         "syscall"});
+    }
+    extend(asms, {
+                     // resume when the only argument is --resume
+                     "mov rsi, [ckpt_args]",
+                     "cmp qword [rsi], 2",
+                     "jne ckpt_start",
+                     "mov rsi, [rsi+16]",
+                     "mov rdi, ckpt_resume",
+                     "ckpt_argument:",
+                     "mov al, [rsi]",
+                     "cmp al, [rdi]",
+                     "jne ckpt_start",
+                     "inc rsi",
+                     "inc rdi",
+                     "test al, al",
+                     "jnz ckpt_argument",
+                     "jmp ckpt_restore",
+                     "ckpt_start:"});
+    return asms;
+}
+
+std::vector<std::string> asm_checkpoint(const std::vector<Command> &cmds, const TapeLayout &tape,
+                                        const std::string &path)
+{
+    const auto regions = tapeRegions(tape);
+    const auto error = path + ": not a snapshot of this program\n";
+    std::stringstream fingerprint;
+    fingerprint << "0x" << std::hex << programFingerprint(cmds, tape);
+    std::vector<std::string> asms = {
+        "section .data",
+        "ckpt_flag: dq 0",
+        "ckpt_pc: dq 0",
+        "ckpt_ret: dq 0",
+        "ckpt_fd: dq 0",
+        "ckpt_args: dq 0",
+        "ckpt_run: dq 0, 0",
+        "ckpt_head: dd " + std::to_string(snapshotMagic) + ", " + std::to_string(snapshotVersion),
+        "dq 0, 0, 0, 0, 0, 0, " + fingerprint.str(),
+        "ckpt_action: dq ckpt_handler, " + signalFlags + ", sig_restorer, 0",
+        "ckpt_path: " + asm_bytes(path),
+        "ckpt_temporary: " + asm_bytes(path + ".tmp"),
+        "ckpt_resume: " + asm_bytes("--resume"),
+        "ckpt_error: " + asm_bytes(error),
+        "ckpt_table:"};
+    for (size_t i = 0; i < cmds.size(); i++)
+    {
+        asms.push_back(cmds.at(i).inst == JMP ? "dq " + int_to_label(i) + "_safe" : "dq 0");
+    }
+    extend(asms, {
+                     "section .text",
+                     "ckpt_handler:",
+                     "mov qword [ckpt_flag], 1",
+                     "ret",
+
+                     // ckpt_save: snapshots the run, the pc in ckpt_pc
+                     "ckpt_save:",
+                     "mov qword [ckpt_flag], 0",
+                     "mov [ckpt_ret], r15",
+                     "mov r15, ckpt_write",
+                     "jmp io_finish",
+                     "ckpt_write:",
+                     "mov [ckpt_head+16], r8",
+                     "mov rax, [ckpt_pc]",
+                     "mov [ckpt_head+8], rax",
+                     "mov rax, [in_base]",
+                     "cmp qword [in_eof], 0",
+                     "jne ckpt_write_input",
+                     "add rax, [in_pos]",
+                     "ckpt_write_input:",
+                     "mov [ckpt_head+24], rax",
+                     "mov rax, [out_total]",
+                     "mov [ckpt_head+32], rax",
+                     "mov rax, [in_last]",
+                     "mov [ckpt_head+40], rax",
+                     "mov rax, [in_eof]",
+                     "mov [ckpt_head+48], rax",
+                     "mov rax, 2",
+                     "mov rdi, ckpt_temporary",
+                     "mov rsi, 0x241",
+                     "mov rdx, 0644o",
+                     "syscall",
+                     "test rax, rax",
+                     "js ckpt_saved",
+                     "mov [ckpt_fd], rax",
+                     "mov rsi, ckpt_head",
+                     "mov rdx, 64",
+                     "mov r12, ckpt_write_tape0",
+                     "jmp ckpt_write_all"});
+    for (size_t k = 0; k < regions.size(); k++)
+    {
+        const auto here = "ckpt_write_tape" + std::to_string(k);
+        const auto start = std::to_string(regions.at(k).first);
+        extend(asms, {
+                         here + ":",
+                         "test rdx, rdx",
+                         "jnz ckpt_write_fail",
+                         "mov qword [ckpt_run], " + start,
+                         "mov qword [ckpt_run+8], " + std::to_string(regions.at(k).second),
+                         "mov rsi, ckpt_run",
+                         "mov rdx, 16",
+                         "mov r12, " + here + "_bytes",
+                         "jmp ckpt_write_all",
+                         here + "_bytes:",
+                         "test rdx, rdx",
+                         "jnz ckpt_write_fail",
+                         "lea rsi, [rsp+" + start + "]",
+                         "mov rdx, " + std::to_string(regions.at(k).second),
+                         "mov r12, ckpt_write_tape" + std::to_string(k + 1),
+                         "jmp ckpt_write_all"});
+    }
+    extend(asms, {
+                     "ckpt_write_tape" + std::to_string(regions.size()) + ":",
+                     "test rdx, rdx",
+                     "jnz ckpt_write_fail",
+                     "mov rdi, [ckpt_fd]",
+                     "mov rax, 74",
+                     "syscall",
+                     "mov rdi, [ckpt_fd]",
+                     "mov rax, 3",
+                     "syscall",
+                     "mov rax, 82",
+                     "mov rdi, ckpt_temporary",
+                     "mov rsi, ckpt_path",
+                     "syscall",
+                     "jmp ckpt_saved",
+                     "ckpt_write_fail:",
+                     "mov rdi, [ckpt_fd]",
+                     "mov rax, 3",
+                     "syscall",
+                     "mov rax, 87",
+                     "mov rdi, ckpt_temporary",
+                     "syscall",
+                     "ckpt_saved:",
+                     "mov r8, [ckpt_head+16]",
+                     "mov r15, [ckpt_ret]",
+                     "jmp r15",
+
+                     // ckpt_write_all and ckpt_read_all: move rdx bytes at
+                     // rsi to or from the snapshot, leaving in rdx what an
+                     // error or the end of the file cut short
+                     "ckpt_write_all:",
+                     "mov eax, 1",
+                     "jmp ckpt_transfer",
+                     "ckpt_read_all:",
+                     "xor eax, eax",
+                     "ckpt_transfer:",
+                     "mov r9, rax",
+                     "ckpt_transfer_next:",
+                     "test rdx, rdx",
+                     "jz ckpt_transfer_done",
+                     "mov rax, r9",
+                     "mov rdi, [ckpt_fd]",
+                     "syscall",
+                     "test rax, rax",
+                     "jle ckpt_transfer_done",
+                     "add rsi, rax",
+                     "sub rdx, rax",
+                     "jmp ckpt_transfer_next",
+                     "ckpt_transfer_done:",
+                     "jmp r12",
+
+                     // ckpt_restore: loads the snapshot and jumps to its
+                     // safepoint
+                     "ckpt_restore:",
+                     "mov rax, 2",
+                     "mov rdi, ckpt_path",
+                     "xor esi, esi",
+                     "syscall",
+                     "test rax, rax",
+                     "js ckpt_bad",
+                     "mov [ckpt_fd], rax",
+                     "mov rsi, ckpt_head",
+                     "mov rdx, 64",
+                     "mov r12, ckpt_restore_head",
+                     "jmp ckpt_read_all",
+                     "ckpt_restore_head:",
+                     "test rdx, rdx",
+                     "jnz ckpt_bad",
+                     "cmp dword [ckpt_head], " + std::to_string(snapshotMagic),
+                     "jne ckpt_bad",
+                     "cmp dword [ckpt_head+4], " + std::to_string(snapshotVersion),
+                     "jne ckpt_bad",
+                     "mov rax, " + fingerprint.str(),
+                     "cmp rax, [ckpt_head+56]",
+                     "jne ckpt_bad",
+                     "ckpt_restore_run:",
+                     "mov rsi, ckpt_run",
+                     "mov rdx, 16",
+                     "mov r12, ckpt_restore_bytes",
+                     "jmp ckpt_read_all",
+                     "ckpt_restore_bytes:",
+                     "cmp rdx, 16",
+                     "je ckpt_restore_done",
+                     "test rdx, rdx",
+                     "jnz ckpt_bad",
+                     "mov rax, [ckpt_run]",
+                     "mov rdx, [ckpt_run+8]",
+                     "lea rcx, [rax+rdx]",
+                     "cmp rcx, rax",
+                     "jb ckpt_bad"});
+    // a run has to lie within one region of the tape
+    for (const auto &[start, length] : regions)
+    {
+        const auto next = "ckpt_region" + std::to_string(start);
+        extend(asms, {
+                         "cmp rax, " + std::to_string(start),
+                         "jb " + next,
+                         "cmp rcx, " + std::to_string(start + length),
+                         "jbe ckpt_restore_region",
+                         next + ":"});
+    }
+    extend(asms, {
+                     "jmp ckpt_bad",
+                     "ckpt_restore_region:",
+                     "lea rsi, [rsp+rax]",
+                     "mov r12, ckpt_restore_read",
+                     "jmp ckpt_read_all",
+                     "ckpt_restore_read:",
+                     "test rdx, rdx",
+                     "jnz ckpt_bad",
+                     "jmp ckpt_restore_run",
+                     "ckpt_restore_done:",
+                     "mov rdi, [ckpt_fd]",
+                     "mov rax, 3",
+                     "syscall",
+                     "mov rax, 8",
+                     "xor edi, edi",
+                     "mov rsi, [ckpt_head+24]",
+                     "xor edx, edx",
+                     "syscall",
+                     "mov rax, [ckpt_head+24]",
+                     "mov [in_base], rax",
+                     "mov rax, [ckpt_head+40]",
+                     "mov [in_last], rax",
+                     "cmp qword [ckpt_head+48], 0",
+                     "je ckpt_restore_output",
+                     "mov qword [in_eof], 1",
+                     "mov rsi, [in_buf]",
+                     "mov [rsi], al",
+                     "mov qword [in_len], 1",
+                     "mov qword [in_pos], 0",
+                     "ckpt_restore_output:",
+                     "mov rax, 77",
+                     "mov rdi, 1",
+                     "mov rsi, [ckpt_head+32]",
+                     "syscall",
+                     "test rax, rax",
+                     "jnz ckpt_restore_jump",
+                     "mov rax, 8",
+                     "mov rdi, 1",
+                     "mov rsi, [ckpt_head+32]",
+                     "xor edx, edx",
+                     "syscall",
+                     "ckpt_restore_jump:",
+                     "mov rax, [ckpt_head+32]",
+                     "mov [out_total], rax",
+                     "mov r8, [ckpt_head+16]",
+                     "mov rax, [ckpt_head+8]",
+                     "cmp rax, " + std::to_string(cmds.size()),
+                     "jae ckpt_bad",
+                     "mov rax, [ckpt_table+rax*8]",
+                     "test rax, rax",
+                     "jz ckpt_bad",
+                     "jmp rax",
+                     "ckpt_bad:",
+                     "mov rax, 1",
+                     "mov rdi, 2",
+                     "mov rsi, ckpt_error",
+                     "mov rdx, " + std::to_string(error.size()),
+                     "syscall",
+                     "mov rax, 231",
+                     "mov rdi, 1",
+                     "syscall"});
+    return asms;
+}
+
+// Incremental builds assemble top-level loop nests apart from the rest,
+// in units, each an object of its own cached by its text. A unit is
+// entered from the main object and jumps back to it, so units can sit
+// anywhere in the executable and an edit only reassembles the units it
+// touched.
+struct NativeUnit
+{
+    std::string name;
+    std::vector<std::string> asms;
+};
+
+// what code for commands refers to in the main object
+const std::vector<std::string> nativeUnitSymbols = {
+    "in_buf", "in_pos", "in_len", "io_refill",
+    "out_buf", "out_len", "io_flush",
+    "budget_left", "budget_out"};
+
+std::vector<std::string> nativeUnitGlobals(bool budget)
+{
+    std::vector<std::string> asms;
+    for (const auto &symbol : nativeUnitSymbols)
+    {
+        if (budget || symbol.rfind("budget_", 0) != 0)
+        {
+            asms.push_back("global " + symbol);
+        }
+    }
+    return asms;
+}
+
+std::string hexFingerprint(const std::vector<std::string> &lines)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    for (const auto &line : lines)
+    {
+        for (const char c : line + "\n")
+        {
+            hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3;
+        }
+    }
+    std::ostringstream hex;
+    hex << std::hex << std::setw(16) << std::setfill('0') << hash;
+    return hex.str();
+}
+
+// Splits the program into units of whole top-level loop nests, each with
+// the commands in front of it. A unit ends after a nest whose commands
+// hash to 0 mod 16, or after 64 nests. That depends on the nests alone,
+// not on where they sit, so after an edit the cuts fall where they did
+// again within a unit or two.
+std::vector<std::pair<size_t, size_t>> nativeUnits(const std::vector<Command> &cmds)
+{
+    const size_t cutEvery = 16;
+    const size_t maxNests = 64;
+    std::vector<std::pair<size_t, size_t>> units;
+    size_t begin = 0, nests = 0;
+    uint64_t hash = 0xcbf29ce484222325;
+    const auto mix = [&](long long value)
+    {
+        hash = (hash ^ static_cast<uint64_t>(value)) * 0x100000001b3;
+    };
+    int depth = 0;
+    for (size_t i = 0; i < cmds.size(); i++)
+    {
+        const auto &cmd = cmds.at(i);
+        mix(cmd.inst);
+        mix(cmd.offset);
+        mix(cmd.value);
+        for (const auto arg : cmd.args)
+        {
+            mix(arg);
+        }
+        depth += cmd.inst == LOOP ? 1 : cmd.inst == JMP ? -1 : 0;
+        if (cmd.inst != JMP || depth != 0)
+        {
+            continue;
+        }
+        nests++;
+        if (hash % cutEvery == 0 || nests == maxNests)
+        {
+            units.emplace_back(begin, i + 1);
+            begin = i + 1;
+            nests = 0;
+            hash = 0xcbf29ce484222325;
+        }
+    }
+    if (begin < cmds.size())
+    {
+        units.emplace_back(begin, cmds.size());
+    }
+    return units;
+}
+
+// pointer step of a loop whose body only moves the pointer, or 0
+long long scanStep(const std::vector<Command> &cmds, size_t loop)
+{
+    long long step = 0;
+    for (size_t j = loop + 1; j < cmds.at(loop).jumpTo; j++)
+    {
+        const auto inst = cmds.at(j).inst;
+        if (inst != RIGHT && inst != LEFT)
+        {
+            return 0;
+        }
+        step += inst == RIGHT ? 1 : -1;
+    }
+    return cmds.at(cmds.at(loop).jumpTo).offset == cmds.at(loop).offset ? step : 0;
+}
+
+std::vector<std::string> assembly(const std::vector<Command> &cmds, const Options &options,
+                                  const TapeLayout &tape, std::vector<NativeUnit> *units = nullptr,
+                                  CompileBudget *compileBudget = nullptr)
+{
+    const bool checkpoint = !options.checkpoint.empty();
+    const bool budget = options.maxSteps > 0 || options.timeLimit > 0;
+    std::vector<std::string> asms = asm_init(tape, checkpoint);
+    const auto start = options.forkServer ? forkPoint(cmds) : 0;
+    const auto startIo = [&]()
+    {
+        if (options.forkServer)
+        {
+            extend(asms, asm_fork_server());
+        }
+        extend(asms, asm_io_init());
+        if (checkpoint || budget)
+        {
+            extend(asms, asm_signals_init());
+        }
+        if (budget)
+        {
+            extend(asms, asm_budget_init(options.timeLimit));
+        }
+        if (checkpoint)
+        {
+            extend(asms, asm_checkpoint_init(options.checkpointEvery));
+        }
+    };
+    std::optional<SuperoptDb> db;
+    if (options.superopt)
+    {
+        db.emplace(options.superoptDb);
+    }
+    // Each distinct segment inside a loop is searched up front, on the
+    // pool. A search gives the same code whichever thread runs it, so
+    // the output does not depend on the thread count.
+    std::map<std::string, std::optional<std::vector<std::string>>> searched;
+    if (db.has_value())
+    {
+        std::vector<Segment> segments;
+        std::vector<std::string> keys;
+        int depth = 0;
+        for (size_t i = 0; i < cmds.size(); i++)
+        {
+            depth += cmds.at(i).inst == LOOP ? 1 : cmds.at(i).inst == JMP ? -1 : 0;
+            if (depth == 0 || !isStraightLine(cmds.at(i).inst))
+            {
+                continue;
+            }
+            size_t end = i;
+            while (end < cmds.size() && isStraightLine(cmds.at(end).inst))
+            {
+                end++;
+            }
+            if (end - i >= 2)
+            {
+                auto seg = canonicalSegment(cmds, i, end);
+                auto key = segmentKey(seg);
+                if (searched.emplace(key, std::nullopt).second)
+                {
+                    segments.push_back(std::move(seg));
+                    keys.push_back(std::move(key));
+                }
+            }
+            i = end - 1;
+        }
+        // once the compile budget is spent, only what the database
+        // already knows is used
+        std::vector<std::optional<std::vector<std::string>>> results(segments.size());
+        std::atomic<size_t> unsearched{0};
+        WorkPool pool(jobCount(options));
+        pool.run(segments.size(), [&](size_t k)
+                 {
+                     if (compileBudget != nullptr && compileBudget->spent())
+                     {
+                         results.at(k) = db->lookup(keys.at(k));
+                         unsearched += results.at(k).has_value() ? 0 : 1;
+                         return;
+                     }
+                     results.at(k) = superoptimize(segments.at(k), db.value());
+                 });
+        for (size_t k = 0; k < keys.size(); k++)
+        {
+            searched.at(keys.at(k)) = results.at(k);
+        }
+        if (unsearched > 0)
+        {
+            compileBudget->leftOut("superopt", "out of time", unsearched, segments.size(), "segments unsearched");
+        }
+    }
+    // the tail of a segment that found nothing is searched as it comes
+    const auto search = [&](size_t begin, size_t end)
+    {
+        const auto seg = canonicalSegment(cmds, begin, end);
+        const auto key = segmentKey(seg);
+        const auto it = searched.find(key);
+        if (it != searched.end())
+        {
+            return it->second;
+        }
+        return compileBudget != nullptr && compileBudget->spent() ? db->lookup(key) : superoptimize(seg, db.value());
+    };
+    std::vector<bool> hasBody(cmds.size(), false);
+    for (const auto &cmd : cmds)
+    {
+        if (cmd.inst == BODY)
+        {
+            hasBody.at(cmd.jumpTo) = true;
+        }
+    }
+    // Code for commands [begin, end). Labels count from begin, so the
+    // same commands give the same text wherever they sit.
+    const auto emit = [&](size_t begin, size_t end, std::vector<std::string> &out)
+    {
+        const auto label = [&](size_t i) { return int_to_label(i - begin); };
+        int depth = 0;
+        for (size_t i = begin; i < end; i++)
+        {
+            const auto &cmd = cmds.at(i);
+            depth += cmd.inst == LOOP ? 1 : cmd.inst == JMP ? -1 : 0;
+            if (i == start && units == nullptr)
+            {
+                startIo();
+            }
+
+            // only segments inside loops are worth the search
+            if (db.has_value() && depth > 0 && isStraightLine(cmd.inst))
+            {
+                size_t last = i;
+                while (last < end && isStraightLine(cmds.at(last).inst))
+                {
+                    last++;
+                }
+                const auto best = last - i >= 2 ? search(i, last) : std::nullopt;
+                if (best.has_value())
+                {
+                    extend(out, best.value());
+                    i = last - 1;
+                    continue;
+                }
+            }
+
+            switch (cmd.inst)
+            {
+            case RIGHT:
+                out.push_back(asm_right());
+                break;
+            case LEFT:
+                out.push_back(asm_left());
+                break;
+            case PLUS:
+                out.push_back(asm_incr());
+                break;
+            case MINUS:
+                out.push_back(asm_decr());
+                break;
+            case PUT:
+                extend(out, asm_put(label(i) + "_io", cmd.offset));
+                break;
+            case GET:
+                extend(out, asm_get(label(i) + "_io", cmd.offset));
+                break;
+            case LOOP:
+                extend(out, asm_loop(
+                                 label(i),
+                                 label(cmd.jumpTo),
+                                 cmd.offset, cmd.value == 0));
+                if (!hasBody.at(i))
+                {
+                    extend(out, asm_body(label(i), label(cmd.jumpTo), cmd.offset, false));
+                }
+                break;
+            case BODY:
+                extend(out, asm_body(
+                                 label(cmd.jumpTo),
+                                 label(cmds.at(cmd.jumpTo).jumpTo),
+                                 cmd.offset, cmd.value == 0));
+                break;
+            case JMP:
+                if (checkpoint)
+                {
+                    extend(out, asm_safepoint(label(i), i));
+                }
+                // scan loops are not charged, as the interpreter runs
+                // them in one step
+                if (budget && scanStep(cmds, cmd.jumpTo) == 0)
+                {
+                    extend(out, asm_budget_check(label(i), label(cmd.jumpTo), cmd.offset, i - cmd.jumpTo));
+                    break;
+                }
+                extend(out, asm_jmp(
+                                 label(i),
+                                 label(cmd.jumpTo),
+                                 cmd.offset));
+                break;
+            case CLEAR:
+                out.push_back(asm_clear());
+                break;
+            case SET:
+                out.push_back(asm_set(cmd.offset, cmd.value));
+                break;
+            case ADD:
+                out.push_back(asm_add(cmd.offset, cmd.value));
+                break;
+            case MULADD:
+                extend(out, asm_muladd(cmd.offset, cmd.value, cmd.args.at(0)));
+                break;
+            case DIVMOD:
+                extend(out, asm_divmod(
+                                 label(i),
+                                 label(i + 1),
+                                 label(cmd.jumpTo),
+                                 cmd.args.at(0), cmd.args.at(1)));
+                break;
+            case MUL:
+                extend(out, asm_mul(
+                                 label(i + 1),
+                                 label(cmd.jumpTo),
+                                 cmd.offset, cmd.args.at(0), cmd.args.at(1), cmd.args.at(2)));
+                break;
+            case CMP:
+                extend(out, asm_cmp(
+                                 label(i),
+                                 label(i + 1),
+                                 label(cmd.jumpTo),
+                                 cmd.args.at(0), cmd.args.at(1), cmd.value));
+                break;
+            }
+        }
+    };
+    if (units == nullptr)
+    {
+        // a command takes a few lines; reserving for them up front keeps
+        // the listing from being copied as it grows
+        asms.reserve(asms.size() + 4 * cmds.size());
+        emit(0, cmds.size(), asms);
+    }
+    else
+    {
+        // each unit is entered with a jump and jumps back through rbx,
+        // which generated code leaves alone
+        extend(asms, nativeUnitGlobals(budget));
+        std::set<std::string> named;
+        for (const auto &[begin, end] : nativeUnits(cmds))
+        {
+            if (start >= begin && start < end)
+            {
+                startIo();
+            }
+            std::vector<std::string> body;
+            emit(begin, end, body);
+            body.push_back("jmp rbx");
+            const auto name = "unit_" + hexFingerprint(body);
+            if (named.insert(name).second)
+            {
+                std::vector<std::string> code = {"section .text"};
+                for (const auto &symbol : nativeUnitSymbols)
+                {
+                    code.push_back("extern " + symbol);
+                }
+                extend(code, {"global " + name, name + ":"});
+                extend(code, body);
+                units->push_back({name, code});
+            }
+            const auto back = name + "_" + std::to_string(begin) + "_back";
+            extend(asms, {"mov rbx, " + back, "jmp " + name, back + ":"});
+        }
+    }
+    if (start == cmds.size())
+    {
+        startIo();
+    }
+    extend(asms, asm_tail(tape));
+    if (checkpoint || budget)
+    {
+        extend(asms, asm_signals());
+    }
+    if (budget)
+    {
+        extend(asms, asm_budget(options.maxSteps));
+    }
+    if (checkpoint)
+    {
+        extend(asms, asm_checkpoint(cmds, tape, options.checkpoint));
+    }
+    if (db.has_value())
+    {
+        db->save();
+    }
+    return asms;
+}
+
+// Zeroes bytes of a private anonymous mapping. The whole pages of a
+// large range are dropped instead, and come back as zero pages when
+// next touched, so a reset costs what the run dirtied, not the tape.
+const long long dropBytes = 1 << 16;
+
+void clearRange(uint8_t *start, long long bytes)
+{
+    const long long page = 4096;
+    const auto at = static_cast<long long>(reinterpret_cast<uintptr_t>(start));
+    const auto first = roundUp(at, page) - at;
+    const auto last = (at + bytes) / page * page - at;
+    if (bytes < dropBytes || last <= first)
+    {
+        std::fill_n(start, bytes, 0);
+        return;
+    }
+    std::fill_n(start, first, 0);
+    madvise(start + first, last - first, MADV_DONTNEED);
+    std::fill_n(start + last, bytes - last, 0);
+}
+
+// In-process tape, allocated like asm_init lays it out.
+class MappedTape
+{
+public:
+    MappedTape(const TapeLayout &tape) : layout(tape)
+    {
+        const long long page = 4096;
+        if (tape.sparse)
+        {
+            size = roundUp(tape.cells, page);
+            mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            base = static_cast<uint8_t *>(mapping);
+        }
+        else if (tape.guarded)
+        {
+            size = tape.stride * fieldSpan(tape) + page;
+            mapping = mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            base = static_cast<uint8_t *>(mapping) + page;
+            for (int field = 0; mapping != MAP_FAILED && field < tape.stride; field++)
+            {
+                mprotect(base + field * fieldSpan(tape), fieldSpan(tape) - page, PROT_READ | PROT_WRITE);
+            }
+        }
+        else
+        {
+            size = roundUp(tape.stride * fieldSpan(tape), page);
+            mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            base = static_cast<uint8_t *>(mapping);
+        }
+        if (mapping == MAP_FAILED)
+        {
+            throw std::runtime_error("could not map the tape");
+        }
+        origin = tape.origin / tape.stride;
+    }
+    MappedTape(const MappedTape &) = delete;
+    MappedTape &operator=(const MappedTape &) = delete;
+    ~MappedTape() { munmap(mapping, size); }
+
+    // zeroes cells [from, to) for the next run, leaving out guard pages
+    void reset(long long from, long long to)
+    {
+        for (const auto &[start, length] : tapeRegions(layout))
+        {
+            const auto lo = std::max(from, start);
+            const auto hi = std::min(to, start + length);
+            if (lo < hi)
+            {
+                clearRange(base + lo, hi - lo);
+            }
+        }
+    }
+
+    // whether address is in the mapping, guard pages included
+    bool holds(const void *address) const
+    {
+        const auto *start = static_cast<const uint8_t *>(mapping);
+        const auto *at = static_cast<const uint8_t *>(address);
+        return at >= start && at < start + size;
+    }
+
+    uint8_t *base = nullptr;
+    long long origin = 0;
+
+private:
+    TapeLayout layout;
+    void *mapping = nullptr;
+    size_t size = 0;
+};
+
+// A run whose pointer leaves its tape faults on a guard page. With the
+// handler installed, runOnTape takes that fault back to itself, on the
+// thread that ran it, and ends that run alone; any other fault is left
+// to kill the process as before.
+struct TapeFault
+{
+    sigjmp_buf *resume = nullptr;
+    const MappedTape *tape = nullptr;
+};
+
+thread_local TapeFault tapeFault;
+
+void catchTapeFault(int, siginfo_t *info, void *)
+{
+    if (tapeFault.resume != nullptr && tapeFault.tape->holds(info->si_addr))
+    {
+        siglongjmp(*tapeFault.resume, 1);
+    }
+    // returning runs the faulting instruction again, now to the default
+    signal(SIGSEGV, SIG_DFL);
+}
+
+void catchTapeFaults()
+{
+    struct sigaction action = {};
+    action.sa_sigaction = catchTapeFault;
+    // the handler leaves by siglongjmp, which then need not restore the
+    // signal mask, a system call on every run
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigaction(SIGSEGV, &action, nullptr);
+}
+
+// Calls run, which runs a program on tape; false when its pointer left
+// the tape. run is not inlined here, where sigsetjmp would keep the
+// engine's loop from being optimized.
+bool runOnTape(const MappedTape &tape, const std::function<void()> &run)
+{
+    sigjmp_buf fault;
+    if (sigsetjmp(fault, 0) != 0)
+    {
+        tapeFault = TapeFault();
+        return false;
+    }
+    tapeFault = TapeFault{&fault, &tape};
+    run();
+    tapeFault = TapeFault();
+    return true;
+}
+
+// Single-producer, single-consumer byte ring between two threads. The
+// fast path is a pair of atomic positions; a side that finds the ring
+// full (the writer) or empty (the reader) spins a little, then sleeps
+// until the other side has moved. The other side only takes the lock
+// to wake a sleeper, so a batch written or read costs at most one
+// wakeup.
+class ByteRing
+{
+public:
+    explicit ByteRing(size_t capacity) : bytes(capacity) {}
+    ByteRing(const ByteRing &) = delete;
+    ByteRing &operator=(const ByteRing &) = delete;
+
+    // writes all of data, waiting while the ring is full; dropped once
+    // the reader is gone
+    void write(const uint8_t *data, size_t n)
+    {
+        while (n > 0 && !abandoned.load())
+        {
+            const auto t = tail.load(std::memory_order_relaxed);
+            const auto room = bytes.size() - (t - head.load(std::memory_order_acquire));
+            if (room == 0)
+            {
+                wait(writerWaits, [&]() { return t - head.load() < bytes.size() || abandoned.load(); });
+                continue;
+            }
+            const auto chunk = std::min(n, room);
+            const auto at = t % bytes.size();
+            const auto first = std::min(chunk, bytes.size() - at);
+            std::copy_n(data, first, bytes.begin() + at);
+            std::copy_n(data + first, chunk - first, bytes.begin());
+            tail.store(t + chunk);
+            wake(readerWaits);
+            data += chunk;
+            n -= chunk;
+        }
+    }
+
+    // reads up to n bytes, waiting while the ring is empty; 0 at the end
+    size_t read(uint8_t *data, size_t n)
+    {
+        const auto h = head.load(std::memory_order_relaxed);
+        auto available = tail.load(std::memory_order_acquire) - h;
+        if (available == 0)
+        {
+            wait(readerWaits, [&]() { return tail.load() != h || closed.load(); });
+            available = tail.load(std::memory_order_acquire) - h;
+            if (available == 0)
+            {
+                return 0;
+            }
+        }
+        const auto chunk = std::min(n, available);
+        const auto at = h % bytes.size();
+        const auto first = std::min(chunk, bytes.size() - at);
+        std::copy_n(bytes.begin() + at, first, data);
+        std::copy_n(bytes.begin(), chunk - first, data + first);
+        head.store(h + chunk);
+        wake(writerWaits);
+        return chunk;
+    }
+
+    // the writer is done
+    void close()
+    {
+        closed.store(true);
+        wake(readerWaits);
+    }
+
+    // the reader is done
+    void abandon()
+    {
+        abandoned.store(true);
+        wake(writerWaits);
+    }
+
+private:
+    static const int spins = 4096;
+
+    template <typename Ready>
+    void wait(std::atomic<bool> &waits, Ready ready)
+    {
+        for (int k = 0; k < spins; k++)
+        {
+            if (ready())
+            {
+                return;
+            }
+            __builtin_ia32_pause();
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        waits.store(true);
+        moved.wait(lock, ready);
+        waits.store(false);
+    }
+
+    void wake(std::atomic<bool> &waits)
+    {
+        if (waits.load())
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            moved.notify_all();
+        }
+    }
+
+    std::vector<uint8_t> bytes;
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+    std::atomic<bool> closed{false};
+    std::atomic<bool> abandoned{false};
+    std::atomic<bool> readerWaits{false};
+    std::atomic<bool> writerWaits{false};
+    std::mutex mutex;
+    std::condition_variable moved;
+};
+
+// Byte I/O for code running in process. Input is read a block at a time
+// and output is buffered and flushed before each block is read, so
+// prompts still show. At end of input, or on a failed read, a read
+// leaves the last byte read, like the generated runtime.
+//
+// A batch run reads its record instead of stdin, and keeps its output
+// until the batch writes it. A session's record is its input so far,
+// and grows while more is expected. A pipeline stage reads from and
+// writes to the rings it is given in place of stdin and stdout.
+struct ProcessIo
+{
+    std::string out;
+    uint8_t last = 0;
+    const std::string *record = nullptr;
+    size_t consumed = 0;
+    bool more = false;
+    ByteRing *source = nullptr;
+    ByteRing *sink = nullptr;
+    // the block read last, from stdin or source
+    std::array<uint8_t, 4096> received;
+    size_t receivedAt = 0;
+    size_t receivedEnd = 0;
+    bool drained = false;
+    // bytes taken from fd 0 and written to fd 1
+    uint64_t inputOffset = 0;
+    uint64_t outputOffset = 0;
+
+    // whether a read returns without waiting for input
+    bool ready() const
+    {
+        return record == nullptr || consumed < record->size() || !more;
+    }
+
+    void put(uint8_t byte)
+    {
+        out.push_back(static_cast<char>(byte));
+        if (record == nullptr && out.size() >= 4096)
+        {
+            flush();
+        }
+    }
+    uint8_t get()
+    {
+        if (record != nullptr)
+        {
+            if (consumed < record->size())
+            {
+                last = record->at(consumed++);
+            }
+            return last;
+        }
+        if (source != nullptr)
+        {
+            if (receivedAt == receivedEnd && !drained)
+            {
+                flush();
+                receivedAt = 0;
+                receivedEnd = source->read(received.data(), received.size());
+                drained = receivedEnd == 0;
+            }
+            if (receivedAt < receivedEnd)
+            {
+                last = received[receivedAt++];
+            }
+            return last;
+        }
+        if (receivedAt == receivedEnd)
+        {
+            flush();
+            receivedAt = 0;
+            receivedEnd = std::max<ssize_t>(read(0, received.data(), received.size()), 0);
+        }
+        if (receivedAt < receivedEnd)
+        {
+            last = received[receivedAt++];
+            inputOffset++;
+        }
+        return last;
+    }
+    void flush()
+    {
+        if (sink != nullptr)
+        {
+            sink->write(reinterpret_cast<const uint8_t *>(out.data()), out.size());
+            out.clear();
+            return;
+        }
+        size_t done = 0;
+        while (done < out.size())
+        {
+            const auto n = write(1, out.data() + done, out.size() - done);
+            if (n <= 0)
+            {
+                break;
+            }
+            done += n;
+        }
+        outputOffset += done;
+        out.clear();
+    }
+};
+
+void processPut(int byte, ProcessIo *io) { io->put(byte); }
+int processGet(ProcessIo *io) { return io->get(); }
+int processReady(ProcessIo *io) { return io->ready(); }
+
+// Run budgets in process, charged as generated code charges them: an
+// engine given the budget takes the length of a loop off it at each back
+// edge and stops there once it goes negative. The time limit's SIGXCPU
+// handler sets it negative, so a back edge catches that too.
+std::atomic<long long> budgetLeft{std::numeric_limits<long long>::max()};
+std::atomic<bool> budgetTimedOut{false};
+static_assert(std::atomic<long long>::is_always_lock_free);
+
+void expireBudget(int)
+{
+    budgetTimedOut = true;
+    budgetLeft = -1;
+}
+
+// Arms the budget for a run; nullptr when it is unlimited.
+std::atomic<long long> *startBudget(long long steps, double seconds)
+{
+    if (steps <= 0 && seconds <= 0)
+    {
+        return nullptr;
+    }
+    budgetLeft = steps > 0 ? steps : std::numeric_limits<long long>::max();
+    if (seconds > 0)
+    {
+        struct sigaction action = {};
+        action.sa_handler = expireBudget;
+        action.sa_flags = SA_RESTART;
+        sigaction(SIGXCPU, &action, nullptr);
+        sigevent event = {};
+        event.sigev_notify = SIGEV_SIGNAL;
+        event.sigev_signo = SIGXCPU;
+        timer_t timer;
+        if (timer_create(CLOCK_MONOTONIC, &event, &timer) != 0)
+        {
+            throw std::runtime_error("could not start the time limit");
+        }
+        itimerspec expiry = {};
+        expiry.it_value.tv_sec = static_cast<time_t>(seconds);
+        expiry.it_value.tv_nsec = static_cast<long>((seconds - expiry.it_value.tv_sec) * 1e9);
+        timer_settime(timer, 0, &expiry, nullptr);
+    }
+    return &budgetLeft;
+}
+
+// whether the run was cut short, saying why
+bool budgetExceeded(std::ostream &os)
+{
+    if (budgetLeft >= 0)
+    {
+        return false;
+    }
+    os << (budgetTimedOut ? "time limit exceeded" : "step budget exceeded") << std::endl;
+    return true;
+}
+
+// Copy-and-patch JIT.
+//
+// Each op has a stencil: the machine code of the sequence the asm_*
+// helpers emit, with holes for displacements, immediates and branch
+// targets. Compiling copies stencils into a buffer and patches the
+// holes; branches are patched once every label is placed. Cells are
+// [rbx+r12+disp32] with rbx the tape base and r12 the pointer, and r13
+// holds the ProcessIo.
+
+enum HoleKind
+{
+    HOLE_IMM8,
+    HOLE_IMM32,
+    HOLE_IMM64,
+    HOLE_REL32
+};
+
+struct Stencil
+{
+    std::vector<uint8_t> code;
+    std::vector<std::pair<size_t, HoleKind>> holes;
+};
+
+enum StencilKind
+{
+    ST_ENTER,
+    ST_LEAVE,
+    ST_MOVE,
+    ST_ADD,
+    ST_SET,
+    ST_MULADD,
+    ST_JZ,
+    ST_JNZ,
+    ST_GUARD,
+    ST_SCAN,
+    ST_PUT,
+    ST_GET,
+    ST_READY,
+    ST_JUMP,
+    ST_JUMP_RCX,
+    ST_EXIT,
+    ST_BUDGET,
+    ST_COUNT
+};
+
+const std::array<Stencil, ST_COUNT> &stencils()
+{
+    static const std::array<Stencil, ST_COUNT> table = {{
+        // push rbx, r12-r15; mov rbx, rdi; mov r12, rsi; mov r13, rdx
+        {{0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57,
+          0x48, 0x89, 0xfb, 0x49, 0x89, 0xf4, 0x49, 0x89, 0xd5},
+         {}},
+        // mov rax, r12; pop r15-r12, rbx; ret
+        {{0x4c, 0x89, 0xe0, 0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3},
+         {}},
+        // add r12, imm32
+        {{0x49, 0x81, 0xc4, 0, 0, 0, 0},
+         {{3, HOLE_IMM32}}},
+        // add byte [rbx+r12+disp32], imm8
+        {{0x42, 0x80, 0x84, 0x23, 0, 0, 0, 0, 0},
+         {{4, HOLE_IMM32}, {8, HOLE_IMM8}}},
+        // mov byte [rbx+r12+disp32], imm8
+        {{0x42, 0xc6, 0x84, 0x23, 0, 0, 0, 0, 0},
+         {{4, HOLE_IMM32}, {8, HOLE_IMM8}}},
+        // movzx eax, byte [src]; imul eax, eax, imm32; add byte [dst], al
+        {{0x42, 0x0f, 0xb6, 0x84, 0x23, 0, 0, 0, 0,
+          0x69, 0xc0, 0, 0, 0, 0,
+          0x42, 0x00, 0x84, 0x23, 0, 0, 0, 0},
+         {{5, HOLE_IMM32}, {11, HOLE_IMM32}, {19, HOLE_IMM32}}},
+        // cmp byte [cell], 0; je rel32
+        {{0x42, 0x80, 0xbc, 0x23, 0, 0, 0, 0, 0x00, 0x0f, 0x84, 0, 0, 0, 0},
+         {{4, HOLE_IMM32}, {11, HOLE_REL32}}},
+        // cmp byte [cell], 0; jne rel32
+        {{0x42, 0x80, 0xbc, 0x23, 0, 0, 0, 0, 0x00, 0x0f, 0x85, 0, 0, 0, 0},
+         {{4, HOLE_IMM32}, {11, HOLE_REL32}}},
+        // cmp byte [cell], imm8; jne rel32
+        {{0x42, 0x80, 0xbc, 0x23, 0, 0, 0, 0, 0, 0x0f, 0x85, 0, 0, 0, 0},
+         {{4, HOLE_IMM32}, {8, HOLE_IMM8}, {11, HOLE_REL32}}},
+        // cmp byte [cell], 0; je done; add r12, imm32; jmp back; done:
+        {{0x42, 0x80, 0xbc, 0x23, 0, 0, 0, 0, 0x00, 0x74, 0x09,
+          0x49, 0x81, 0xc4, 0, 0, 0, 0, 0xeb, 0xec},
+         {{4, HOLE_IMM32}, {14, HOLE_IMM32}}},
+        // movzx edi, byte [cell]; mov rsi, r13; mov rax, imm64; call rax
+        {{0x42, 0x0f, 0xb6, 0xbc, 0x23, 0, 0, 0, 0, 0x4c, 0x89, 0xee,
+          0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xd0},
+         {{5, HOLE_IMM32}, {14, HOLE_IMM64}}},
+        // mov rdi, r13; mov rax, imm64; call rax; mov byte [cell], al
+        {{0x4c, 0x89, 0xef, 0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xd0,
+          0x42, 0x88, 0x84, 0x23, 0, 0, 0, 0},
+         {{5, HOLE_IMM64}, {19, HOLE_IMM32}}},
+        // mov rdi, r13; mov rax, imm64; call rax; test al, al; je rel32
+        {{0x4c, 0x89, 0xef, 0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xd0,
+          0x84, 0xc0, 0x0f, 0x84, 0, 0, 0, 0},
+         {{5, HOLE_IMM64}, {19, HOLE_REL32}}},
+        // jmp rel32
+        {{0xe9, 0, 0, 0, 0},
+         {{1, HOLE_REL32}}},
+        // jmp rcx
+        {{0xff, 0xe1},
+         {}},
+        // mov edx, imm32; jmp rel32
+        {{0xba, 0, 0, 0, 0, 0xe9, 0, 0, 0, 0},
+         {{1, HOLE_IMM32}, {6, HOLE_REL32}}},
+        // mov rax, imm64; sub qword [rax], imm32; jl rel32
+        {{0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0x48, 0x81, 0x28, 0, 0, 0, 0,
+          0x0f, 0x8c, 0, 0, 0, 0},
+         {{2, HOLE_IMM64}, {13, HOLE_IMM32}, {19, HOLE_REL32}}},
+    }};
+    return table;
+}
+
+// Machine code assembled from stencils.
+struct StencilCode
+{
+    std::vector<uint8_t> bytes;
+
+    // copies a stencil and fills its holes with operands, in order;
+    // returns where it starts
+    size_t place(StencilKind kind, const std::vector<long long> &operands)
+    {
+        const auto &stencil = stencils().at(kind);
+        const auto start = bytes.size();
+        extend(bytes, stencil.code);
+        for (size_t h = 0; h < stencil.holes.size(); h++)
+        {
+            const auto [at, hole] = stencil.holes.at(h);
+            const auto value = operands.at(h);
+            const size_t width = hole == HOLE_IMM8 ? 1 : hole == HOLE_IMM64 ? 8 : 4;
+            std::copy_n(reinterpret_cast<const uint8_t *>(&value), width, bytes.begin() + start + at);
+        }
+        return start;
+    }
+
+    // where the branch target of the stencil placed at start goes
+    static size_t target(StencilKind kind, size_t start)
+    {
+        return start + stencils().at(kind).holes.back().first;
+    }
+
+    void patch(size_t at, size_t label)
+    {
+        const auto rel = static_cast<int32_t>(label - (at + 4));
+        std::copy_n(reinterpret_cast<const uint8_t *>(&rel), 4, bytes.begin() + at);
+    }
+
+    // the stencil for a command that does not branch; false for the rest.
+    // shift is added to every cell offset.
+    bool placeCommand(const Command &cmd, int shift = 0)
+    {
+        switch (cmd.inst)
+        {
+        case RIGHT:
+            place(ST_MOVE, {1});
+            return true;
+        case LEFT:
+            place(ST_MOVE, {-1});
+            return true;
+        case PLUS:
+        case MINUS:
+            place(ST_ADD, {shift + cmd.offset, cmd.inst == PLUS ? 1 : -1});
+            return true;
+        case CLEAR:
+            place(ST_SET, {shift + cmd.offset, 0});
+            return true;
+        case SET:
+            place(ST_SET, {shift + cmd.offset, cmd.value});
+            return true;
+        case ADD:
+            place(ST_ADD, {shift + cmd.offset, cmd.value});
+            return true;
+        case MULADD:
+            place(ST_MULADD, {shift + cmd.args.at(0), cmd.value, shift + cmd.offset});
+            return true;
+        case PUT:
+            place(ST_PUT, {shift + cmd.offset, reinterpret_cast<long long>(&processPut)});
+            return true;
+        case GET:
+            place(ST_GET, {reinterpret_cast<long long>(&processGet), shift + cmd.offset});
+            return true;
+        case DIVMOD:
+        case MUL:
+        case CMP:
+            // the loop behind an idiom op does the same work
+            return true;
+        default:
+            return false;
+        }
+    }
+};
+
+// Executable memory that code is appended to. It is writable only while
+// being written.
+class CodeArena
+{
+public:
+    CodeArena(size_t capacity) : capacity(roundUp(capacity, 4096))
+    {
+        memory = static_cast<uint8_t *>(mmap(nullptr, this->capacity, PROT_READ | PROT_EXEC,
+                                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (memory == MAP_FAILED)
+        {
+            throw std::runtime_error("could not map JIT code");
+        }
+    }
+    CodeArena(const CodeArena &) = delete;
+    CodeArena &operator=(const CodeArena &) = delete;
+    ~CodeArena() { munmap(memory, capacity); }
+
+    // where the next append lands, or nullptr when it would not fit
+    uint8_t *next(size_t size) const
+    {
+        return used + size <= capacity ? memory + used : nullptr;
+    }
+    uint8_t *append(const std::vector<uint8_t> &bytes)
+    {
+        auto *at = next(bytes.size());
+        if (at != nullptr)
+        {
+            write(at, bytes.data(), bytes.size());
+            used += bytes.size();
+        }
+        return at;
+    }
+    void write(uint8_t *at, const void *bytes, size_t size)
+    {
+        mprotect(memory, capacity, PROT_READ | PROT_WRITE);
+        std::copy_n(static_cast<const uint8_t *>(bytes), size, at);
+        mprotect(memory, capacity, PROT_READ | PROT_EXEC);
+    }
+    // points the rel32 at `at` to target
+    void link(uint8_t *at, const uint8_t *target)
+    {
+        const auto rel = static_cast<int32_t>(target - (at + 4));
+        write(at, &rel, 4);
+    }
+
+private:
+    uint8_t *memory = nullptr;
+    size_t capacity = 0;
+    size_t used = 0;
+};
+
+class StencilJit
+{
+public:
+    using Entry = long long (*)(uint8_t *tape, long long pointer, ProcessIo *io);
+
+    StencilJit(const std::vector<Command> &cmds, std::atomic<long long> *budget = nullptr)
+        : cmds(cmds), budget(budget), bodies(cmds.size(), 0), ends(cmds.size(), 0) {}
+
+    Entry compile()
+    {
+        std::vector<bool> hasBody(cmds.size(), false);
+        for (const auto &cmd : cmds)
+        {
+            if (cmd.inst == BODY)
+            {
+                hasBody.at(cmd.jumpTo) = true;
+            }
+        }
+
+        code.place(ST_ENTER, {});
+        for (size_t i = 0; i < cmds.size(); i++)
+        {
+            const auto &cmd = cmds.at(i);
+            switch (cmd.inst)
+            {
+            case RIGHT:
+            case LEFT:
+            {
+                long long move = 0;
+                for (; i < cmds.size() && (cmds.at(i).inst == RIGHT || cmds.at(i).inst == LEFT); i++)
+                {
+                    move += cmds.at(i).inst == RIGHT ? 1 : -1;
+                }
+                i--;
+                if (move != 0)
+                {
+                    code.place(ST_MOVE, {move});
+                }
+                break;
+            }
+            case LOOP:
+                if (const auto step = scanStep(cmds, i); step != 0)
+                {
+                    code.place(ST_SCAN, {cmd.offset, step});
+                    i = cmd.jumpTo;
+                    break;
+                }
+                if (cmd.value == 0)
+                {
+                    branch(ST_JZ, cmd.offset, &ends, i);
+                }
+                if (!hasBody.at(i))
+                {
+                    bodies.at(i) = code.bytes.size();
+                }
+                break;
+            case BODY:
+                if (cmd.value == 0)
+                {
+                    branch(ST_JZ, cmd.offset, &ends, cmd.jumpTo);
+                }
+                bodies.at(cmd.jumpTo) = code.bytes.size();
+                break;
+            case JMP:
+                if (budget != nullptr)
+                {
+                    // only a back edge that is taken is charged
+                    branch(ST_JZ, cmd.offset, &ends, cmd.jumpTo);
+                    const auto charge = code.place(ST_BUDGET, {reinterpret_cast<long long>(budget),
+                                                               static_cast<long long>(i - cmd.jumpTo), 0});
+                    outOfBudget.push_back(StencilCode::target(ST_BUDGET, charge));
+                    const auto jump = code.place(ST_JUMP, {0});
+                    fixups.push_back({StencilCode::target(ST_JUMP, jump), &bodies, cmd.jumpTo});
+                }
+                else
+                {
+                    branch(ST_JNZ, cmd.offset, &bodies, cmd.jumpTo);
+                }
+                ends.at(cmd.jumpTo) = code.bytes.size();
+                break;
+            default:
+                code.placeCommand(cmd);
+                break;
+            }
+        }
+        const auto leave = code.place(ST_LEAVE, {});
+
+        for (const auto &[at, labels, loop] : fixups)
+        {
+            code.patch(at, labels->at(loop));
+        }
+        for (const auto at : outOfBudget)
+        {
+            code.patch(at, leave);
+        }
+        arena.emplace(code.bytes.size());
+        return reinterpret_cast<Entry>(arena->append(code.bytes));
+    }
+
+private:
+    void branch(StencilKind kind, int offset, std::vector<size_t> *labels, size_t loop)
+    {
+        const auto start = code.place(kind, {offset, 0});
+        fixups.push_back({StencilCode::target(kind, start), labels, loop});
+    }
+
+    struct Fixup
+    {
+        size_t at;
+        const std::vector<size_t> *labels;
+        size_t loop;
+    };
+
+    const std::vector<Command> &cmds;
+    std::atomic<long long> *budget;
+    StencilCode code;
+    std::vector<size_t> bodies, ends;
+    std::vector<Fixup> fixups;
+    std::vector<size_t> outOfBudget;
+    std::optional<CodeArena> arena;
+};
+
+// State of a program running in process.
+struct Machine
+{
+    uint8_t *tape = nullptr;
+    long long pointer = 0;
+    size_t pc = 0;
+};
+
+// Interpreter over the optimized commands. Loops the pointer-only scan
+// shape run as one step, and idiom ops are skipped in favour of the
+// loop behind them.
+class Interpreter
+{
+public:
+    Interpreter(const std::vector<Command> &cmds)
+        : cmds(cmds), bodies(cmds.size(), 0), scans(cmds.size(), 0)
+    {
+        for (size_t i = 0; i < cmds.size(); i++)
+        {
+            if (cmds.at(i).inst == LOOP)
+            {
+                bodies.at(i) = i + 1;
+                scans.at(i) = scanStep(cmds, i);
+            }
+            else if (cmds.at(i).inst == BODY)
+            {
+                bodies.at(cmds.at(i).jumpTo) = i + 1;
+            }
+        }
+    }
+
+    bool done(const Machine &m) const { return m.pc >= cmds.size(); }
+
+    // where a loop's back edge lands
+    size_t bodyStart(size_t loop) const { return bodies.at(loop); }
+    long long scan(size_t loop) const { return scans.at(loop); }
+
+    void step(Machine &m, ProcessIo &io) const
+    {
+        const auto &cmd = cmds.at(m.pc);
+        auto &cell = m.tape[m.pointer + cmd.offset];
+        switch (cmd.inst)
+        {
+        case RIGHT:
+            m.pointer++;
+            break;
+        case LEFT:
+            m.pointer--;
+            break;
+        case PLUS:
+            cell++;
+            break;
+        case MINUS:
+            cell--;
+            break;
+        case PUT:
+            io.put(cell);
+            break;
+        case GET:
+            cell = io.get();
+            break;
+        case LOOP:
+            if (scans.at(m.pc) != 0)
+            {
+                while (m.tape[m.pointer + cmd.offset] != 0)
+                {
+                    m.pointer += scans.at(m.pc);
+                }
+                m.pc = cmd.jumpTo;
+            }
+            else if (cell == 0)
+            {
+                m.pc = cmd.jumpTo;
+            }
+            break;
+        case BODY:
+            if (cell == 0)
+            {
+                m.pc = cmds.at(cmd.jumpTo).jumpTo;
+            }
+            break;
+        case JMP:
+            if (cell != 0)
+            {
+                const auto charge = static_cast<long long>(m.pc - cmd.jumpTo);
+                if (budget != nullptr && budget->fetch_sub(charge, std::memory_order_relaxed) < charge)
+                {
+                    m.pc = cmds.size();
+                    return;
+                }
+                m.pc = bodies.at(cmd.jumpTo);
+                return;
+            }
+            break;
+        case CLEAR:
+            cell = 0;
+            break;
+        case SET:
+            cell = cmd.value;
+            break;
+        case ADD:
+            cell += cmd.value;
+            break;
+        case MULADD:
+            cell += m.tape[m.pointer + cmd.args.at(0)] * cmd.value;
+            break;
+        case DIVMOD:
+        case MUL:
+        case CMP:
+            break;
+        }
+        m.pc++;
+    }
+
+    // charges loops to budget from now on, ending the run once it is
+    // spent
+    void limit(std::atomic<long long> *left) { budget = left; }
+
+    // whether a read at m would wait for input
+    bool blocked(const Machine &m, const ProcessIo &io) const
+    {
+        return cmds.at(m.pc).inst == GET && !io.ready();
+    }
+
+    // runs to the end, widening [lowest, highest] to every pointer it
+    // reaches, for a tape that is reset afterwards
+    void run(Machine &m, ProcessIo &io, long long &lowest, long long &highest) const
+    {
+        lowest = std::min(lowest, m.pointer);
+        highest = std::max(highest, m.pointer);
+        while (!done(m))
+        {
+            step(m, io);
+            lowest = std::min(lowest, m.pointer);
+            highest = std::max(highest, m.pointer);
+        }
+    }
+
+    // runs to the end; false when it stopped at a read that would wait
+    bool run(Machine &m, ProcessIo &io) const
+    {
+        while (!done(m))
+        {
+            if (blocked(m, io))
+            {
+                return false;
+            }
+            step(m, io);
+        }
+        return true;
+    }
+
+protected:
+    const std::vector<Command> &cmds;
+    std::vector<size_t> bodies;
+    std::vector<long long> scans;
+    std::atomic<long long> *budget = nullptr;
+};
+
+// Tracing JIT.
+//
+// The interpreter counts back edges per loop. When a loop gets hot, the
+// next iteration is recorded as a trace: the commands actually run, with
+// inner loops unrolled as far as they went. The trace is compiled into
+// straight-line code with a guard at every branch. A guard that fails
+// leaves to the interpreter at the other side of that branch, and the
+// trace loops back to its head while the loop keeps going. A side exit
+// that gets hot grows a branch trace from where it lands, which is
+// stitched in by pointing the exit's jump at it.
+class TracingJit
+{
+public:
+    TracingJit(const std::vector<Command> &cmds, std::atomic<long long> *budget = nullptr)
+        : cmds(cmds), interpreter(cmds), budget(budget), anchors(cmds.size()), entries(cmds.size(), nullptr),
+          arena(arenaSize)
+    {
+        interpreter.limit(budget);
+        // entry trampoline: save registers, jump to the trace in rcx
+        StencilCode stubs;
+        stubs.place(ST_ENTER, {});
+        stubs.place(ST_JUMP_RCX, {});
+        const auto leave = stubs.place(ST_LEAVE, {});
+        const auto *base = arena.append(stubs.bytes);
+        enter = reinterpret_cast<Entry>(base);
+        leaveStub = base + leave;
+    }
+
+    // runs to the end; false when it stopped at a read that would wait
+    bool run(Machine &m, ProcessIo &io)
+    {
+        while (!interpreter.done(m))
+        {
+            if (entries.at(m.pc) != nullptr)
+            {
+                const auto [pointer, exit] = enter(m.tape, m.pointer, &io, entries.at(m.pc));
+                m.pointer = pointer;
+                auto &taken = exits.at(exit);
+                m.pc = taken.pc;
+                if (++taken.hits == hotExit && taken.stitch != nullptr)
+                {
+                    recordBranch(m, io, exit);
+                }
+                continue;
+            }
+
+            if (interpreter.blocked(m, io))
+            {
+                return false;
+            }
+            const auto pc = m.pc;
+            interpreter.step(m, io);
+            if (cmds.at(pc).inst == JMP && m.pc != pc + 1)
+            {
+                const auto loop = cmds.at(pc).jumpTo;
+                if (++anchors.at(loop).hits == hotLoop)
+                {
+                    recordAnchor(m, io, loop);
+                }
+            }
+        }
+        return true;
+    }
+
+private:
+    // returned in rax and rdx
+    struct Result
+    {
+        long long pointer;
+        long long exit;
+    };
+    using Entry = Result (*)(uint8_t *tape, long long pointer, ProcessIo *io, const uint8_t *target);
+
+    static const int hotLoop = 16;
+    static const int hotExit = 16;
+    static const size_t maxTraceLength = 4096;
+    static const int maxTracesPerLoop = 32;
+    static const size_t arenaSize = 16 << 20;
+
+    // one command of a trace, and where control went after it
+    struct TraceOp
+    {
+        size_t pc;
+        size_t next;
+    };
+
+    struct Anchor
+    {
+        int hits = 0;
+        int traces = 0;
+        const uint8_t *head = nullptr;
+    };
+
+    struct Exit
+    {
+        size_t pc;
+        size_t anchor;
+        int hits = 0;
+        // the jump to patch when a branch trace is stitched in
+        uint8_t *stitch = nullptr;
+    };
+
+    // runs the interpreter from m until the anchor's back edge, keeping
+    // what ran; empty when the path gets too long, the program ends or
+    // a read would wait
+    std::vector<TraceOp> record(Machine &m, ProcessIo &io, size_t anchor)
+    {
+        std::vector<TraceOp> ops;
+        while (!interpreter.done(m) && !interpreter.blocked(m, io))
+        {
+            const auto pc = m.pc;
+            interpreter.step(m, io);
+            ops.push_back({pc, m.pc});
+            if (pc == cmds.at(anchor).jumpTo)
+            {
+                return ops;
+            }
+            if (ops.size() == maxTraceLength)
+            {
+                break;
+            }
+        }
+        return {};
+    }
+
+    void recordAnchor(Machine &m, ProcessIo &io, size_t loop)
+    {
+        const auto start = m.pc;
+        const auto ops = record(m, io, loop);
+        if (ops.empty())
+        {
+            return;
+        }
+        auto &anchor = anchors.at(loop);
+        anchor.head = compile(ops, loop);
+        anchor.traces++;
+        entries.at(start) = anchor.head;
+    }
+
+    void recordBranch(Machine &m, ProcessIo &io, size_t exit)
+    {
+        const auto loop = exits.at(exit).anchor;
+        if (anchors.at(loop).traces == maxTracesPerLoop)
+        {
+            return;
+        }
+        const auto ops = record(m, io, loop);
+        if (ops.empty())
+        {
+            return;
+        }
+        if (const auto *trace = compile(ops, loop); trace != nullptr)
+        {
+            anchors.at(loop).traces++;
+            arena.link(exits.at(exit).stitch, trace);
+        }
+    }
+
+    // compiles a trace of loop; the anchor's back edge goes to its head,
+    // or to the start of this trace when it is the first
+    const uint8_t *compile(const std::vector<TraceOp> &ops, size_t loop)
+    {
+        StencilCode code;
+        struct Guard
+        {
+            size_t at;
+            size_t pc;
+        };
+        std::vector<Guard> guards;
+        const auto guard = [&](StencilKind kind, int offset, size_t pc)
+        {
+            guards.push_back({StencilCode::target(kind, code.place(kind, {offset, 0})), pc});
+        };
+        // a back edge the trace takes is charged as the interpreter
+        // charges it; out of budget, the interpreter stops at it
+        const auto charge = [&](size_t pc)
+        {
+            if (budget != nullptr)
+            {
+                const auto at = code.place(ST_BUDGET, {reinterpret_cast<long long>(budget),
+                                                       static_cast<long long>(pc - cmds.at(pc).jumpTo), 0});
+                guards.push_back({StencilCode::target(ST_BUDGET, at), pc});
+            }
+        };
+
+        std::optional<size_t> backEdge;
+        for (const auto &[pc, next] : ops)
+        {
+            const auto &cmd = cmds.at(pc);
+            if (cmd.inst == GET)
+            {
+                const auto ready = code.place(ST_READY, {reinterpret_cast<long long>(&processReady), 0});
+                guards.push_back({StencilCode::target(ST_READY, ready), pc});
+            }
+            if (code.placeCommand(cmd))
+            {
+                continue;
+            }
+            const bool fallsThrough = next == pc + 1;
+            switch (cmd.inst)
+            {
+            case LOOP:
+                if (interpreter.scan(pc) != 0)
+                {
+                    code.place(ST_SCAN, {cmd.offset, interpreter.scan(pc)});
+                }
+                else
+                {
+                    guard(fallsThrough ? ST_JZ : ST_JNZ, cmd.offset, fallsThrough ? cmd.jumpTo + 1 : pc + 1);
+                }
+                break;
+            case BODY:
+            {
+                const auto end = cmds.at(cmd.jumpTo).jumpTo;
+                guard(fallsThrough ? ST_JZ : ST_JNZ, cmd.offset, fallsThrough ? end + 1 : pc + 1);
+                break;
+            }
+            case JMP:
+                if (pc == cmds.at(loop).jumpTo && budget != nullptr)
+                {
+                    guard(ST_JZ, cmd.offset, pc + 1);
+                    charge(pc);
+                    backEdge = StencilCode::target(ST_JUMP, code.place(ST_JUMP, {0}));
+                }
+                else if (pc == cmds.at(loop).jumpTo)
+                {
+                    backEdge = StencilCode::target(ST_JNZ, code.place(ST_JNZ, {cmd.offset, 0}));
+                    guards.push_back({StencilCode::target(ST_JUMP, code.place(ST_JUMP, {0})), pc + 1});
+                }
+                else
+                {
+                    // under a budget, a back edge the trace did not take
+                    // leaves at the jump, so the interpreter charges it
+                    const auto taken = budget != nullptr ? pc : interpreter.bodyStart(cmd.jumpTo);
+                    guard(fallsThrough ? ST_JNZ : ST_JZ, cmd.offset, fallsThrough ? taken : pc + 1);
+                    if (!fallsThrough)
+                    {
+                        charge(pc);
+                    }
+                }
+                break;
+            default:
+                break;
+            }
+        }
+
+        // exit stubs, with the jumps out of the trace resolved once it is placed
+        std::vector<std::pair<size_t, size_t>> stubs;
+        for (const auto &[at, pc] : guards)
+        {
+            const auto stub = code.place(ST_EXIT, {static_cast<long long>(exits.size()), 0});
+            code.patch(at, stub);
+            stubs.emplace_back(exits.size(), StencilCode::target(ST_EXIT, stub));
+            exits.push_back({pc, loop, 0, nullptr});
+        }
+        auto *base = arena.next(code.bytes.size());
+        if (base == nullptr)
+        {
+            exits.resize(exits.size() - stubs.size());
+            return nullptr;
+        }
+        arena.append(code.bytes);
+        for (const auto &[exit, at] : stubs)
+        {
+            arena.link(base + at, leaveStub);
+            if (exits.at(exit).pc != cmds.at(loop).jumpTo + 1)
+            {
+                exits.at(exit).stitch = base + at;
+            }
+        }
+        const auto *head = anchors.at(loop).head != nullptr ? anchors.at(loop).head : base;
+        arena.link(base + backEdge.value(), head);
+        return base;
+    }
+
+    const std::vector<Command> &cmds;
+    Interpreter interpreter;
+    std::atomic<long long> *budget;
+    std::vector<Anchor> anchors;
+    std::vector<const uint8_t *> entries;
+    std::vector<Exit> exits;
+    CodeArena arena;
+    Entry enter = nullptr;
+    const uint8_t *leaveStub = nullptr;
+};
+
+std::optional<Instruction> readChar(char c)
+{
+    switch (c)
+    {
+    case '+':
+        return std::make_optional(PLUS);
+    case '-':
+        return std::make_optional(MINUS);
+    case '>':
+        return std::make_optional(RIGHT);
+    case '<':
+        return std::make_optional(LEFT);
+    case '.':
+        return std::make_optional(PUT);
+    case ',':
+        return std::make_optional(GET);
+    case '[':
+        return std::make_optional(LOOP);
+    case ']':
+        return std::make_optional(JMP);
+    }
+    return std::optional<Instruction>();
+}
+
+// Lexes chunks of the text in parallel, then concatenates them.
+std::vector<Instruction> readInstructions(const std::string &text)
+{
+    const auto chunks = chunkCount(text.size());
+    std::vector<std::vector<Instruction>> parts(chunks);
+    forChunks(text.size(), chunks,
+              [&](size_t c, size_t begin, size_t end)
+              {
+                  // a chunk has at most one instruction per character
+                  parts[c].reserve(end - begin);
+                  for (size_t at = begin; at < end; at++)
+                  {
+                      auto i = readChar(text[at]);
+                      if (i.has_value())
+                      {
+                          parts[c].push_back(i.value());
+                      }
+                  }
+              });
+    if (chunks == 1)
+    {
+        return std::move(parts.front());
+    }
+    std::vector<size_t> starts(chunks + 1, 0);
+    for (size_t c = 0; c < chunks; c++)
+    {
+        starts[c + 1] = starts[c] + parts[c].size();
+    }
+    std::vector<Instruction> insts(starts.back());
+    forChunks(chunks, chunks, [&](size_t c, size_t, size_t)
+              { std::copy(parts[c].begin(), parts[c].end(), insts.begin() + starts[c]); });
+    return insts;
+}
+
+// Recomputes the jump targets after a pass has moved commands around.
+// An idiom op jumps to the end of the loop it stands in front of.
+void relink(std::vector<Command> &cmds)
+{
+    std::stack<size_t> loopstack;
+    for (size_t i = 0; i < cmds.size(); i++)
+    {
+        switch (cmds.at(i).inst)
+        {
+        case LOOP:
+            loopstack.push(i);
+            break;
+        case JMP:
+        {
+            size_t jmpto = loopstack.top();
+            loopstack.pop();
+            cmds.at(i).jumpTo = jmpto;
+            cmds.at(jmpto).jumpTo = i;
+            break;
+        }
+        case BODY:
+            cmds.at(i).jumpTo = loopstack.top();
+            break;
+        default:
+            break;
+        }
+    }
+    for (size_t i = 0; i + 1 < cmds.size(); i++)
+    {
+        const auto inst = cmds.at(i).inst;
+        if (inst == DIVMOD || inst == MUL || inst == CMP)
+        {
+            cmds.at(i).jumpTo = cmds.at(i + 1).jumpTo;
+        }
+    }
+}
+
+// Top-level loop nests and the commands between them, in runs of about
+// nestGrain commands. Loops only look inside themselves, and an idiom op
+// only at the loop right after it, which always shares its run.
+std::vector<std::pair<size_t, size_t>> nestRuns(const std::vector<Command> &cmds)
+{
+    const size_t nestGrain = 4096;
+    std::vector<std::pair<size_t, size_t>> runs;
+    size_t begin = 0;
+    for (size_t i = 0; i < cmds.size();)
+    {
+        i = cmds.at(i).inst == LOOP ? cmds.at(i).jumpTo + 1 : i + 1;
+        const auto inst = cmds.at(i - 1).inst;
+        if (i - begin >= nestGrain && inst != DIVMOD && inst != MUL && inst != CMP)
+        {
+            runs.emplace_back(begin, i);
+            begin = i;
+        }
+    }
+    if (begin < cmds.size())
+    {
+        runs.emplace_back(begin, cmds.size());
+    }
+    return runs;
+}
+
+// Commands a pass writes for one run of nests. They come from an arena
+// for the run, which the pass may also take scratch space from; all of
+// it is freed at once when the pass is done with the run.
+using CommandBuffer = std::pmr::vector<Command>;
+
+// Top-level loops in [begin, end).
+size_t countNests(const std::vector<Command> &cmds, size_t begin, size_t end)
+{
+    size_t nests = 0;
+    for (size_t i = begin; i < end; i = cmds.at(i).inst == LOOP ? cmds.at(i).jumpTo + 1 : i + 1)
+    {
+        nests += cmds.at(i).inst == LOOP ? 1 : 0;
+    }
+    return nests;
+}
+
+// Runs a pass's rewrite(begin, end, out) over each run of nests on the
+// pool, then joins the results in program order and relinks them, so
+// the program is the same at any number of threads. Under a compile
+// budget, runs reached after the time is up and runs that outgrow their
+// share of memory are copied as they were.
+template <typename Rewrite>
+std::vector<Command> rewriteNests(const std::vector<Command> &cmds, WorkPool &pool, const Rewrite &rewrite,
+                                  CompileBudget *compileBudget = nullptr)
+{
+    const auto runs = nestRuns(cmds);
+    // room for the run's output to double once, and for scratch, so
+    // most runs take one block from the heap
+    std::vector<std::unique_ptr<std::pmr::monotonic_buffer_resource>> arenas;
+    std::vector<CommandBuffer> parts;
+    parts.reserve(runs.size());
+    for (const auto &[begin, end] : runs)
+    {
+        arenas.push_back(std::make_unique<std::pmr::monotonic_buffer_resource>(4 * (end - begin) * sizeof(Command)));
+        parts.emplace_back(arenas.back().get());
+    }
+    enum Outcome : char
+    {
+        REWRITTEN,
+        OUT_OF_TIME,
+        OVER_MEMORY
+    };
+    std::vector<Outcome> outcomes(runs.size(), REWRITTEN);
+    pool.run(runs.size(), [&](size_t k)
+             {
+                 const auto [begin, end] = runs.at(k);
+                 auto &part = parts.at(k);
+                 part.reserve(end - begin);
+                 if (compileBudget != nullptr && compileBudget->spent())
+                 {
+                     outcomes.at(k) = OUT_OF_TIME;
+                 }
+                 else
+                 {
+                     rewrite(begin, end, part);
+                 }
+                 if (compileBudget != nullptr && !compileBudget->fits(part.size(), end - begin, cmds.size()))
+                 {
+                     outcomes.at(k) = OVER_MEMORY;
+                 }
+                 if (outcomes.at(k) != REWRITTEN)
+                 {
+                     part.assign(cmds.begin() + begin, cmds.begin() + end);
+                 }
+             });
+    if (compileBudget != nullptr)
+    {
+        std::array<size_t, 3> nests{};
+        for (size_t k = 0; k < runs.size(); k++)
+        {
+            nests.at(outcomes.at(k)) += countNests(cmds, runs.at(k).first, runs.at(k).second);
+        }
+        const auto of = nests.at(REWRITTEN) + nests.at(OUT_OF_TIME) + nests.at(OVER_MEMORY);
+        if (nests.at(OUT_OF_TIME) > 0)
+        {
+            compileBudget->leftOut(compileBudget->pass(), "out of time", nests.at(OUT_OF_TIME), of,
+                                   "loop nests as they were");
+        }
+        if (nests.at(OVER_MEMORY) > 0)
+        {
+            compileBudget->leftOut(compileBudget->pass(), "over the memory cap", nests.at(OVER_MEMORY), of,
+                                   "loop nests as they were");
+        }
+    }
+    size_t total = 0;
+    for (const auto &part : parts)
+    {
+        total += part.size();
+    }
+    std::vector<Command> out;
+    out.reserve(total);
+    for (const auto &part : parts)
+    {
+        extend(out, part);
+    }
+    relink(out);
+    return out;
+}
+
+// Turns loops like [->+>++<<] into MULADDs followed by a CLEAR.
+// Only loops whose body is +-<> with no net movement and which step
+// the loop cell by exactly one are rewritten, so the effect is exact.
+std::vector<Command> lowerSimpleLoops(const std::vector<Command> &cmds, WorkPool &pool,
+                                      CompileBudget *compileBudget = nullptr)
+{
+    const auto lower = [&](size_t begin, size_t end, CommandBuffer &out)
+    {
+        for (size_t i = begin; i < end; i++)
+        {
+            const auto &cmd = cmds.at(i);
+            if (cmd.inst != LOOP)
+            {
+                out.push_back(cmd);
+                continue;
+            }
+
+            std::pmr::map<int, int> deltas(out.get_allocator().resource());
+            int pos = 0;
+            bool simple = true;
+            for (size_t j = i + 1; j < cmd.jumpTo && simple; j++)
+            {
+                switch (cmds.at(j).inst)
+                {
+                case RIGHT:
+                    pos++;
+                    break;
+                case LEFT:
+                    pos--;
+                    break;
+                case PLUS:
+                    deltas[pos]++;
+                    break;
+                case MINUS:
+                    deltas[pos]--;
+                    break;
+                default:
+                    simple = false;
+                    break;
+                }
+            }
+            const int step = deltas[0];
+            if (!simple || pos != 0 || (step != 1 && step != -1))
+            {
+                out.push_back(cmd);
+                continue;
+            }
+
+            // the loop runs cell times when stepping down, -cell times up
+            for (const auto &[offset, delta] : deltas)
+            {
+                if (offset != 0 && delta % 256 != 0)
+                {
+                    out.emplace_back(MULADD, offset, -step * delta);
+                }
+            }
+            out.emplace_back(CLEAR, 0, 0);
+            i = cmd.jumpTo;
+        }
+    };
+    return rewriteNests(cmds, pool, lower, compileBudget);
+}
+
+// Idiom library.
+//
+// A pattern is written in brainfuck with named cells. A lowercase
+// letter moves to that cell (the first name is the loop cell), +-<>[]
+// match literally, {x -y} matches a lowered transfer loop adding the
+// current cell to x and subtracting it from y ({} is a clear), and ~
+// marks that the real pointer is one cell left of where the text says,
+// as after a [>-]> style scan.
+//
+// Names bind to pointer offsets from the loop cell. The extract function
+// checks the layout and builds the native op, which runs in front of
+// the original loop and falls back to it when its guard fails.
+
+using Bindings = std::pmr::map<char, int>;
+
+struct IdiomPattern
+{
+    const char *name;
+    const char *pattern;
+    std::optional<Command> (*extract)(const Bindings &cells);
+};
+
+bool distinct(std::vector<int> offsets)
+{
+    std::sort(offsets.begin(), offsets.end());
+    return std::adjacent_find(offsets.begin(), offsets.end()) == offsets.end();
+}
+
+// >n d -> >0 d-n%d n%d n/d, needs d != 1 and d+1..d+4 zeroed
+std::optional<Command> extractDivmod(const Bindings &)
+{
+    Command cmd(DIVMOD, 0, 0);
+    cmd.args = {1, 0, 0};
+    return cmd;
+}
+
+// >n 0 d -> >0 n d-n%d n%d n/d, same guard
+std::optional<Command> extractDivmodCopy(const Bindings &)
+{
+    Command cmd(DIVMOD, 0, 0);
+    cmd.args = {2, 1, 0};
+    return cmd;
+}
+
+// x += t*y with y restored through s, needs s zeroed
+std::optional<Command> extractMul(const Bindings &cells)
+{
+    const int y = cells.at('y'), x = cells.at('x'), s = cells.at('s');
+    if (!distinct({0, y, x, s}))
+    {
+        return std::nullopt;
+    }
+    Command cmd(MUL, 0, 0);
+    cmd.args = {y, x, s};
+    return cmd;
+}
+
+// x += sign if 1 <= b <= a, leaving b = 0; otherwise b -= a.
+// Needs the flag pair b+1, b+2 to hold 1, 0.
+std::optional<Command> extractCmp(const Bindings &cells, int sign)
+{
+    const int b = cells.at('b'), x = cells.at('x');
+    if (!distinct({0, b, b + 1, b + 2, x}))
+    {
+        return std::nullopt;
+    }
+    Command cmd(CMP, 0, sign);
+    cmd.args = {b, x, 0};
+    return cmd;
+}
+
+const std::vector<IdiomPattern> &idiomLibrary()
+{
+    static const std::vector<IdiomPattern> library = {
+        {"divmod", "[->-[>+>>]>[+{<}>+>>]<<<<<]", extractDivmod},
+        {"divmod", "[->+>-[>+>>]>[+{<}>+>>]<<<<<<]", extractDivmodCopy},
+        {"mul", "t[y{x s}s{y}t-]", extractMul},
+        {"mul", "t[-y{x s}s{y}t]", extractMul},
+        {"cmp", "a[b-[>-]>[~<x+a{}+b>->]<+<a-]",
+         [](const Bindings &cells) { return extractCmp(cells, 1); }},
+        {"cmp", "a[b-[>-]>[~<x-a{}+b>->]<+<a-]",
+         [](const Bindings &cells) { return extractCmp(cells, -1); }},
+        // x right of the flag pair, reached without stepping back to b
+        {"cmp", "a[b-[>-]>[~x+a{}+b>->]<+<a-]",
+         [](const Bindings &cells) { return extractCmp(cells, 1); }},
+        {"cmp", "a[b-[>-]>[~x-a{}+b>->]<+<a-]",
+         [](const Bindings &cells) { return extractCmp(cells, -1); }},
+    };
+    return library;
+}
+
+class IdiomMatcher
+{
+public:
+    IdiomMatcher(const std::vector<Command> &cmds, size_t begin, size_t end,
+                 std::pmr::memory_resource *scratch)
+        : cmds(cmds), pc(begin), end(end), cells(scratch) {}
+
+    std::optional<Bindings> match(std::string_view pattern)
+    {
+        for (size_t i = 0; i < pattern.size(); i++)
+        {
+            const char c = pattern.at(i);
+            if (c >= 'a' && c <= 'z')
+            {
+                // leave the moves of literal <> right after the name
+                size_t literal = 0;
+                while (i + 1 + literal < pattern.size() &&
+                       (pattern.at(i + 1 + literal) == '<' || pattern.at(i + 1 + literal) == '>'))
+                {
+                    literal++;
+                }
+                moves(literal);
+                if (!bind(c, offset))
+                {
+                    return std::nullopt;
+                }
+                continue;
+            }
+            if (c == '~')
+            {
+                offset--;
+                continue;
+            }
+            if (c == '{')
+            {
+                const auto close = pattern.find('}', i);
+                if (!transfer(pattern.substr(i + 1, close - i - 1)))
+                {
+                    return std::nullopt;
+                }
+                i = close;
+                continue;
+            }
+            const auto inst = readChar(c);
+            if (pc == end || !inst.has_value() || cmds.at(pc).inst != inst.value())
+            {
+                return std::nullopt;
+            }
+            offset += inst == RIGHT ? 1 : inst == LEFT ? -1 : 0;
+            pc++;
+        }
+        if (pc != end)
+        {
+            return std::nullopt;
+        }
+        return std::move(cells);
+    }
+
+private:
+    void moves(size_t keep)
+    {
+        size_t last = pc;
+        while (last < end && (cmds.at(last).inst == RIGHT || cmds.at(last).inst == LEFT))
+        {
+            last++;
+        }
+        for (; pc + keep < last; pc++)
+        {
+            offset += cmds.at(pc).inst == RIGHT ? 1 : -1;
+        }
+    }
+
+    bool bind(char name, int at)
+    {
+        const auto it = cells.find(name);
+        if (it == cells.end())
+        {
+            cells[name] = at;
+            return true;
+        }
+        return it->second == at;
+    }
+
+    // Matches MULADDs from the current cell followed by its CLEAR.
+    // The MULADDs of a lowered loop commute, so any order binds.
+    bool transfer(std::string_view group)
+    {
+        struct Target
+        {
+            int factor;
+            char name;
+            int relative;
+        };
+        std::pmr::vector<Target> targets(cells.get_allocator());
+        while (!group.empty())
+        {
+            const auto space = group.find(' ');
+            const auto word = group.substr(0, space);
+            group.remove_prefix(space == std::string_view::npos ? group.size() : space + 1);
+            if (word.empty())
+            {
+                continue;
+            }
+            Target t{1, 0, 0};
+            size_t k = 0;
+            if (word.at(0) == '-')
+            {
+                t.factor = -1;
+                k++;
+            }
+            for (; k < word.size(); k++)
+            {
+                if (word.at(k) == '>')
+                    t.relative++;
+                else if (word.at(k) == '<')
+                    t.relative--;
+                else
+                    t.name = word.at(k);
+            }
+            targets.push_back(t);
+        }
+
+        std::pmr::vector<size_t> found(cells.get_allocator());
+        for (; pc < end && cmds.at(pc).inst == MULADD; pc++)
+        {
+            found.push_back(pc);
+        }
+        if (pc == end || cmds.at(pc).inst != CLEAR || found.size() != targets.size())
+        {
+            return false;
+        }
+        pc++;
+
+        do
+        {
+            Bindings attempt(cells, cells.get_allocator());
+            bool ok = true;
+            for (size_t k = 0; k < targets.size() && ok; k++)
+            {
+                const auto &t = targets.at(k);
+                const auto &cmd = cmds.at(found.at(k));
+                if (cmd.value != t.factor)
+                {
+                    ok = false;
+                }
+                else if (t.name == 0)
+                {
+                    ok = cmd.offset == t.relative;
+                }
+                else
+                {
+                    const auto it = attempt.find(t.name);
+                    const int at = offset + cmd.offset;
+                    ok = it == attempt.end() ? (attempt[t.name] = at, true) : it->second == at;
+                }
+            }
+            if (ok)
+            {
+                cells = attempt;
+                return true;
+            }
+        } while (std::next_permutation(found.begin(), found.end()));
+        return false;
+    }
+
+    const std::vector<Command> &cmds;
+    size_t pc;
+    size_t end;
+    int offset = 0;
+    Bindings cells;
+};
+
+// Puts a native op in front of every loop matching the idiom library.
+std::vector<Command> recognizeIdioms(const std::vector<Command> &cmds, WorkPool &pool,
+                                     CompileBudget *compileBudget = nullptr)
+{
+    const auto recognize = [&](size_t begin, size_t end, CommandBuffer &out)
+    {
+        for (size_t i = begin; i < end; i++)
+        {
+            const auto &cmd = cmds.at(i);
+            if (cmd.inst == LOOP)
+            {
+                // the matchers' bindings are dropped with the loop
+                std::array<std::byte, 2048> buffer;
+                std::pmr::monotonic_buffer_resource scratch(buffer.data(), buffer.size());
+                for (const auto &idiom : idiomLibrary())
+                {
+                    IdiomMatcher matcher(cmds, i, cmd.jumpTo + 1, &scratch);
+                    const auto cells = matcher.match(idiom.pattern);
+                    if (!cells.has_value())
+                    {
+                        continue;
+                    }
+                    const auto native = idiom.extract(cells.value());
+                    if (native.has_value())
+                    {
+                        out.push_back(native.value());
+                        break;
+                    }
+                }
+            }
+            out.push_back(cmd);
+        }
+    };
+    return rewriteNests(cmds, pool, recognize, compileBudget);
+}
+
+// Value range analysis.
+//
+// Cells are tracked as an interval plus known bits, starting from the
+// zeroed tape. Positions are relative to an anchor that stays fixed
+// across loops whose body has no net movement; after any other loop
+// nothing is known and the anchor is reset.
+
+struct CellRange
+{
+    int lo = 0;
+    int hi = 255;
+    // bits known to be 0 and known to be 1
+    uint8_t zeros = 0;
+    uint8_t ones = 0;
+};
+
+CellRange exactRange(int value)
+{
+    value &= 0xff;
+    return {value, value, static_cast<uint8_t>(~value), static_cast<uint8_t>(value)};
+}
+
+bool isConstant(const CellRange &r) { return r.lo == r.hi; }
+bool mayBeZero(const CellRange &r) { return r.lo == 0 && r.ones == 0; }
+bool isTop(const CellRange &r) { return r.lo == 0 && r.hi == 255 && r.zeros == 0 && r.ones == 0; }
+
+bool operator==(const CellRange &a, const CellRange &b)
+{
+    return a.lo == b.lo && a.hi == b.hi && a.zeros == b.zeros && a.ones == b.ones;
+}
+
+CellRange joinRange(const CellRange &a, const CellRange &b)
+{
+    return {std::min(a.lo, b.lo), std::max(a.hi, b.hi),
+            static_cast<uint8_t>(a.zeros & b.zeros), static_cast<uint8_t>(a.ones & b.ones)};
+}
+
+// number of low bits whose value is known
+int knownLowBits(const CellRange &r)
+{
+    int n = 0;
+    while (n < 8 && ((r.zeros | r.ones) >> n & 1))
+    {
+        n++;
+    }
+    return n;
+}
+
+CellRange addConstant(const CellRange &r, int k)
+{
+    k &= 0xff;
+    if (isConstant(r))
+        return exactRange(r.lo + k);
+
+    CellRange out;
+    if (r.hi + k <= 255)
+        out.lo = r.lo + k, out.hi = r.hi + k;
+    else if (r.lo + k >= 256)
+        out.lo = r.lo + k - 256, out.hi = r.hi + k - 256;
+
+    // the carry into a bit only depends on the bits below it
+    const int known = knownLowBits(r);
+    const int mask = (1 << known) - 1;
+    const int low = (r.ones + k) & mask;
+    out.zeros = ~low & mask;
+    out.ones = low & mask;
+    return out;
+}
+
+CellRange mulAdd(const CellRange &dst, const CellRange &src, int factor)
+{
+    if (isConstant(dst) && isConstant(src))
+        return exactRange(dst.lo + src.lo * factor);
+
+    CellRange out;
+    const int a = src.lo * factor, b = src.hi * factor;
+    const int lo = dst.lo + std::min(a, b), hi = dst.hi + std::max(a, b);
+    if (lo >= 0 && hi <= 255)
+        out.lo = lo, out.hi = hi;
+
+    auto trailingZeros = [](const CellRange &r) {
+        int n = 0;
+        while (n < 8 && (r.zeros >> n & 1))
+            n++;
+        return n;
+    };
+    int tzFactor = 0;
+    while (tzFactor < 8 && factor != 0 && (factor >> tzFactor & 1) == 0)
+        tzFactor++;
+    const int tz = std::min(trailingZeros(dst), std::min(8, trailingZeros(src) + tzFactor));
+    out.zeros = (1 << tz) - 1;
+    return out;
+}
+
+CellRange refineNonzero(CellRange r)
+{
+    if (r.lo == 0 && r.hi > 0)
+        r.lo = 1;
+    return r;
+}
+
+struct TapeState
+{
+    TapeState() = default;
+    explicit TapeState(std::pmr::memory_resource *memory) : cells(memory) {}
+    // a copy keeps its cells where the original's are
+    TapeState(const TapeState &other)
+        : pos(other.pos), pristine(other.pristine), cells(other.cells, other.cells.get_allocator()) {}
+    TapeState(TapeState &&) = default;
+    TapeState &operator=(const TapeState &) = default;
+    TapeState &operator=(TapeState &&) = default;
+
+    int pos = 0;
+    // cells not listed are zero while the tape is pristine, unknown after
+    bool pristine = true;
+    std::pmr::map<int, CellRange> cells;
+
+    CellRange get(int at) const
+    {
+        const auto it = cells.find(at);
+        if (it != cells.end())
+            return it->second;
+        return pristine ? exactRange(0) : CellRange();
+    }
+
+    void set(int at, const CellRange &r)
+    {
+        if (!pristine && isTop(r))
+            cells.erase(at);
+        else
+            cells[at] = r;
+    }
+};
+
+TapeState joinState(const TapeState &a, const TapeState &b, bool widen)
+{
+    TapeState out(a.cells.get_allocator().resource());
+    out.pos = a.pos;
+    out.pristine = a.pristine && b.pristine;
+    std::pmr::vector<int> keys(a.cells.get_allocator());
+    keys.reserve(a.cells.size() + b.cells.size());
+    for (const auto &[at, r] : a.cells)
+        keys.push_back(at);
+    for (const auto &[at, r] : b.cells)
+        keys.push_back(at);
+    for (const int at : keys)
+    {
+        const auto ra = a.get(at), joined = joinRange(ra, b.get(at));
+        out.set(at, widen && !(joined == ra) ? CellRange() : joined);
+    }
+    return out;
+}
+
+bool sameState(const TapeState &a, const TapeState &b)
+{
+    if (a.pristine != b.pristine)
+        return false;
+    for (const auto &[at, r] : a.cells)
+        if (!(b.get(at) == r))
+            return false;
+    for (const auto &[at, r] : b.cells)
+        if (!(a.get(at) == r))
+            return false;
+    return true;
+}
+
+// Loops whose body moves the pointer by the same amount on every path.
+std::vector<bool> balancedLoops(const std::vector<Command> &cmds)
+{
+    std::vector<bool> balanced(cmds.size(), false);
+    std::stack<std::pair<int, bool>> open;
+    for (size_t i = 0; i < cmds.size(); i++)
+    {
+        switch (cmds.at(i).inst)
+        {
+        case RIGHT:
+        case LEFT:
+            if (!open.empty())
+                open.top().first += cmds.at(i).inst == RIGHT ? 1 : -1;
+            break;
+        case LOOP:
+            open.push({0, true});
+            break;
+        case JMP:
+        {
+            const auto [net, ok] = open.top();
+            open.pop();
+            balanced.at(cmds.at(i).jumpTo) = net == 0 && ok;
+            if (!open.empty() && !(net == 0 && ok))
+                open.top().second = false;
+            break;
+        }
+        default:
+            break;
+        }
+    }
+    return balanced;
+}
+
+class RangeAnalysis
+{
+public:
+    // Under a compile budget, the analysis gives up with BudgetSpent
+    // once the time is up.
+    explicit RangeAnalysis(const std::vector<Command> &cmds, const CompileBudget *compileBudget = nullptr)
+        : cmds(cmds), balanced(balancedLoops(cmds)), facts(cmds.size()), firstOnly(cmds.size()),
+          compileBudget(compileBudget), windows(cmds.size()), summaries(cmds.size()) {}
+
+    // Range of the cell under the pointer at each LOOP (on entry), MULADD
+    // and CLEAR, for the commands that are reached at all, from the given
+    // state on entry. Loops nested deeper than maxDepth, or touching more
+    // than maxWindow cells, are not looked into: what they write is
+    // unknown after them, and nothing inside them gets a fact.
+    std::vector<std::optional<CellRange>> run(const TapeState &entry = TapeState())
+    {
+        TapeState start(&memory);
+        start = entry;
+        block(0, cmds.size(), start);
+        return facts;
+    }
+
+    // Offsets from each loop's cell that are constant on first entry
+    // but not on later iterations.
+    const std::vector<std::vector<int>> &firstIteration() const { return firstOnly; }
+
+private:
+    static const int maxDepth = 64;
+    static const size_t maxWindow = 4096;
+    static const size_t fixpointCells = 256;
+    // analyses of a loop before its entry state is widened
+    static const int widenAfter = 8;
+
+    // A loop's last analysis: the cells of its window on entry, relative
+    // to its cell, and on exit. A visit whose state that entry covers
+    // reuses the exit, and the facts the analysis left in the body hold
+    // for it too.
+    struct Summary
+    {
+        TapeState entry;
+        TapeState exit;
+        int analyses = 0;
+    };
+
+    void killCell(TapeState &s, int at) { s.set(s.pos + at, CellRange()); }
+
+    // Offsets from a balanced loop's cell of every cell its body reads
+    // or writes, nested loops included, and of those it writes.
+    struct Window
+    {
+        std::vector<int> touched;
+        std::vector<int> written;
+    };
+
+    const Window &window(size_t i)
+    {
+        auto &cells = windows.at(i);
+        if (!cells.touched.empty())
+        {
+            return cells;
+        }
+        int pos = 0;
+        cells.touched.push_back(0);
+        cells.written.push_back(0);
+        for (size_t j = i + 1; j < cmds.at(i).jumpTo; j++)
+        {
+            const auto &cmd = cmds.at(j);
+            switch (cmd.inst)
+            {
+            case RIGHT:
+            case LEFT:
+                pos += cmd.inst == RIGHT ? 1 : -1;
+                continue;
+            case PLUS:
+            case MINUS:
+            case GET:
+            case CLEAR:
+            case LOOP:
+                cells.written.push_back(pos);
+                break;
+            case ADD:
+            case SET:
+            case MULADD:
+                cells.written.push_back(pos + cmd.offset);
+                break;
+            default:
+                break;
+            }
+            cells.touched.push_back(pos);
+            cells.touched.push_back(pos + cmd.offset);
+        }
+        for (auto *offsets : {&cells.touched, &cells.written})
+        {
+            std::sort(offsets->begin(), offsets->end());
+            offsets->erase(std::unique(offsets->begin(), offsets->end()), offsets->end());
+        }
+        return cells;
+    }
+
+    void block(size_t begin, size_t end, TapeState &s)
+    {
+        for (size_t i = begin; i < end; i++)
+        {
+            if (compileBudget != nullptr && ++visited % 4096 == 0 && compileBudget->spent())
+            {
+                throw BudgetSpent();
+            }
+            const auto &cmd = cmds.at(i);
+            switch (cmd.inst)
+            {
+            case RIGHT:
+                s.pos++;
+                break;
+            case LEFT:
+                s.pos--;
+                break;
+            case PLUS:
+                s.set(s.pos, addConstant(s.get(s.pos), 1));
+                break;
+            case MINUS:
+                s.set(s.pos, addConstant(s.get(s.pos), -1));
+                break;
+            case ADD:
+                s.set(s.pos + cmd.offset, addConstant(s.get(s.pos + cmd.offset), cmd.value));
+                break;
+            case CLEAR:
+                facts.at(i) = s.get(s.pos);
+                s.set(s.pos, exactRange(0));
+                break;
+            case SET:
+                s.set(s.pos + cmd.offset, exactRange(cmd.value));
+                break;
+            case MULADD:
+                facts.at(i) = s.get(s.pos);
+                s.set(s.pos + cmd.offset,
+                      mulAdd(s.get(s.pos + cmd.offset), s.get(s.pos), cmd.value));
+                break;
+            case PUT:
+                break;
+            case GET:
+                killCell(s, 0);
+                break;
+            case DIVMOD:
+            case MUL:
+            case CMP:
+                // same effect as the loop that follows, which is analyzed
+                break;
+            case LOOP:
+                depth++;
+                loop(i, s);
+                depth--;
+                i = cmd.jumpTo;
+                break;
+            case JMP:
+            case BODY:
+                break;
+            }
+        }
+    }
+
+    void loop(size_t i, TapeState &s)
+    {
+        const auto end = cmds.at(i).jumpTo;
+        const auto cond = s.get(s.pos);
+        if (isConstant(cond) && cond.lo == 0)
+        {
+            facts.at(i) = cond;
+            return;
+        }
+        if (!balanced.at(i))
+        {
+            // facts for nested loops, then forget everything
+            facts.at(i) = cond;
+            TapeState top(&memory);
+            top.pristine = false;
+            if (depth <= maxDepth)
+            {
+                block(i + 1, end, top);
+            }
+            s = TapeState(&memory);
+            s.pristine = false;
+            return;
+        }
+
+        // the body only reads and writes its window, so only that is
+        // carried through the fixpoint; a balanced loop has no unbalanced
+        // loop inside, so the tape stays as pristine as it was
+        const auto &cells = window(i);
+        if (depth > maxDepth || cells.touched.size() > maxWindow)
+        {
+            facts.at(i) = cond;
+            for (const int at : cells.written)
+            {
+                killCell(s, at);
+            }
+            s.set(s.pos, exactRange(0));
+            return;
+        }
+        TapeState entry(&memory);
+        entry.pristine = s.pristine;
+        for (const int at : cells.touched)
+        {
+            if (const auto it = s.cells.find(s.pos + at); it != s.cells.end())
+            {
+                entry.cells.emplace(at, it->second);
+            }
+        }
+        auto &summary = summaries.at(i);
+        if (summary.has_value())
+        {
+            auto &last = summary.value();
+            // the first few rounds are redone for any other entry; after
+            // that the entry only grows, and widens
+            const bool early = last.analyses < widenAfter;
+            if (!sameState(early ? entry : joinState(last.entry, entry, false), last.entry))
+            {
+                last.entry = early ? entry : joinState(last.entry, entry, true);
+                last.exit = analyze(i, last.entry);
+                last.analyses++;
+            }
+        }
+        else
+        {
+            summary = Summary{entry, analyze(i, entry), 1};
+        }
+
+        const auto &exit = summary.value().exit;
+        for (const int at : cells.written)
+        {
+            if (const auto it = exit.cells.find(at); it != exit.cells.end())
+            {
+                s.cells.insert_or_assign(s.pos + at, it->second);
+            }
+            else
+            {
+                s.cells.erase(s.pos + at);
+            }
+        }
+    }
+
+    // The state after a balanced loop entered in s, which holds its
+    // window with the loop's cell at 0.
+    TapeState analyze(size_t i, const TapeState &s)
+    {
+        const auto end = cmds.at(i).jumpTo;
+        const auto cond = s.get(0);
+        facts.at(i) = cond;
+        if (window(i).touched.size() > fixpointCells)
+        {
+            // every pass would copy and join the whole window, so the
+            // cells it writes are taken as unknown from the start, which
+            // holds on every iteration, and the body is gone through once
+            TapeState in = s;
+            for (const int at : window(i).written)
+            {
+                in.set(at, CellRange());
+            }
+            TapeState pass = in;
+            pass.set(0, refineNonzero(cond));
+            block(i + 1, end, pass);
+            firstOnly.at(i).clear();
+            for (const auto &[at, r] : s.cells)
+            {
+                if (isConstant(r) && !isConstant(in.get(at)))
+                    firstOnly.at(i).push_back(at);
+            }
+            in.set(0, exactRange(0));
+            return in;
+        }
+
+        // the part before BODY runs once, on entry
+        size_t body = i;
+        for (size_t j = i + 1; j < end; j = cmds.at(j).inst == LOOP ? cmds.at(j).jumpTo + 1 : j + 1)
+        {
+            if (cmds.at(j).inst == BODY)
+                body = j;
+        }
+        // the body only ever sees the state after that part
+        TapeState in = s;
+        if (body != i)
+        {
+            in.set(0, refineNonzero(cond));
+            block(i + 1, body, in);
+        }
+
+        for (int iteration = 0;; iteration++)
+        {
+            TapeState next = in;
+            next.set(0, refineNonzero(next.get(0)));
+            block(body + 1, end, next);
+            next = joinState(in, next, iteration >= 2);
+            if (sameState(next, in))
+                break;
+            in = next;
+        }
+
+        firstOnly.at(i).clear();
+        for (const auto &[at, r] : s.cells)
+        {
+            if (isConstant(r) && !isConstant(in.get(at)))
+                firstOnly.at(i).push_back(at);
+        }
+        if (body != i)
+        {
+            in = joinState(in, s, false);
+        }
+        in.set(0, exactRange(0));
+        return in;
+    }
+
+    const std::vector<Command> &cmds;
+    std::vector<bool> balanced;
+    std::vector<std::optional<CellRange>> facts;
+    std::vector<std::vector<int>> firstOnly;
+    const CompileBudget *compileBudget;
+    size_t visited = 0;
+    int depth = 0;
+    // the states' cells, which are copied and dropped at every loop;
+    // all of it goes when the analysis does
+    std::pmr::unsynchronized_pool_resource memory;
+    std::vector<Window> windows;
+    std::vector<std::optional<Summary>> summaries;
+};
+
+bool isIdiom(Instruction inst)
+{
+    return inst == DIVMOD || inst == MUL || inst == CMP;
+}
+
+// Loops that run a known number of times with a straight-line body are
+// folded to ADDs when they only add constants, or unrolled when small.
+bool expandCountedLoop(const std::vector<Command> &cmds, size_t i, int count,
+                       CommandBuffer &out)
+{
+    const size_t end = cmds.at(i).jumpTo;
+    std::pmr::map<int, int> deltas(out.get_allocator().resource());
+    int pos = 0;
+    bool onlyAdds = true;
+    for (size_t j = i + 1; j < end; j++)
+    {
+        const auto &cmd = cmds.at(j);
+        switch (cmd.inst)
+        {
+        case RIGHT:
+            pos++;
+            break;
+        case LEFT:
+            pos--;
+            break;
+        case PLUS:
+        case MINUS:
+            deltas[pos] += cmd.inst == PLUS ? 1 : -1;
+            break;
+        case ADD:
+            deltas[pos + cmd.offset] += cmd.value;
+            break;
+        case SET:
+            if (pos + cmd.offset == 0)
+                return false;
+            onlyAdds = false;
+            break;
+        case PUT:
+        case MULADD:
+            onlyAdds = false;
+            if (cmd.inst == MULADD && pos + cmd.offset == 0)
+                return false;
+            break;
+        case CLEAR:
+        case GET:
+            if (pos == 0)
+                return false;
+            onlyAdds = false;
+            break;
+        default:
+            return false;
+        }
+    }
+    const int step = deltas[0];
+    if (pos != 0 || step % 256 == 0)
+    {
+        return false;
+    }
+    int trips = 1;
+    while (trips <= 256 && ((count + trips * step) & 0xff) != 0)
+    {
+        trips++;
+    }
+    if (trips > 256)
+    {
+        // the cell never reaches zero
+        return false;
+    }
+
+    if (onlyAdds)
+    {
+        for (const auto &[offset, delta] : deltas)
+        {
+            if (offset != 0 && (delta * trips) % 256 != 0)
+            {
+                out.emplace_back(ADD, offset, wrapByte(delta * trips));
+            }
+        }
+        out.emplace_back(CLEAR, 0, 0);
+        return true;
+    }
+
+    const size_t unrollLimit = 256;
+    if (trips * (end - i - 1) > unrollLimit)
+    {
+        return false;
+    }
+    for (int t = 0; t < trips; t++)
+    {
+        out.insert(out.end(), cmds.begin() + i + 1, cmds.begin() + end);
+    }
+    return true;
+}
+
+// Drops loops that never run, expands counted loops, and marks loops
+// whose cell is nonzero on entry so codegen can skip the first test.
+// MULADDs from a constant cell become ADDs, and clears of a zero go.
+// The tape is zeroed on entry unless entry says otherwise.
+std::vector<Command> propagateRanges(const std::vector<Command> &cmds, WorkPool &pool,
+                                     const TapeState &entry = TapeState(), CompileBudget *compileBudget = nullptr)
+{
+    // the analysis follows the pointer through the whole program; only
+    // rewriting with its facts splits up
+    const auto facts = RangeAnalysis(cmds, compileBudget).run(entry);
+    const auto propagate = [&](size_t begin, size_t end, CommandBuffer &out)
+    {
+        for (size_t i = begin; i < end; i++)
+        {
+            auto cmd = cmds.at(i);
+            if (!facts.at(i).has_value())
+            {
+                out.push_back(cmd);
+                continue;
+            }
+            const auto known = facts.at(i).value();
+
+            if (cmd.inst == CLEAR && isConstant(known) && known.lo == 0)
+            {
+                continue;
+            }
+            if (cmd.inst == MULADD && isConstant(known))
+            {
+                const int product = wrapByte(known.lo * cmd.value);
+                if (product != 0)
+                {
+                    out.emplace_back(ADD, cmd.offset, product);
+                }
+                continue;
+            }
+            if (cmd.inst != LOOP)
+            {
+                out.push_back(cmd);
+                continue;
+            }
+
+            // an idiom op in front belongs to this loop and goes with it
+            const bool guarded = !out.empty() && isIdiom(out.back().inst);
+            CommandBuffer expanded(out.get_allocator());
+            if (isConstant(known) && (known.lo == 0 || expandCountedLoop(cmds, i, known.lo, expanded)))
+            {
+                if (guarded)
+                    out.pop_back();
+                extend(out, expanded);
+                i = cmd.jumpTo;
+                continue;
+            }
+            cmd.value = mayBeZero(known) ? 0 : 1;
+            out.push_back(cmd);
+        }
+    };
+    return rewriteNests(cmds, pool, propagate, compileBudget);
+}
+
+// Loop-invariant code motion and first-iteration peeling.
+//
+// Both fill the part of a loop between LOOP and BODY, which runs once
+// when the loop is entered. A cell whose accesses in the body are a
+// store followed by adds and MULADDs from cells the loop never writes,
+// with nothing reading it, ends every iteration with the same value, so
+// those ops move out of the body. A loop whose body reads cells that are
+// only constant on the first iteration gets that iteration peeled, for
+// the next range pass to fold.
+
+struct Placed
+{
+    int pos;
+    int depth;
+};
+
+// Pointer position and nesting depth of each command of a balanced body.
+std::pmr::vector<Placed> placeCommands(const CommandBuffer &body)
+{
+    std::pmr::vector<Placed> placed(body.get_allocator());
+    placed.reserve(body.size());
+    int pos = 0, depth = 0;
+    for (const auto &cmd : body)
+    {
+        if (cmd.inst == JMP)
+            depth--;
+        placed.push_back({pos, depth});
+        if (cmd.inst == LOOP)
+            depth++;
+        pos += cmd.inst == RIGHT ? 1 : cmd.inst == LEFT ? -1 : 0;
+    }
+    return placed;
+}
+
+// Removes the invariant stores from a loop body and returns them, with
+// their offsets taken from the loop's cell. Working memory comes from
+// the body's allocator.
+CommandBuffer hoistInvariants(CommandBuffer &body)
+{
+    const auto alloc = body.get_allocator();
+    const auto placed = placeCommands(body);
+    std::pmr::vector<int> written(alloc), blocked({0}, alloc);
+    std::pmr::map<int, std::pmr::vector<size_t>> stores(alloc);
+    for (size_t k = 0; k < body.size(); k++)
+    {
+        const auto &cmd = body.at(k);
+        const int p = placed.at(k).pos;
+        std::optional<int> target;
+        switch (cmd.inst)
+        {
+        case PLUS:
+        case MINUS:
+        case CLEAR:
+            target = p;
+            break;
+        case SET:
+        case ADD:
+            target = p + cmd.offset;
+            break;
+        case MULADD:
+            target = p + cmd.offset;
+            blocked.push_back(p);
+            break;
+        case GET:
+            written.push_back(p);
+            blocked.push_back(p);
+            break;
+        case PUT:
+        case LOOP:
+        case JMP:
+        case BODY:
+            blocked.push_back(p);
+            break;
+        case DIVMOD:
+        case MUL:
+        case CMP:
+            for (const int at : {0, cmd.args.at(0), cmd.args.at(0) + 1, cmd.args.at(0) + 2,
+                                 cmd.args.at(0) + 3, cmd.args.at(0) + 4, cmd.args.at(1), cmd.args.at(2)})
+            {
+                written.push_back(p + at);
+                blocked.push_back(p + at);
+            }
+            break;
+        default:
+            break;
+        }
+        if (target.has_value())
+        {
+            written.push_back(*target);
+            if (placed.at(k).depth > 0)
+                blocked.push_back(*target);
+            else
+                stores[*target].push_back(k);
+        }
+    }
+    auto contains = [](const std::pmr::vector<int> &cells, int at) {
+        return std::find(cells.begin(), cells.end(), at) != cells.end();
+    };
+
+    std::pmr::vector<bool> hoisted(body.size(), false, alloc);
+    std::pmr::vector<std::pair<size_t, int>> order(alloc);
+    for (const auto &[at, ks] : stores)
+    {
+        const auto first = body.at(ks.front()).inst;
+        bool invariant = !contains(blocked, at) && (first == CLEAR || first == SET);
+        for (const size_t k : ks)
+        {
+            if (body.at(k).inst == MULADD && contains(written, placed.at(k).pos))
+                invariant = false;
+        }
+        if (invariant)
+        {
+            order.emplace_back(ks.front(), at);
+            for (const size_t k : ks)
+                hoisted.at(k) = true;
+        }
+    }
+    std::sort(order.begin(), order.end());
+
+    CommandBuffer pre(alloc);
+    for (const auto &[firstIndex, at] : order)
+    {
+        for (const size_t k : stores.at(at))
+        {
+            const auto &cmd = body.at(k);
+            const int p = placed.at(k).pos;
+            switch (cmd.inst)
+            {
+            case CLEAR:
+                pre.emplace_back(SET, at, 0);
+                break;
+            case SET:
+                pre.emplace_back(SET, at, cmd.value);
+                break;
+            case PLUS:
+            case MINUS:
+                pre.emplace_back(ADD, at, cmd.inst == PLUS ? 1 : -1);
+                break;
+            case ADD:
+                pre.emplace_back(ADD, at, cmd.value);
+                break;
+            case MULADD:
+                for (int m = 0; m < std::abs(p); m++)
+                    pre.emplace_back(p > 0 ? RIGHT : LEFT, 0);
+                pre.emplace_back(MULADD, at - p, cmd.value);
+                for (int m = 0; m < std::abs(p); m++)
+                    pre.emplace_back(p > 0 ? LEFT : RIGHT, 0);
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    CommandBuffer kept(alloc);
+    kept.reserve(body.size());
+    for (size_t k = 0; k < body.size(); k++)
+    {
+        if (!hoisted.at(k))
+            kept.push_back(body.at(k));
+    }
+    body = std::move(kept);
+    return pre;
+}
+
+class LoopMotion
+{
+public:
+    LoopMotion(const std::vector<Command> &cmds, CompileBudget *compileBudget)
+        : cmds(cmds), balanced(balancedLoops(cmds)), compileBudget(compileBudget)
+    {
+        RangeAnalysis analysis(cmds, compileBudget);
+        facts = analysis.run();
+        firstOnly = analysis.firstIteration();
+    }
+
+    std::vector<Command> run(WorkPool &pool)
+    {
+        return rewriteNests(
+            cmds, pool, [this](size_t begin, size_t end, CommandBuffer &out) { block(begin, end, out); },
+            compileBudget);
+    }
+
+private:
+    // Inner loops are done first, in place at the end of out.
+    void block(size_t begin, size_t end, CommandBuffer &out)
+    {
+        for (size_t i = begin; i < end; i++)
+        {
+            const auto &cmd = cmds.at(i);
+            out.push_back(cmd);
+            if (cmd.inst != LOOP)
+            {
+                continue;
+            }
+            const auto mark = out.size();
+            block(i + 1, cmd.jumpTo, out);
+            transform(i, out, mark);
+            out.push_back(cmds.at(cmd.jumpTo));
+            i = cmd.jumpTo;
+        }
+    }
+
+    // Rewrites the body of the loop, which is what out holds from mark on.
+    void transform(size_t loop, CommandBuffer &out, size_t mark)
+    {
+        const bool fresh = std::none_of(out.begin() + mark, out.end(),
+                                        [](const Command &c) { return c.inst == BODY; });
+        if (!facts.at(loop).has_value() || !balanced.at(loop) || !fresh)
+        {
+            return;
+        }
+
+        // the copies made here are dropped with the loop; a large body
+        // spills to the heap rather than filling the run's arena
+        std::array<std::byte, 16384> buffer;
+        std::pmr::monotonic_buffer_resource scratch(buffer.data(), buffer.size());
+        const CommandBuffer body(out.begin() + mark, out.end(), &scratch);
+        const size_t peelLimit = 64;
+        bool peel = false;
+        const auto placed = placeCommands(body);
+        const auto &constant = firstOnly.at(loop);
+        for (size_t k = 0; k < body.size() && body.size() <= peelLimit; k++)
+        {
+            const auto inst = body.at(k).inst;
+            if ((inst == LOOP || inst == MULADD) &&
+                std::find(constant.begin(), constant.end(), placed.at(k).pos) != constant.end())
+            {
+                peel = true;
+            }
+        }
+
+        CommandBuffer steady(body, &scratch);
+        const auto pre = hoistInvariants(steady);
+        if (!peel && pre.empty())
+        {
+            return;
+        }
+        // a peeled loop runs its whole body once in front
+        Command marker(BODY, 0);
+        marker.value = peel ? 0 : 1;
+        if (!peel)
+        {
+            out.erase(out.begin() + mark, out.end());
+            extend(out, pre);
+        }
+        out.push_back(marker);
+        extend(out, steady);
+    }
+
+    const std::vector<Command> &cmds;
+    std::vector<bool> balanced;
+    CompileBudget *compileBudget;
+    std::vector<std::optional<CellRange>> facts;
+    std::vector<std::vector<int>> firstOnly;
+};
+
+std::vector<Command> hoistAndPeel(const std::vector<Command> &cmds, WorkPool &pool,
+                                  CompileBudget *compileBudget = nullptr)
+{
+    return LoopMotion(cmds, compileBudget).run(pool);
+}
+
+// Work of a pass that visits each command about once per loop around
+// it, as the analyses of ranges and motion do.
+double nestedWork(const std::vector<Command> &cmds)
+{
+    double work = 0;
+    size_t depth = 0;
+    for (const auto &cmd : cmds)
+    {
+        depth -= cmd.inst == JMP ? 1 : 0;
+        work += depth + 1;
+        depth += cmd.inst == LOOP ? 1 : 0;
+    }
+    return work;
+}
+
+std::vector<Command> optimize(const std::vector<Command> &cmds, WorkPool &pool, CompileStats *stats = nullptr,
+                              CompileBudget *compileBudget = nullptr)
+{
+    std::vector<Command> program;
+    const auto *current = &cmds;
+    // a pass the budget turns down, or whose analysis runs out of time,
+    // leaves the program as it was
+    const auto pass = [&](const char *name, double work, const auto &apply)
+    {
+        if (compileBudget == nullptr)
+        {
+            program = apply(*current);
+            current = &program;
+        }
+        else if (compileBudget->admit(name, work))
+        {
+            try
+            {
+                program = apply(*current);
+                current = &program;
+                compileBudget->charge();
+            }
+            catch (const BudgetSpent &)
+            {
+                compileBudget->skip(name, "out of time part way");
+            }
+        }
+        if (stats != nullptr)
+        {
+            stats->mark(name);
+        }
+    };
+    // work is weighed against lowering, which takes a command at a time;
+    // the weights are as measured on large generated programs
+    pass("lower", current->size(),
+         [&](const auto &p) { return lowerSimpleLoops(p, pool, compileBudget); });
+    pass("idioms", 1.2 * current->size(),
+         [&](const auto &p) { return recognizeIdioms(p, pool, compileBudget); });
+    pass("ranges", 0.5 * nestedWork(*current),
+         [&](const auto &p) { return propagateRanges(p, pool, TapeState(), compileBudget); });
+    pass("motion", 0.5 * nestedWork(*current),
+         [&](const auto &p) { return hoistAndPeel(p, pool, compileBudget); });
+    pass("ranges", 0.5 * nestedWork(*current),
+         [&](const auto &p) { return propagateRanges(p, pool, TapeState(), compileBudget); });
+    if (current == &cmds)
+    {
+        return cmds;
+    }
+    return program;
+}
+
+// Line and column of each instruction in the source text. Chunks are
+// scanned in parallel twice: once to count the instructions and newlines
+// in each, then, knowing where each one starts, to fill in positions.
+std::vector<std::pair<size_t, size_t>> locateInstructions(const std::string &text)
+{
+    // instructions and newlines in a chunk, and characters after its
+    // last newline; or, once summed, where a chunk starts
+    struct Span
+    {
+        size_t insts = 0;
+        size_t lines = 0;
+        size_t column = 0;
+    };
+    const auto chunks = chunkCount(text.size());
+    std::vector<Span> spans(chunks);
+    forChunks(text.size(), chunks,
+              [&](size_t c, size_t begin, size_t end)
+              {
+                  auto &span = spans[c];
+                  for (size_t at = begin; at < end; at++)
+                  {
+                      span.insts += readChar(text[at]).has_value() ? 1 : 0;
+                      span.column = text[at] == '\n' ? 0 : span.column + 1;
+                      span.lines += text[at] == '\n' ? 1 : 0;
+                  }
+              });
+    Span start{0, 1, 1};
+    for (auto &span : spans)
+    {
+        const auto next = Span{start.insts + span.insts, start.lines + span.lines,
+                               span.lines > 0 ? span.column + 1 : start.column + span.column};
+        span = start;
+        start = next;
+    }
+
+    std::vector<std::pair<size_t, size_t>> locations(start.insts);
+    forChunks(text.size(), chunks,
+              [&](size_t c, size_t begin, size_t end)
+              {
+                  auto [index, line, column] = spans[c];
+                  for (size_t at = begin; at < end; at++)
+                  {
+                      if (readChar(text[at]).has_value())
+                      {
+                          locations[index++] = {line, column};
+                      }
+                      if (text[at] == '\n')
+                      {
+                          line++;
+                          column = 1;
+                      }
+                      else
+                      {
+                          column++;
+                      }
+                  }
+              });
+    return locations;
+}
+
+// Compiled bytecode. A .bfb file holds a program as the optimizer left
+// it, with jump targets resolved, the tape layout planned for it and the
+// source position of each instruction for diagnostics. Running one maps
+// the file and checks it instead of parsing and optimizing again.
+//
+// The header is followed by the command records, then a line and column
+// per instruction. The checksum covers everything after the header; it
+// catches a damaged or truncated file, not a forged one, which is
+// trusted like any executable bfc writes.
+const uint32_t bytecodeMagic = 0x31424642;
+const uint32_t bytecodeVersion = 1;
+
+struct BytecodeHeader
+{
+    uint32_t magic = bytecodeMagic;
+    uint32_t version = bytecodeVersion;
+    uint64_t commands = 0;
+    uint64_t positions = 0;
+    int64_t cells = 0;
+    int64_t origin = 0;
+    int32_t stride = 1;
+    // 1 for a guarded tape, 2 for a sparse one
+    uint32_t flags = 0;
+    uint64_t checksum = 0;
+};
+
+struct BytecodeCommand
+{
+    uint32_t inst;
+    uint32_t jumpTo;
+    int32_t offset;
+    int32_t value;
+    std::array<int32_t, 3> args;
+    uint32_t source;
+};
+
+static_assert(sizeof(BytecodeHeader) == 56 && sizeof(BytecodeCommand) == 32);
+
+struct Bytecode
+{
+    std::vector<Command> program;
+    TapeLayout tape;
+    std::vector<std::pair<size_t, size_t>> locations;
+};
+
+// FNV-1a over 64-bit words, so checking a large file stays cheap
+uint64_t bytecodeChecksum(const uint8_t *data, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    size_t at = 0;
+    for (; at + 8 <= size; at += 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, data + at, 8);
+        hash = (hash ^ word) * 0x100000001b3;
+    }
+    for (; at < size; at++)
+    {
+        hash = (hash ^ data[at]) * 0x100000001b3;
+    }
+    return hash;
+}
+
+bool isBytecodeFile(const std::string &filename)
+{
+    return fs::path(filename).extension() == ".bfb";
+}
+
+// Written next to path and renamed over it, like a snapshot.
+void writeBytecode(const std::string &path, const Bytecode &code)
+{
+    if (std::max(code.program.size(), code.locations.size()) > std::numeric_limits<uint32_t>::max())
+    {
+        throw std::runtime_error("program too large for bytecode");
+    }
+    std::string payload;
+    payload.reserve(code.program.size() * sizeof(BytecodeCommand) + code.locations.size() * 8);
+    for (const auto &cmd : code.program)
+    {
+        BytecodeCommand record{};
+        record.inst = cmd.inst;
+        record.offset = cmd.offset;
+        record.jumpTo = cmd.jumpTo;
+        record.value = cmd.value;
+        std::copy(cmd.args.begin(), cmd.args.end(), record.args.begin());
+        record.source = cmd.source;
+        payload.append(reinterpret_cast<const char *>(&record), sizeof record);
+    }
+    for (const auto &[line, column] : code.locations)
+    {
+        const uint32_t position[] = {static_cast<uint32_t>(line), static_cast<uint32_t>(column)};
+        payload.append(reinterpret_cast<const char *>(position), sizeof position);
+    }
+
+    BytecodeHeader header;
+    header.commands = code.program.size();
+    header.positions = code.locations.size();
+    header.cells = code.tape.cells;
+    header.origin = code.tape.origin;
+    header.stride = code.tape.stride;
+    header.flags = (code.tape.guarded ? 1 : 0) | (code.tape.sparse ? 2 : 0);
+    header.checksum = bytecodeChecksum(reinterpret_cast<const uint8_t *>(payload.data()), payload.size());
+
+    const auto temporary = path + ".tmp";
+    std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char *>(&header), sizeof header);
+    out.write(payload.data(), payload.size());
+    out.close();
+    if (!out)
+    {
+        fs::remove(temporary);
+        throw std::runtime_error("could not write " + temporary);
+    }
+    fs::rename(temporary, path);
+}
+
+// Jump targets must pair up the way relink leaves them, so that no
+// engine follows one out of the program.
+bool wellLinked(const std::vector<Command> &cmds, size_t positions)
+{
+    std::vector<size_t> loops;
+    for (size_t i = 0; i < cmds.size(); i++)
+    {
+        const auto &cmd = cmds.at(i);
+        if (cmd.source >= positions || cmd.jumpTo >= cmds.size())
+        {
+            return false;
+        }
+        switch (cmd.inst)
+        {
+        case LOOP:
+            loops.push_back(i);
+            if (cmds.at(cmd.jumpTo).inst != JMP || cmds.at(cmd.jumpTo).jumpTo != i)
+            {
+                return false;
+            }
+            break;
+        case JMP:
+            if (loops.empty() || loops.back() != cmd.jumpTo)
+            {
+                return false;
+            }
+            loops.pop_back();
+            break;
+        case BODY:
+            if (loops.empty() || loops.back() != cmd.jumpTo)
+            {
+                return false;
+            }
+            break;
+        case DIVMOD:
+        case MUL:
+        case CMP:
+            if (i + 1 == cmds.size() || cmds.at(i + 1).jumpTo != cmd.jumpTo)
+            {
+                return false;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return loops.empty();
+}
+
+// Maps the file read-only and builds the program straight from its
+// records.
+Bytecode readBytecode(const std::string &path)
+{
+    const auto bad = [&](const std::string &why)
+    { return std::runtime_error(path + ": " + why); };
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        throw bad("could not read");
+    }
+    const auto size = static_cast<size_t>(info.st_size);
+    void *mapping = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        throw bad(size > 0 ? "could not map" : "not a bytecode file");
+    }
+    struct Unmap
+    {
+        void *mapping;
+        size_t size;
+        ~Unmap() { munmap(mapping, size); }
+    } unmap{mapping, size};
+    const auto *data = static_cast<const uint8_t *>(mapping);
+
+    BytecodeHeader header;
+    if (size < sizeof header)
+    {
+        throw bad("not a bytecode file");
+    }
+    std::memcpy(&header, data, sizeof header);
+    if (header.magic != bytecodeMagic)
+    {
+        throw bad("not a bytecode file");
+    }
+    if (header.version != bytecodeVersion)
+    {
+        throw bad("bytecode version " + std::to_string(header.version) + " is not supported");
+    }
+    const auto payload = size - sizeof header;
+    if (header.commands > payload / sizeof(BytecodeCommand) ||
+        header.positions > (payload - header.commands * sizeof(BytecodeCommand)) / 8 ||
+        header.commands * sizeof(BytecodeCommand) + header.positions * 8 != payload ||
+        bytecodeChecksum(data + sizeof header, payload) != header.checksum)
+    {
+        throw bad("bytecode is damaged");
+    }
+
+    Bytecode code;
+    code.tape.cells = header.cells;
+    code.tape.origin = header.origin;
+    code.tape.stride = header.stride;
+    code.tape.guarded = (header.flags & 1) != 0;
+    code.tape.sparse = (header.flags & 2) != 0;
+    const auto *records = data + sizeof header;
+    code.program.reserve(header.commands);
+    for (uint64_t i = 0; i < header.commands; i++)
+    {
+        BytecodeCommand record;
+        std::memcpy(&record, records + i * sizeof record, sizeof record);
+        if (record.inst > CMP)
+        {
+            throw bad("bytecode is damaged");
+        }
+        auto &cmd = code.program.emplace_back(static_cast<Instruction>(record.inst), record.offset, record.value);
+        cmd.jumpTo = record.jumpTo;
+        std::copy(record.args.begin(), record.args.end(), cmd.args.begin());
+        cmd.source = record.source;
+    }
+    const auto *positions = records + header.commands * sizeof(BytecodeCommand);
+    code.locations.reserve(header.positions);
+    for (uint64_t i = 0; i < header.positions; i++)
+    {
+        uint32_t position[2];
+        std::memcpy(position, positions + i * sizeof position, sizeof position);
+        code.locations.emplace_back(position[0], position[1]);
+    }
+    const auto &tape = code.tape;
+    if (!wellLinked(code.program, code.locations.size()) || tape.stride < 1 || tape.cells < 1 ||
+        tape.cells > sparseTapeCells || tape.origin < 0 || tape.origin >= tape.cells)
+    {
+        throw bad("bytecode is damaged");
+    }
+    return code;
+}
+
+// Offsets from the pointer of the cells a command reads or writes.
+// There are at most seven, so they are kept inline rather than on the
+// heap.
+struct TouchedCells
+{
+    TouchedCells() = default;
+    TouchedCells(std::initializer_list<int> offsets) : count(offsets.size())
+    {
+        std::copy(offsets.begin(), offsets.end(), cells.begin());
+    }
+
+    const int *begin() const { return cells.data(); }
+    const int *end() const { return cells.data() + count; }
+
+    std::array<int, 7> cells{};
+    size_t count = 0;
+};
+
+TouchedCells touchedCells(const Command &cmd)
+{
+    const auto &a = cmd.args;
+    switch (cmd.inst)
+    {
+    case RIGHT:
+    case LEFT:
+        return {};
+    case SET:
+    case ADD:
+        return {cmd.offset};
+    case MULADD:
+        return {a.at(0), cmd.offset};
+    case DIVMOD:
+        return {0, a.at(0), a.at(0) + 1, a.at(0) + 2, a.at(0) + 3, a.at(0) + 4, a.at(1)};
+    case MUL:
+        return {cmd.offset, a.at(0), a.at(1), a.at(2)};
+    case CMP:
+        return {0, a.at(0), a.at(0) + 1, a.at(0) + 2, a.at(1)};
+    default:
+        return {cmd.offset};
+    }
+}
+
+// Speculative specialization.
+//
+// The interpreter profiles loops as they are entered: the value of each
+// cell the first iteration is sure to read at a fixed offset, and for
+// every scan how far the pointer lands. When a loop has been entered
+// often enough, the cells that always held the same value and the scans
+// that always landed at the same distance are assumed to keep doing so.
+// The loop is then compiled under those assumptions. The range pass
+// folds it with the assumed cells known, and an assumed scan becomes a
+// check of the cells it passes over and a fixed move. Pointer moves that
+// leave the pointer at a known distance from where the loop was entered
+// are folded into the displacements of the commands that follow.
+//
+// Each assumption is guarded. A failed guard deoptimizes: the exit
+// brings r12 up to the pointer the unspecialized program would have
+// there and resumes the interpreter at the matching command. Nothing
+// else needs restoring, since the tape is always written through. A
+// specialization whose guards keep failing is dropped, and the loop
+// profiled again.
+//
+// The range pass reads logical cells, so a program transposed to a
+// field-major tape is specialized on its scans only.
+class SpeculatingJit
+{
+public:
+    SpeculatingJit(const std::vector<Command> &cmds, bool fieldMajor, std::atomic<long long> *budget = nullptr)
+        : cmds(cmds), interpreter(cmds), budget(budget), balanced(balancedLoops(cmds)), fieldMajor(fieldMajor),
+          loops(cmds.size()), scans(cmds.size()), arena(arenaSize)
+    {
+        interpreter.limit(budget);
+        // entry trampoline: save registers, jump to the code in rcx
+        StencilCode stubs;
+        stubs.place(ST_ENTER, {});
+        stubs.place(ST_JUMP_RCX, {});
+        const auto leave = stubs.place(ST_LEAVE, {});
+        const auto *base = arena.append(stubs.bytes);
+        enter = reinterpret_cast<Entry>(base);
+        leaveStub = base + leave;
+    }
+
+    // runs to the end; false when it stopped at a read that would wait
+    bool run(Machine &m, ProcessIo &io)
+    {
+        // set after a deopt, so the command it resumes at is interpreted
+        bool deopted = false;
+        while (!interpreter.done(m))
+        {
+            const auto pc = m.pc;
+            const bool scan = interpreter.scan(pc) != 0;
+            if (cmds.at(pc).inst == LOOP && !scan && !deopted)
+            {
+                auto &loop = loops.at(pc);
+                if (loop.code != nullptr)
+                {
+                    deopted = runSpecialized(m, io, pc);
+                    continue;
+                }
+                if (loop.rounds < maxRounds)
+                {
+                    profile(m, pc);
+                }
+            }
+            deopted = false;
+            if (interpreter.blocked(m, io))
+            {
+                return false;
+            }
+            const auto before = m.pointer;
+            interpreter.step(m, io);
+            if (cmds.at(pc).inst == LOOP && scan)
+            {
+                scans.at(pc).land(m.pointer - before);
+            }
+        }
+        return true;
+    }
+
+private:
+    // returned in rax and rdx
+    struct Result
+    {
+        long long pointer;
+        long long exit;
+    };
+    using Entry = Result (*)(uint8_t *tape, long long pointer, ProcessIo *io, const uint8_t *target);
+
+    static const int hotLoop = 16;
+    static const int maxMisses = 16;
+    static const int maxRounds = 4;
+    static const size_t maxCells = 16;
+    static const int minScanRuns = 4;
+    static const long long maxScanGuards = 8;
+    static const size_t arenaSize = 16 << 20;
+
+    struct LoopProfile
+    {
+        int entries = 0;
+        // offsets from the pointer on entry, the value each held on the
+        // first entry, and whether it held it every time since
+        std::vector<int> cells;
+        std::vector<uint8_t> values;
+        std::vector<bool> stable;
+        const uint8_t *code = nullptr;
+        int hits = 0;
+        int misses = 0;
+        int rounds = 0;
+    };
+
+    struct ScanProfile
+    {
+        int runs = 0;
+        long long distance = 0;
+        bool stable = true;
+
+        void land(long long moved)
+        {
+            stable = stable && (runs == 0 || moved == distance);
+            distance = moved;
+            runs++;
+        }
+    };
+
+    struct Exit
+    {
+        size_t pc;
+        size_t loop;
+        bool deopt;
+    };
+
+    // Cells the first iteration of a loop reads at a fixed offset: its
+    // own, and those outside inner loops up to the first inner loop that
+    // moves the pointer.
+    std::vector<int> readSet(size_t loop) const
+    {
+        std::vector<int> cells = {cmds.at(loop).offset};
+        if (!balanced.at(loop))
+        {
+            return cells;
+        }
+        const auto add = [&](int cell)
+        {
+            if (cells.size() < maxCells && std::find(cells.begin(), cells.end(), cell) == cells.end())
+            {
+                cells.push_back(cell);
+            }
+        };
+        int pos = 0;
+        for (size_t j = loop + 1; j < cmds.at(loop).jumpTo; j++)
+        {
+            const auto &cmd = cmds.at(j);
+            if (cmd.inst == LOOP)
+            {
+                if (!balanced.at(j))
+                {
+                    break;
+                }
+                // only the test on entry is sure to run
+                add(pos + cmd.offset);
+                j = cmd.jumpTo;
+            }
+            else if (cmd.inst == RIGHT || cmd.inst == LEFT)
+            {
+                pos += cmd.inst == RIGHT ? 1 : -1;
+            }
+            else if (!isIdiom(cmd.inst))
+            {
+                for (const auto offset : touchedCells(cmd))
+                {
+                    add(pos + offset);
+                }
+            }
+        }
+        return cells;
+    }
+
+    void profile(const Machine &m, size_t loop)
+    {
+        auto &profile = loops.at(loop);
+        if (profile.entries == 0)
+        {
+            profile.cells = readSet(loop);
+            profile.values.assign(profile.cells.size(), 0);
+            profile.stable.assign(profile.cells.size(), true);
+        }
+        const auto *at = m.tape + m.pointer;
+        // the other cells may be out of reach when the loop does not run
+        const bool runs = at[cmds.at(loop).offset] != 0;
+        for (size_t k = 0; k < profile.cells.size(); k++)
+        {
+            if (k > 0 && !runs)
+            {
+                profile.stable.at(k) = false;
+                continue;
+            }
+            const auto value = at[profile.cells.at(k)];
+            if (profile.entries == 0)
+            {
+                profile.values.at(k) = value;
+            }
+            else if (profile.values.at(k) != value)
+            {
+                profile.stable.at(k) = false;
+            }
+        }
+        if (++profile.entries == hotLoop)
+        {
+            profile.code = specialize(loop);
+            if (profile.code == nullptr)
+            {
+                profile.rounds = maxRounds;
+            }
+        }
+    }
+
+    // whether the specialized code deoptimized
+    bool runSpecialized(Machine &m, ProcessIo &io, size_t pc)
+    {
+        const auto [pointer, exit] = enter(m.tape, m.pointer, &io, loops.at(pc).code);
+        m.pointer = pointer;
+        const auto &taken = exits.at(exit);
+        m.pc = taken.pc;
+        auto &loop = loops.at(taken.loop);
+        if (!taken.deopt)
+        {
+            loop.hits++;
+            return false;
+        }
+        if (++loop.misses >= maxMisses && loop.misses > loop.hits)
+        {
+            // the assumptions no longer hold; profile again
+            const auto rounds = loop.rounds + 1;
+            loop = LoopProfile();
+            loop.rounds = rounds;
+        }
+        return true;
+    }
+
+    // the distance a scan is assumed to land at, if it is
+    std::optional<long long> assumedLanding(size_t pc, long long step) const
+    {
+        const auto &scan = scans.at(pc);
+        if (scan.runs < minScanRuns || !scan.stable || scan.distance / step > maxScanGuards)
+        {
+            return std::nullopt;
+        }
+        return scan.distance;
+    }
+
+    // Loops of a specialized fragment that leave the pointer where they
+    // found it on every path, counting assumed scans as fixed moves.
+    std::vector<bool> fixedLoops(const std::vector<Command> &code) const
+    {
+        struct Open
+        {
+            long long net = 0;
+            bool ok = true;
+            std::optional<long long> body;
+        };
+        std::vector<bool> fixed(code.size(), false);
+        std::vector<Open> open;
+        for (size_t i = 0; i < code.size(); i++)
+        {
+            const auto &cmd = code.at(i);
+            switch (cmd.inst)
+            {
+            case RIGHT:
+            case LEFT:
+                if (!open.empty())
+                {
+                    open.back().net += cmd.inst == RIGHT ? 1 : -1;
+                }
+                break;
+            case LOOP:
+                if (const auto step = scanStep(code, i); step != 0)
+                {
+                    const auto landing = assumedLanding(cmd.source, step);
+                    if (!open.empty() && landing.has_value())
+                    {
+                        open.back().net += landing.value();
+                    }
+                    else if (!open.empty())
+                    {
+                        open.back().ok = false;
+                    }
+                    i = cmd.jumpTo;
+                    break;
+                }
+                open.push_back({});
+                break;
+            case BODY:
+                open.back().body = open.back().net;
+                break;
+            case JMP:
+            {
+                const auto loop = open.back();
+                open.pop_back();
+                fixed.at(cmd.jumpTo) = loop.ok && loop.net == 0 && loop.body.value_or(0) == 0;
+                if (!open.empty() && !fixed.at(cmd.jumpTo))
+                {
+                    open.back().ok = false;
+                }
+                break;
+            }
+            default:
+                break;
+            }
+        }
+        return fixed;
+    }
+
+    // Compiles a loop under the assumptions its profile supports. The
+    // commands of the fragment keep the index of the command they stand
+    // for in source, which is where a guard on them resumes.
+    const uint8_t *specialize(size_t loop)
+    {
+        const auto &profile = loops.at(loop);
+        const auto &head = cmds.at(loop);
+        std::vector<Command> fragment(cmds.begin() + loop, cmds.begin() + head.jumpTo + 1);
+        for (size_t j = 0; j < fragment.size(); j++)
+        {
+            fragment.at(j).source = loop + j;
+        }
+        relink(fragment);
+
+        TapeState assumed;
+        assumed.pristine = false;
+        for (size_t k = 0; k < profile.cells.size(); k++)
+        {
+            if (profile.stable.at(k) && !fieldMajor)
+            {
+                assumed.set(profile.cells.at(k), exactRange(profile.values.at(k)));
+            }
+        }
+        // a single loop nest, so nothing to split across threads. Under a
+        // run budget the fragment is kept as it is: the counted loops the
+        // assumptions would expand are charged by the interpreter.
+        WorkPool serial(1);
+        const auto code = fieldMajor || budget != nullptr ? fragment : propagateRanges(fragment, serial, assumed);
+        const auto fixed = fixedLoops(code);
+
+        StencilCode out;
+        struct Guard
+        {
+            size_t at;
+            size_t pc;
+            long long pos;
+            bool deopt;
+        };
+        std::vector<Guard> guards;
+        const auto guard = [&](StencilKind kind, std::vector<long long> operands, size_t pc,
+                               long long pos, bool deopt)
+        {
+            operands.push_back(0);
+            guards.push_back({StencilCode::target(kind, out.place(kind, operands)), pc, pos, deopt});
+        };
+
+        // the loop cell goes first: the rest are only read once the loop
+        // is known to run
+        const auto end = head.jumpTo + 1;
+        if (profile.stable.at(0) && !fieldMajor)
+        {
+            guard(ST_GUARD, {head.offset, profile.values.at(0)}, loop, 0, true);
+        }
+        else
+        {
+            guard(ST_JZ, {head.offset}, end, 0, false);
+        }
+        for (size_t k = 1; k < profile.cells.size() && !fieldMajor; k++)
+        {
+            if (profile.stable.at(k))
+            {
+                guard(ST_GUARD, {profile.cells.at(k), profile.values.at(k)}, loop, 0, true);
+            }
+        }
+
+        std::vector<bool> hasBody(code.size(), false);
+        for (const auto &cmd : code)
+        {
+            if (cmd.inst == BODY)
+            {
+                hasBody.at(cmd.jumpTo) = true;
+            }
+        }
+        std::vector<size_t> bodies(code.size(), 0), ends(code.size(), 0);
+        std::vector<std::tuple<size_t, const std::vector<size_t> *, size_t>> fixups;
+        const auto branch = [&](StencilKind kind, long long offset, const std::vector<size_t> *labels,
+                                size_t inner)
+        {
+            fixups.emplace_back(StencilCode::target(kind, out.place(kind, {offset, 0})), labels, inner);
+        };
+        long long pos = 0;
+        const auto materialize = [&]()
+        {
+            if (pos != 0)
+            {
+                out.place(ST_MOVE, {pos});
+            }
+            pos = 0;
+        };
+
+        for (size_t i = 0; i < code.size(); i++)
+        {
+            const auto &cmd = code.at(i);
+            switch (cmd.inst)
+            {
+            case RIGHT:
+                pos++;
+                break;
+            case LEFT:
+                pos--;
+                break;
+            case LOOP:
+                if (const auto step = scanStep(code, i); step != 0)
+                {
+                    if (const auto landing = assumedLanding(cmd.source, step); landing.has_value())
+                    {
+                        for (long long k = 0; k * step != landing.value(); k++)
+                        {
+                            guard(ST_JZ, {pos + cmd.offset + k * step}, cmd.source, pos, true);
+                        }
+                        guard(ST_JNZ, {pos + cmd.offset + landing.value()}, cmd.source, pos, true);
+                        pos += landing.value();
+                    }
+                    else
+                    {
+                        materialize();
+                        out.place(ST_SCAN, {cmd.offset, step});
+                    }
+                    i = cmd.jumpTo;
+                    break;
+                }
+                if (!fixed.at(i))
+                {
+                    materialize();
+                }
+                if (cmd.value == 0)
+                {
+                    branch(ST_JZ, pos + cmd.offset, &ends, i);
+                }
+                if (!hasBody.at(i))
+                {
+                    bodies.at(i) = out.bytes.size();
+                }
+                break;
+            case BODY:
+                if (!fixed.at(cmd.jumpTo))
+                {
+                    materialize();
+                }
+                if (cmd.value == 0)
+                {
+                    branch(ST_JZ, pos + cmd.offset, &ends, cmd.jumpTo);
+                }
+                bodies.at(cmd.jumpTo) = out.bytes.size();
+                break;
+            case JMP:
+                if (!fixed.at(cmd.jumpTo))
+                {
+                    materialize();
+                }
+                if (budget != nullptr)
+                {
+                    // a taken back edge is charged what the interpreter
+                    // charges for the one it stands for
+                    const auto length = cmd.source - cmds.at(cmd.source).jumpTo;
+                    branch(ST_JZ, pos + cmd.offset, &ends, cmd.jumpTo);
+                    guard(ST_BUDGET, {reinterpret_cast<long long>(budget), static_cast<long long>(length)},
+                          cmd.source, pos, false);
+                    fixups.emplace_back(StencilCode::target(ST_JUMP, out.place(ST_JUMP, {0})), &bodies, cmd.jumpTo);
+                }
+                else
+                {
+                    branch(ST_JNZ, pos + cmd.offset, &bodies, cmd.jumpTo);
+                }
+                ends.at(cmd.jumpTo) = out.bytes.size();
+                break;
+            default:
+                if (cmd.inst == GET)
+                {
+                    // leaves, without deoptimizing, when the read would wait
+                    guard(ST_READY, {reinterpret_cast<long long>(&processReady)}, cmd.source, pos, false);
+                }
+                out.placeCommand(cmd, pos);
+                break;
+            }
+        }
+        for (const auto &[at, labels, inner] : fixups)
+        {
+            out.patch(at, labels->at(inner));
+        }
+
+        // the loop ran to its end, then the exit stubs of the guards
+        materialize();
+        const auto firstExit = exits.size();
+        std::vector<size_t> leaves = {
+            StencilCode::target(ST_EXIT, out.place(ST_EXIT, {static_cast<long long>(firstExit), 0}))};
+        exits.push_back({end, loop, false});
+        for (const auto &g : guards)
+        {
+            const auto stub = out.bytes.size();
+            if (g.pos != 0)
+            {
+                out.place(ST_MOVE, {g.pos});
+            }
+            const auto exit = static_cast<long long>(exits.size());
+            leaves.push_back(StencilCode::target(ST_EXIT, out.place(ST_EXIT, {exit, 0})));
+            out.patch(g.at, stub);
+            exits.push_back({g.pc, loop, g.deopt});
+        }
+        auto *base = arena.append(out.bytes);
+        if (base == nullptr)
+        {
+            exits.resize(firstExit);
+            return nullptr;
+        }
+        for (const auto at : leaves)
+        {
+            arena.link(base + at, leaveStub);
+        }
+        return base;
+    }
+
+    const std::vector<Command> &cmds;
+    Interpreter interpreter;
+    std::atomic<long long> *budget;
+    std::vector<bool> balanced;
+    bool fieldMajor;
+    std::vector<LoopProfile> loops;
+    std::vector<ScanProfile> scans;
+    std::vector<Exit> exits;
+    CodeArena arena;
+    Entry enter = nullptr;
+    const uint8_t *leaveStub = nullptr;
+};
+
+void runInProcess(const std::vector<Command> &cmds, const TapeLayout &layout, Engine engine, ProcessIo &io,
+                  std::atomic<long long> *budget = nullptr)
+{
+    MappedTape tape(layout);
+    Machine m{tape.base, tape.origin, 0};
+    switch (engine)
+    {
+    case ENGINE_INTERPRETER:
+    {
+        Interpreter interpreter(cmds);
+        interpreter.limit(budget);
+        interpreter.run(m, io);
+        break;
+    }
+    case ENGINE_STENCIL:
+        StencilJit(cmds, budget).compile()(m.tape, m.pointer, &io);
+        break;
+    case ENGINE_TRACING:
+        TracingJit(cmds, budget).run(m, io);
+        break;
+    case ENGINE_SPECULATIVE:
+        SpeculatingJit(cmds, layout.stride > 1, budget).run(m, io);
+        break;
+    case ENGINE_NATIVE:
+        break;
+    }
+    io.flush();
+}
+
+// Memoized loops.
+//
+// A loop that does no I/O and leaves the pointer where it found it
+// touches a fixed window of cells around the pointer, so what a run of
+// it does depends only on the cells of that window it can read. On
+// entry such a loop is looked up by its index and those cells; a hit
+// writes back the cells the loop wrote the last time and skips it, and
+// a miss runs it and records them. Entries come out of a fixed memory
+// budget, and the cache starts over when it runs out. A loop that is
+// too cheap to be worth a lookup, or seldom hits, stops being looked up.
+class LoopMemo
+{
+public:
+    LoopMemo(const std::vector<Command> &cmds, const TapeLayout &layout, size_t budget,
+             std::atomic<long long> *steps = nullptr)
+        : cmds(cmds), interpreter(cmds), loops(cmds.size()), regions(tapeRegions(layout)), budget(budget),
+          stepBudget(steps)
+    {
+        interpreter.limit(steps);
+        const auto balanced = balancedLoops(cmds);
+        for (size_t i = 0; i < cmds.size(); i++)
+        {
+            if (cmds.at(i).inst == LOOP && balanced.at(i))
+            {
+                loops.at(i) = window(i);
+            }
+        }
+    }
+
+    void run(Machine &m, ProcessIo &io)
+    {
+        long long steps = 0;
+        while (!interpreter.done(m))
+        {
+            finish(m, steps);
+            const auto &cmd = cmds.at(m.pc);
+            auto &loop = loops.at(m.pc);
+            if (cmd.inst == LOOP && loop.has_value() && loop->enabled &&
+                m.tape[m.pointer + cmd.offset] != 0 && reachable(m, loop.value()))
+            {
+                auto key = lookupKey(m, loop.value());
+                loop->lookups++;
+                lookups++;
+                const auto found = cache.find(key);
+                if (found != cache.end())
+                {
+                    // the loop's back edges are charged as if it ran;
+                    // it has no I/O, so the run may as well end before it
+                    const auto &[cells, charge] = found->second;
+                    if (stepBudget != nullptr && stepBudget->fetch_sub(charge, std::memory_order_relaxed) < charge)
+                    {
+                        m.pc = cmds.size();
+                        break;
+                    }
+                    for (size_t k = 0; k < loop->writes.size(); k++)
+                    {
+                        m.tape[m.pointer + loop->writes.at(k)] = cells.at(k);
+                    }
+                    loop->hits++;
+                    hits++;
+                    m.pc = cmd.jumpTo + 1;
+                    continue;
+                }
+                open.push_back({m.pc, std::move(key), steps, budgetLeft()});
+            }
+            interpreter.step(m, io);
+            steps++;
+        }
+        finish(m, steps);
+    }
+
+    void report(std::ostream &os, const std::string &filename,
+                const std::vector<std::pair<size_t, size_t>> &locations) const
+    {
+        os << "memo: " << hits << " hits in " << lookups << " lookups";
+        if (lookups > 0)
+        {
+            os << " (" << 100 * hits / lookups << "%)";
+        }
+        os << ", " << cache.size() << " entries in " << used << " of " << budget
+           << " bytes, " << resets << " resets" << std::endl;
+        for (size_t i = 0; i < loops.size(); i++)
+        {
+            if (loops.at(i).has_value() && loops.at(i)->lookups > 0)
+            {
+                const auto &[line, column] = locations.at(cmds.at(i).source);
+                os << filename << ":" << line << ":" << column << ": " << loops.at(i)->hits
+                   << " hits in " << loops.at(i)->lookups << " lookups"
+                   << (loops.at(i)->enabled ? "" : ", no longer looked up") << std::endl;
+            }
+        }
+    }
+
+private:
+    struct Window
+    {
+        // offsets from the pointer on entry that are read, or may be
+        // left alone, and those that may be written
+        std::vector<int> reads;
+        std::vector<int> writes;
+        long long lookups = 0;
+        long long hits = 0;
+        long long missSteps = 0;
+        bool enabled = true;
+    };
+
+    struct Pending
+    {
+        size_t loop;
+        std::string key;
+        long long steps;
+        long long budgetLeft;
+    };
+
+    // the cells a loop wrote, and what its back edges took off the budget
+    struct Result
+    {
+        std::string cells;
+        long long charge;
+    };
+
+    long long budgetLeft() const
+    {
+        return stepBudget != nullptr ? stepBudget->load(std::memory_order_relaxed) : 0;
+    }
+
+    // The cells a loop reads and writes. A cell it only ever sets is
+    // left out of the key when the first pass through the loop always
+    // sets it; otherwise the loop may leave it alone, and what it held
+    // before is part of the result.
+    std::optional<Window> window(size_t loop) const
+    {
+        std::vector<int> reads;
+        std::vector<int> writes;
+        std::vector<int> definite;
+        int at = 0;
+        int depth = 0;
+        bool first = true;
+        for (size_t i = loop; i <= cmds.at(loop).jumpTo; i++)
+        {
+            const auto &cmd = cmds.at(i);
+            switch (cmd.inst)
+            {
+            case RIGHT:
+                at++;
+                break;
+            case LEFT:
+                at--;
+                break;
+            case PUT:
+            case GET:
+                return std::nullopt;
+            case SET:
+            case CLEAR:
+                writes.push_back(at + cmd.offset);
+                if (depth == 0 && first)
+                {
+                    definite.push_back(at + cmd.offset);
+                }
+                break;
+            case DIVMOD:
+            case MUL:
+            case CMP:
+                break;
+            default:
+                for (const auto offset : touchedCells(cmd))
+                {
+                    reads.push_back(at + offset);
+                }
+                if (cmd.inst == PLUS || cmd.inst == MINUS || cmd.inst == ADD || cmd.inst == MULADD)
+                {
+                    writes.push_back(at + cmd.offset);
+                }
+                break;
+            }
+            depth += i == loop ? 0 : cmd.inst == LOOP ? 1 : cmd.inst == JMP ? -1 : 0;
+            first = first && !(depth == 0 && cmd.inst == BODY && cmd.jumpTo == loop);
+        }
+        const auto unique = [](std::vector<int> &cells)
+        {
+            std::sort(cells.begin(), cells.end());
+            cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+        };
+        unique(writes);
+        unique(definite);
+        for (const auto cell : writes)
+        {
+            if (!std::binary_search(definite.begin(), definite.end(), cell))
+            {
+                reads.push_back(cell);
+            }
+        }
+        unique(reads);
+        Window w;
+        w.reads = reads;
+        w.writes = writes;
+        return w;
+    }
+
+    // whether every cell of the window is on the tape
+    bool reachable(const Machine &m, const Window &w) const
+    {
+        const auto inside = [&](int offset)
+        {
+            const auto cell = m.pointer + offset;
+            return std::any_of(regions.begin(), regions.end(), [&](const auto &region)
+                               { return cell >= region.first && cell < region.first + region.second; });
+        };
+        return std::all_of(w.reads.begin(), w.reads.end(), inside) &&
+               std::all_of(w.writes.begin(), w.writes.end(), inside);
+    }
+
+    std::string lookupKey(const Machine &m, const Window &w) const
+    {
+        std::string key(sizeof(size_t) + w.reads.size(), '\0');
+        const auto loop = m.pc;
+        std::copy_n(reinterpret_cast<const char *>(&loop), sizeof loop, key.begin());
+        for (size_t k = 0; k < w.reads.size(); k++)
+        {
+            key.at(sizeof(size_t) + k) = static_cast<char>(m.tape[m.pointer + w.reads.at(k)]);
+        }
+        return key;
+    }
+
+    // records the loops the interpreter has just left
+    void finish(const Machine &m, long long steps)
+    {
+        while (!open.empty() && m.pc == cmds.at(open.back().loop).jumpTo + 1)
+        {
+            auto &pending = open.back();
+            auto &loop = loops.at(pending.loop).value();
+            std::string result(loop.writes.size(), '\0');
+            for (size_t k = 0; k < loop.writes.size(); k++)
+            {
+                result.at(k) = static_cast<char>(m.tape[m.pointer + loop.writes.at(k)]);
+            }
+            const auto cost = pending.key.size() + result.size() + entryOverhead;
+            if (used + cost > budget)
+            {
+                cache.clear();
+                used = 0;
+                resets++;
+            }
+            if (cost <= budget)
+            {
+                used += cost;
+                cache.emplace(std::move(pending.key), Result{std::move(result), pending.budgetLeft - budgetLeft()});
+            }
+
+            // a lookup costs about a step per cell
+            loop.missSteps += steps - pending.steps;
+            const auto misses = loop.lookups - loop.hits;
+            if (misses >= probeRuns &&
+                (loop.missSteps < misses * static_cast<long long>(2 * (loop.reads.size() + loop.writes.size())) ||
+                 loop.hits * 8 < loop.lookups))
+            {
+                loop.enabled = false;
+            }
+            open.pop_back();
+        }
+    }
+
+    static constexpr size_t entryOverhead = 64;
+    static constexpr long long probeRuns = 32;
+
+    const std::vector<Command> &cmds;
+    Interpreter interpreter;
+    std::vector<std::optional<Window>> loops;
+    std::vector<std::pair<long long, long long>> regions;
+    std::unordered_map<std::string, Result> cache;
+    std::vector<Pending> open;
+    size_t budget;
+    std::atomic<long long> *stepBudget;
+    size_t used = 0;
+    long long lookups = 0;
+    long long hits = 0;
+    long long resets = 0;
+};
+
+// Runs in the interpreter through the memo, then reports how it did.
+void runMemoized(const std::vector<Command> &cmds, const TapeLayout &layout, const Options &options,
+                 const std::vector<std::pair<size_t, size_t>> &locations, std::atomic<long long> *budget)
+{
+    MappedTape tape(layout);
+    Machine m{tape.base, tape.origin, 0};
+    ProcessIo io;
+    LoopMemo memo(cmds, layout, options.memoBudget, budget);
+    memo.run(m, io);
+    io.flush();
+    memo.report(std::cerr, options.filename, locations);
+}
+
+// Writes a snapshot next to path and renames it over path, so a crash
+// midway leaves the last one whole. Each region goes out as runs of the
+// pages resident in it; pages never touched are still zero.
+void saveSnapshot(const std::string &path, const SnapshotHeader &header, uint8_t *base,
+                  const TapeLayout &layout)
+{
+    const long long page = 4096;
+    const long long window = 1LL << 30;
+    const auto temporary = path + ".tmp";
+    std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char *>(&header), sizeof header);
+    std::vector<unsigned char> resident(window / page);
+    for (const auto &[start, length] : tapeRegions(layout))
+    {
+        for (long long at = 0; at < length; at += window)
+        {
+            const auto bytes = std::min(window, length - at);
+            if (mincore(base + start + at, bytes, resident.data()) != 0)
+            {
+                std::fill(resident.begin(), resident.end(), 1);
+            }
+            for (long long first = 0; first * page < bytes;)
+            {
+                auto last = first;
+                while (last * page < bytes && (resident.at(last) & 1) != 0)
+                {
+                    last++;
+                }
+                if (last > first)
+                {
+                    const uint64_t run[] = {static_cast<uint64_t>(start + at + first * page),
+                                            static_cast<uint64_t>(std::min(last * page, bytes) - first * page)};
+                    out.write(reinterpret_cast<const char *>(run), sizeof run);
+                    out.write(reinterpret_cast<const char *>(base + run[0]), run[1]);
+                }
+                first = last + 1;
+            }
+        }
+    }
+    out.close();
+    if (!out)
+    {
+        fs::remove(temporary);
+        throw std::runtime_error("could not write " + temporary);
+    }
+    fs::rename(temporary, path);
+}
+
+// Reads a snapshot of the program with this fingerprint onto a zeroed
+// tape.
+SnapshotHeader loadSnapshot(const std::string &path, uint64_t fingerprint, uint8_t *base,
+                            const TapeLayout &layout)
+{
+    std::ifstream in(path, std::ios::binary);
+    SnapshotHeader header;
+    if (!in.read(reinterpret_cast<char *>(&header), sizeof header) || header.magic != snapshotMagic ||
+        header.version != snapshotVersion || header.program != fingerprint)
+    {
+        throw std::runtime_error(path + ": not a snapshot of this program");
+    }
+    const auto regions = tapeRegions(layout);
+    uint64_t run[2];
+    while (in.read(reinterpret_cast<char *>(run), sizeof run))
+    {
+        const auto fits = std::any_of(regions.begin(), regions.end(), [&](const auto &region)
+                                      { return run[0] >= static_cast<uint64_t>(region.first) &&
+                                               run[1] <= static_cast<uint64_t>(region.first + region.second) - run[0]; });
+        if (!fits || !in.read(reinterpret_cast<char *>(base + run[0]), run[1]))
+        {
+            throw std::runtime_error(path + ": not a snapshot of this program");
+        }
+    }
+    return header;
+}
+
+volatile std::sig_atomic_t checkpointDue = 0;
+
+void requestCheckpoint(int) { checkpointDue = 1; }
+
+// Runs in the interpreter, the engine whose state maps straight onto a
+// snapshot, taking one at the first back edge after SIGUSR1 or each
+// tick of the checkpoint timer.
+void runCheckpointed(const std::vector<Command> &cmds, const TapeLayout &layout, const Options &options,
+                     std::atomic<long long> *budget)
+{
+    MappedTape tape(layout);
+    Machine m{tape.base, tape.origin, 0};
+    ProcessIo io;
+    const auto fingerprint = programFingerprint(cmds, layout);
+    if (options.resume)
+    {
+        const auto header = loadSnapshot(options.checkpoint, fingerprint, tape.base, layout);
+        if (header.pc >= cmds.size() || cmds.at(header.pc).inst != JMP)
+        {
+            throw std::runtime_error(options.checkpoint + ": not a snapshot of this program");
+        }
+        m.pc = header.pc;
+        m.pointer = header.pointer;
+        io.last = header.last;
+        io.inputOffset = header.input;
+        io.outputOffset = header.output;
+        lseek(0, header.input, SEEK_SET);
+        if (ftruncate(1, header.output) == 0)
+        {
+            lseek(1, header.output, SEEK_SET);
+        }
+    }
+    struct sigaction action = {};
+    action.sa_handler = requestCheckpoint;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &action, nullptr);
+    if (options.checkpointEvery > 0)
+    {
+        sigaction(SIGALRM, &action, nullptr);
+        itimerval timer = {{options.checkpointEvery, 0}, {options.checkpointEvery, 0}};
+        setitimer(ITIMER_REAL, &timer, nullptr);
+    }
+
+    Interpreter interpreter(cmds);
+    interpreter.limit(budget);
+    while (!interpreter.done(m))
+    {
+        if (checkpointDue != 0 && cmds.at(m.pc).inst == JMP)
+        {
+            checkpointDue = 0;
+            io.flush();
+            SnapshotHeader header;
+            header.pc = m.pc;
+            header.pointer = m.pointer;
+            header.input = io.inputOffset;
+            header.output = io.outputOffset;
+            header.last = io.last;
+            header.program = fingerprint;
+            saveSnapshot(options.checkpoint, header, tape.base, layout);
+        }
+        interpreter.step(m, io);
+    }
+    io.flush();
+}
+
+// Asynchronous stdin and stdout.
+//
+// The batch runner reads its records and writes its results through
+// two pairs of buffers, like the generated runtime: a chunk of input is
+// split into records while the next is being read, and results are
+// collected in one buffer while the other is being written. The reads
+// and writes in flight go through an io_uring; without one they are
+// plain syscalls.
+
+// A minimal io_uring: reads and writes at the current file position,
+// a completion told apart by its tag.
+class Uring
+{
+public:
+    Uring()
+    {
+        io_uring_params params{};
+        fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (fd < 0)
+        {
+            return;
+        }
+        const unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_RW_CUR_POS;
+        ringSize = std::max(params.sq_off.array + params.sq_entries * sizeof(uint32_t),
+                            params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        ring = (params.features & needed) == needed
+                   ? mmap(nullptr, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                          IORING_OFF_SQ_RING)
+                   : MAP_FAILED;
+        sqes = ring != MAP_FAILED
+                   ? mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                          IORING_OFF_SQES)
+                   : MAP_FAILED;
+        if (sqes == MAP_FAILED)
+        {
+            release();
+            return;
+        }
+        sq = params.sq_off;
+        cq = params.cq_off;
+    }
+    Uring(const Uring &) = delete;
+    Uring &operator=(const Uring &) = delete;
+    ~Uring() { release(); }
+
+    bool available() const { return fd >= 0; }
+
+    // starts reading into or writing from buffer
+    void submit(uint8_t op, int file, const void *buffer, size_t length, uint64_t tag)
+    {
+        auto *tail = field(sq.tail);
+        const auto at = *tail & *field(sq.ring_mask);
+        auto &sqe = static_cast<io_uring_sqe *>(sqes)[at];
+        sqe = io_uring_sqe{};
+        sqe.opcode = op;
+        sqe.fd = file;
+        sqe.off = static_cast<uint64_t>(-1);
+        sqe.addr = reinterpret_cast<uint64_t>(buffer);
+        sqe.len = static_cast<uint32_t>(length);
+        sqe.user_data = tag;
+        field(sq.array)[at] = at;
+        __atomic_store_n(tail, *tail + 1, __ATOMIC_RELEASE);
+        syscall(__NR_io_uring_enter, fd, 1, 0, 0, nullptr, 0);
+    }
+
+    // waits for a completion; its tag and result
+    std::pair<uint64_t, int> reap()
+    {
+        auto *head = field(cq.head);
+        while (*head == __atomic_load_n(field(cq.tail), __ATOMIC_ACQUIRE))
+        {
+            syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        }
+        const auto &cqe = reinterpret_cast<io_uring_cqe *>(
+            static_cast<uint8_t *>(ring) + cq.cqes)[*head & *field(cq.ring_mask)];
+        const std::pair<uint64_t, int> done = {cqe.user_data, cqe.res};
+        __atomic_store_n(head, *head + 1, __ATOMIC_RELEASE);
+        return done;
+    }
+
+private:
+    static const unsigned entries = 4;
+
+    uint32_t *field(uint32_t offset) const
+    {
+        return reinterpret_cast<uint32_t *>(static_cast<uint8_t *>(ring) + offset);
+    }
+
+    void release()
+    {
+        if (sqes != MAP_FAILED)
+        {
+            munmap(sqes, sqesSize);
+        }
+        if (ring != MAP_FAILED)
+        {
+            munmap(ring, ringSize);
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        sqes = ring = MAP_FAILED;
+        fd = -1;
+    }
+
+    int fd = -1;
+    void *ring = MAP_FAILED;
+    void *sqes = MAP_FAILED;
+    size_t ringSize = 0;
+    size_t sqesSize = 0;
+    io_sqring_offsets sq{};
+    io_cqring_offsets cq{};
+};
+
+class AsyncStdio
+{
+public:
+    AsyncStdio()
+    {
+        for (auto &buffer : in)
+        {
+            buffer.resize(bufferSize);
+        }
+    }
+    AsyncStdio(const AsyncStdio &) = delete;
+    AsyncStdio &operator=(const AsyncStdio &) = delete;
+
+    // the next chunk of stdin, valid until the next call; empty at the end
+    std::string_view read()
+    {
+        if (!ring.available())
+        {
+            const auto n = ::read(0, in[0].data(), bufferSize);
+            return {in[0].data(), static_cast<size_t>(std::max<ssize_t>(n, 0))};
+        }
+        if (readState == READ_IDLE)
+        {
+            startRead();
+        }
+        while (readState == READ_BUSY)
+        {
+            reap();
+        }
+        readState = READ_IDLE;
+        if (readResult <= 0)
+        {
+            return {};
+        }
+        // read ahead into the other buffer while this one is used
+        const auto &chunk = in[reading];
+        reading ^= 1;
+        startRead();
+        return {chunk.data(), static_cast<size_t>(readResult)};
+    }
+
+    // queues bytes for stdout
+    void write(const std::string &bytes)
+    {
+        out[filling] += bytes;
+        if (out[filling].size() >= bufferSize)
+        {
+            startWrite();
+        }
+    }
+
+    // writes out what is queued and waits for it
+    void finish()
+    {
+        startWrite();
+        waitWrite();
+    }
+
+private:
+    static const size_t bufferSize = 1 << 16;
+    static const uint64_t readTag = 1;
+    static const uint64_t writeTag = 2;
+
+    enum ReadState
+    {
+        READ_IDLE,
+        READ_BUSY,
+        READ_DONE
+    };
+
+    void startRead()
+    {
+        ring.submit(IORING_OP_READ, 0, in[reading].data(), bufferSize, readTag);
+        readState = READ_BUSY;
+    }
+
+    void reap()
+    {
+        const auto [tag, result] = ring.reap();
+        if (tag == readTag)
+        {
+            readResult = result;
+            readState = READ_DONE;
+        }
+        else
+        {
+            writeResult = result;
+            writeBusy = false;
+        }
+    }
+
+    // waits for the write in flight, finishing it if it came up short
+    void waitWrite()
+    {
+        while (writeBusy)
+        {
+            reap();
+        }
+        const auto &written = out[filling ^ 1];
+        if (writeResult >= 0 && static_cast<size_t>(writeResult) < written.size())
+        {
+            writeAll(written.data() + writeResult, written.size() - writeResult);
+        }
+        out[filling ^ 1].clear();
+        writeResult = 0;
+    }
+
+    void startWrite()
+    {
+        if (!ring.available())
+        {
+            writeAll(out[filling].data(), out[filling].size());
+            out[filling].clear();
+            return;
+        }
+        waitWrite();
+        if (out[filling].empty())
+        {
+            return;
+        }
+        ring.submit(IORING_OP_WRITE, 1, out[filling].data(), out[filling].size(), writeTag);
+        writeBusy = true;
+        filling ^= 1;
+    }
+
+    static void writeAll(const char *data, size_t size)
+    {
+        while (size > 0)
+        {
+            const auto n = ::write(1, data, size);
+            if (n <= 0)
+            {
+                break;
+            }
+            data += n;
+            size -= n;
+        }
+    }
+
+    Uring ring;
+    std::array<std::vector<char>, 2> in;
+    int reading = 0;
+    ReadState readState = READ_IDLE;
+    int readResult = 0;
+    std::array<std::string, 2> out;
+    int filling = 0;
+    bool writeBusy = false;
+    int writeResult = 0;
+};
+
+// SPMD lockstep execution.
+//
+// A group of runs shares one program counter and one pointer. Their
+// tapes are interleaved, so a cell of every lane is one vector, and each
+// command acts on all lanes at once under a mask of the lanes it applies
+// to. A loop whose body leaves the pointer where it was runs until every
+// lane has left it: a lane whose cell is zero is masked off and waits at
+// the end. Other loops move the pointer, so the lanes have to agree at
+// each test. When they do not, the lanes in the minority are peeled off
+// and finish alone in the interpreter, on a copy of their tape.
+
+// The lowest and highest offsets the program accesses cells at, so the
+// cells a run touched are its pointer range widened by them.
+std::pair<int, int> offsetSpan(const std::vector<Command> &cmds)
+{
+    std::pair<int, int> span = {0, 0};
+    for (const auto &cmd : cmds)
+    {
+        for (const auto offset : touchedCells(cmd))
+        {
+            span.first = std::min(span.first, offset);
+            span.second = std::max(span.second, offset);
+        }
+    }
+    return span;
+}
+
+// Tapes of a group of lanes, interleaved: cell a of lane l is byte
+// a * lanes + l. There is an inaccessible page on each side.
+class LaneTape
+{
+public:
+    LaneTape(const TapeLayout &tape, int lanes)
+    {
+        const long long page = 4096;
+        cells = tape.sparse ? roundUp(tape.cells, page) : tape.stride * fieldSpan(tape);
+        size = roundUp(cells * lanes, page) + 2 * page;
+        mapping = mmap(nullptr, size, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | (tape.sparse ? MAP_NORESERVE : 0), -1, 0);
+        if (mapping == MAP_FAILED)
+        {
+            throw std::runtime_error("could not map the lane tapes");
+        }
+        base = static_cast<uint8_t *>(mapping) + page;
+        mprotect(base, size - 2 * page, PROT_READ | PROT_WRITE);
+        origin = tape.origin / tape.stride;
+    }
+    LaneTape(const LaneTape &) = delete;
+    LaneTape &operator=(const LaneTape &) = delete;
+    ~LaneTape() { munmap(mapping, size); }
+
+    // zeroes cells [from, to) of every lane for the next group
+    void reset(long long from, long long to, int lanes)
+    {
+        from = std::max(from, 0LL);
+        to = std::min(to, cells);
+        if (from < to)
+        {
+            clearRange(base + from * lanes, (to - from) * lanes);
+        }
+    }
+
+    uint8_t *base = nullptr;
+    long long origin = 0;
+    long long cells = 0;
+
+private:
+    void *mapping = nullptr;
+    size_t size = 0;
+};
+
+// a cell of every lane
+template <int Lanes>
+struct LaneVector;
+template <>
+struct LaneVector<16>
+{
+    typedef uint8_t type __attribute__((vector_size(16)));
+};
+template <>
+struct LaneVector<32>
+{
+    typedef uint8_t type __attribute__((vector_size(32)));
+};
+template <>
+struct LaneVector<64>
+{
+    typedef uint8_t type __attribute__((vector_size(64)));
+};
+
+template <int Lanes>
+class Lockstep
+{
+public:
+    using Vector = typename LaneVector<Lanes>::type;
+
+    Lockstep(const std::vector<Command> &cmds, const TapeLayout &layout)
+        : cmds(cmds), layout(layout), interpreter(cmds), balanced(balancedLoops(cmds))
+    {
+        std::tie(lowestOffset, highestOffset) = offsetSpan(cmds);
+    }
+
+    // runs the program once for each of ios, Lanes runs at a time; the
+    // runs whose pointer left the tape
+    std::vector<size_t> run(std::vector<ProcessIo> &ios)
+    {
+        std::vector<size_t> failures;
+        for (size_t first = 0; first < ios.size(); first += Lanes)
+        {
+            runGroup(ios.data() + first, std::min<size_t>(Lanes, ios.size() - first));
+            for (int l = 0; l < Lanes; l++)
+            {
+                if (failed[l] != 0)
+                {
+                    failures.push_back(first + l);
+                }
+            }
+        }
+        return failures;
+    }
+
+private:
+    // groups share one set of tapes, reset to zero over the cells the
+    // last group touched
+    void runGroup(ProcessIo *groupIos, size_t count)
+    {
+        if (!tape.has_value())
+        {
+            tape.emplace(layout, Lanes);
+        }
+        cells = tape->cells;
+        base = tape->base;
+        pointer = lowest = highest = tape->origin;
+        ios = groupIos;
+        mask = Vector{};
+        failed = Vector{};
+        for (size_t l = 0; l < count; l++)
+        {
+            mask[l] = 0xff;
+        }
+        outer.clear();
+
+        size_t pc = 0;
+        while (pc < cmds.size())
+        {
+            const auto &cmd = cmds.at(pc);
+            if (!reaches(cmd))
+            {
+                if (!leave(pc))
+                {
+                    break;
+                }
+                continue;
+            }
+            auto &cell = at(cmd.offset);
+            switch (cmd.inst)
+            {
+            case RIGHT:
+                move(1);
+                break;
+            case LEFT:
+                move(-1);
+                break;
+            case PLUS:
+                cell += mask & static_cast<uint8_t>(1);
+                break;
+            case MINUS:
+                cell -= mask & static_cast<uint8_t>(1);
+                break;
+            case ADD:
+                cell += mask & static_cast<uint8_t>(cmd.value);
+                break;
+            case CLEAR:
+                cell &= ~mask;
+                break;
+            case SET:
+                cell = (cell & ~mask) | (mask & static_cast<uint8_t>(cmd.value));
+                break;
+            case MULADD:
+                cell += mask & (at(cmd.args.at(0)) * static_cast<uint8_t>(cmd.value));
+                break;
+            case PUT:
+                for (int l = 0; l < Lanes; l++)
+                {
+                    if (mask[l] != 0)
+                    {
+                        ios[l].put(cell[l]);
+                    }
+                }
+                break;
+            case GET:
+                for (int l = 0; l < Lanes; l++)
+                {
+                    if (mask[l] != 0)
+                    {
+                        cell[l] = ios[l].get();
+                    }
+                }
+                break;
+            case LOOP:
+                if (const auto step = interpreter.scan(pc); step != 0)
+                {
+                    while (reaches(cmd) && agree(pc, at(cmd.offset)))
+                    {
+                        move(step);
+                    }
+                    if (!reaches(cmd))
+                    {
+                        continue;
+                    }
+                    pc = cmd.jumpTo;
+                }
+                else if (balanced.at(pc))
+                {
+                    const Vector taken = mask & Vector(cell != 0);
+                    if (none(taken))
+                    {
+                        pc = cmd.jumpTo;
+                        break;
+                    }
+                    outer.push_back({mask, pc, pointer});
+                    mask = taken;
+                }
+                else if (!agree(pc, cell))
+                {
+                    pc = cmd.jumpTo;
+                }
+                break;
+            case BODY:
+                if (balanced.at(cmd.jumpTo))
+                {
+                    mask &= Vector(cell != 0);
+                    if (none(mask))
+                    {
+                        mask = outer.back().lanes;
+                        outer.pop_back();
+                        pc = cmds.at(cmd.jumpTo).jumpTo;
+                    }
+                }
+                else if (!agree(pc, cell))
+                {
+                    pc = cmds.at(cmd.jumpTo).jumpTo;
+                }
+                break;
+            case JMP:
+                if (balanced.at(cmd.jumpTo))
+                {
+                    const Vector taken = mask & Vector(cell != 0);
+                    if (!none(taken))
+                    {
+                        mask = taken;
+                        pc = interpreter.bodyStart(cmd.jumpTo);
+                        continue;
+                    }
+                    mask = outer.back().lanes;
+                    outer.pop_back();
+                }
+                else if (agree(pc, cell))
+                {
+                    pc = interpreter.bodyStart(cmd.jumpTo);
+                    continue;
+                }
+                break;
+            case DIVMOD:
+            case MUL:
+            case CMP:
+                break;
+            }
+            pc++;
+        }
+        tape->reset(lowest + lowestOffset, highest + highestOffset + 1, Lanes);
+    }
+
+    Vector &at(int offset)
+    {
+        return *reinterpret_cast<Vector *>(base + (pointer + offset) * Lanes);
+    }
+
+    void move(long long step)
+    {
+        pointer += step;
+        lowest = std::min(lowest, pointer);
+        highest = std::max(highest, pointer);
+    }
+
+    // whether the cells cmd touches are on the tape
+    bool reaches(const Command &cmd) const
+    {
+        if (pointer + lowestOffset >= 0 && pointer + highestOffset < cells)
+        {
+            return true;
+        }
+        if (isIdiom(cmd.inst))
+        {
+            return true;
+        }
+        for (const auto offset : touchedCells(cmd))
+        {
+            if (pointer + offset < 0 || pointer + offset >= cells)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Fails the running lanes, whose pointer left the tape. The lanes
+    // parked at the innermost loop that has any go on after it, where
+    // the pointer is back where it was on entry; false when none are.
+    bool leave(size_t &pc)
+    {
+        failed |= mask;
+        for (auto &saved : outer)
+        {
+            saved.lanes &= ~mask;
+        }
+        mask = Vector{};
+        while (!outer.empty())
+        {
+            const auto parked = outer.back();
+            outer.pop_back();
+            if (!none(parked.lanes))
+            {
+                mask = parked.lanes;
+                pointer = parked.pointer;
+                pc = cmds.at(parked.loop).jumpTo + 1;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static int count(const Vector &lanes)
+    {
+        int n = 0;
+        for (int l = 0; l < Lanes; l++)
+        {
+            n += lanes[l] != 0;
+        }
+        return n;
+    }
+    static bool none(const Vector &lanes) { return count(lanes) == 0; }
+
+    // Whether the branch at pc is taken, for a test the lanes have to
+    // agree on. The lanes in the minority are peeled off first; on a tie
+    // those that take it are, as they are the ones falling behind.
+    bool agree(size_t pc, const Vector &cell)
+    {
+        const Vector taken = mask & Vector(cell != 0);
+        const int yes = count(taken), active = count(mask);
+        if (yes != 0 && yes != active)
+        {
+            peel(yes * 2 > active ? mask & ~taken : taken, pc);
+        }
+        return yes * 2 > active;
+    }
+
+    // finishes the given lanes in the interpreter, from pc
+    void peel(const Vector &lanes, size_t pc)
+    {
+        const auto from = std::max(0LL, lowest + lowestOffset);
+        const auto to = std::min(cells, highest + highestOffset + 1);
+        for (int l = 0; l < Lanes; l++)
+        {
+            if (lanes[l] == 0)
+            {
+                continue;
+            }
+            if (!spare.has_value())
+            {
+                spare.emplace(layout);
+            }
+            for (auto a = from; a < to; a++)
+            {
+                if (const auto value = base[a * Lanes + l]; value != 0)
+                {
+                    spare->base[a] = value;
+                }
+            }
+            Machine m{spare->base, pointer, pc};
+            auto low = lowest, high = highest;
+            if (!runOnTape(*spare, [&]() { interpreter.run(m, ios[l], low, high); }))
+            {
+                failed[l] = 0xff;
+            }
+            spare->reset(low + lowestOffset, high + highestOffset + 1);
+        }
+        mask &= ~lanes;
+        for (auto &saved : outer)
+        {
+            saved.lanes &= ~lanes;
+        }
+    }
+
+    const std::vector<Command> &cmds;
+    const TapeLayout &layout;
+    Interpreter interpreter;
+    std::vector<bool> balanced;
+    int lowestOffset = 0;
+    int highestOffset = 0;
+    std::optional<LaneTape> tape;
+    // the tape a peeled lane finishes on
+    std::optional<MappedTape> spare;
+
+    // state of the group being run
+    uint8_t *base = nullptr;
+    long long cells = 0;
+    long long pointer = 0;
+    long long lowest = 0;
+    long long highest = 0;
+    ProcessIo *ios = nullptr;
+    Vector mask{};
+    // lanes whose pointer left the tape
+    Vector failed{};
+    // The enclosing loops that mask lanes off: the lanes on entry, which
+    // go on after the loop, and where it and the pointer were.
+    struct Parked
+    {
+        Vector lanes;
+        size_t loop;
+        long long pointer;
+    };
+    std::vector<Parked> outer;
+};
+
+// Runs one record at a time in the interpreter, on one tape reset over
+// the cells each run touched.
+class SerialRuns
+{
+public:
+    SerialRuns(const std::vector<Command> &cmds, const TapeLayout &layout)
+        : interpreter(cmds), offsets(offsetSpan(cmds)), tape(layout)
+    {
+    }
+
+    // the runs whose pointer left the tape
+    std::vector<size_t> run(std::vector<ProcessIo> &ios)
+    {
+        std::vector<size_t> failures;
+        for (size_t i = 0; i < ios.size(); i++)
+        {
+            Machine m{tape.base, tape.origin, 0};
+            auto lowest = m.pointer, highest = m.pointer;
+            if (!runOnTape(tape, [&]() { interpreter.run(m, ios.at(i), lowest, highest); }))
+            {
+                failures.push_back(i);
+            }
+            tape.reset(lowest + offsets.first, highest + offsets.second + 1);
+        }
+        return failures;
+    }
+
+private:
+    Interpreter interpreter;
+    std::pair<int, int> offsets;
+    MappedTape tape;
+};
+
+// Records are run a few groups at a time as their input arrives, so the
+// runs overlap the reads and writes in flight. The runner keeps its
+// tapes from one group to the next.
+const size_t batchRecords = 1024;
+
+// A record whose run left the tape is reported by its line number, after
+// its output so far; the others run on. ran counts the records before.
+template <typename Runner>
+size_t runRecords(Runner &runner, std::vector<std::string> &records, AsyncStdio &stdio, size_t &ran)
+{
+    std::vector<ProcessIo> ios(records.size());
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        ios.at(i).record = &records.at(i);
+    }
+    const auto failures = runner.run(ios);
+    for (const auto &io : ios)
+    {
+        stdio.write(io.out);
+    }
+    for (const auto i : failures)
+    {
+        std::cerr << "record " << ran + i + 1 << ": pointer left the tape" << std::endl;
+    }
+    ran += records.size();
+    records.clear();
+    return failures.size();
+}
+
+// false when a record failed
+template <typename Runner>
+bool streamBatch(Runner &runner)
+{
+    catchTapeFaults();
+    AsyncStdio stdio;
+    std::vector<std::string> records;
+    size_t ran = 0, failures = 0;
+    std::string partial;
+    for (auto chunk = stdio.read(); !chunk.empty(); chunk = stdio.read())
+    {
+        for (auto end = chunk.find('\n'); end != std::string_view::npos; end = chunk.find('\n'))
+        {
+            records.push_back(partial.append(chunk.substr(0, end + 1)));
+            partial.clear();
+            chunk.remove_prefix(end + 1);
+        }
+        partial.append(chunk);
+        if (records.size() >= batchRecords)
+        {
+            failures += runRecords(runner, records, stdio, ran);
+        }
+    }
+    if (!partial.empty())
+    {
+        records.push_back(partial + "\n");
+    }
+    failures += runRecords(runner, records, stdio, ran);
+    stdio.finish();
+    return failures == 0;
+}
+
+// Batch mode runs the program once per line of stdin, on a zeroed tape
+// with the line and its newline as input. The outputs of the runs are
+// written in order. False when a record failed.
+bool runBatch(const std::vector<Command> &cmds, const TapeLayout &layout, int lanes)
+{
+    switch (lanes)
+    {
+    case 16:
+    {
+        Lockstep<16> runner(cmds, layout);
+        return streamBatch(runner);
+    }
+    case 32:
+    {
+        Lockstep<32> runner(cmds, layout);
+        return streamBatch(runner);
+    }
+    case 64:
+    {
+        Lockstep<64> runner(cmds, layout);
+        return streamBatch(runner);
+    }
+    default:
+    {
+        SerialRuns runner(cmds, layout);
+        return streamBatch(runner);
+    }
+    }
+}
+
+// Suspendable sessions.
+//
+// A session is one run of the program on input that arrives a piece at a
+// time. Instead of blocking a thread on a read, its engine stops before a
+// read that would wait, with the machine as it was, and the session is
+// resumed by whichever worker picks it up once more input, or the end of
+// it, has arrived. Many sessions share a few threads. The stencil JIT
+// compiles the program as one function that cannot stop part way, so
+// sessions run under the interpreter unless a tracing or speculating JIT
+// is asked for.
+
+class Session
+{
+public:
+    Session(const std::vector<Command> &cmds, const TapeLayout &layout, Engine engine)
+        : tape(layout), m{tape.base, tape.origin, 0}, interpreter(cmds)
+    {
+        io.record = &input;
+        io.more = true;
+        if (engine == ENGINE_TRACING)
+        {
+            tracing.emplace(cmds);
+        }
+        else if (engine == ENGINE_SPECULATIVE)
+        {
+            speculating.emplace(cmds, layout.stride > 1);
+        }
+    }
+
+    // adds input, dropping what was read already
+    void feed(const std::string &text, bool closed)
+    {
+        input.erase(0, io.consumed);
+        io.consumed = 0;
+        input += text;
+        io.more = !closed;
+    }
+
+    // runs until the program ends or waits for input; true when it ended,
+    // which it also does when the pointer left the tape
+    bool resume()
+    {
+        bool finished = true;
+        faulted = !runOnTape(tape, [&]() { finished = advance(); });
+        return finished;
+    }
+
+    bool failed() const { return faulted; }
+
+    bool waitsForClose() const { return io.more; }
+
+    // the output lines completed so far, each after prefix; with all,
+    // the unfinished line too
+    std::string takeLines(const std::string &prefix, bool all)
+    {
+        std::string lines;
+        size_t start = 0;
+        for (auto end = io.out.find('\n'); end != std::string::npos; end = io.out.find('\n', start))
+        {
+            lines += prefix + io.out.substr(start, end + 1 - start);
+            start = end + 1;
+        }
+        io.out.erase(0, start);
+        if (all && !io.out.empty())
+        {
+            lines += prefix + io.out + "\n";
+            io.out.clear();
+        }
+        return lines;
+    }
+
+private:
+    bool advance()
+    {
+        if (tracing.has_value())
+        {
+            return tracing->run(m, io);
+        }
+        if (speculating.has_value())
+        {
+            return speculating->run(m, io);
+        }
+        return interpreter.run(m, io);
+    }
+
+    MappedTape tape;
+    Machine m;
+    std::string input;
+    ProcessIo io;
+    Interpreter interpreter;
+    std::optional<TracingJit> tracing;
+    std::optional<SpeculatingJit> speculating;
+    bool faulted = false;
+};
+
+// Runs sessions on a fixed set of worker threads. Input is handed to a
+// session under the lock and only while it is not running, so a running
+// session owns its state.
+class SessionPool
+{
+public:
+    SessionPool(const std::vector<Command> &cmds, const TapeLayout &layout, Engine engine, int threads)
+        : cmds(cmds), layout(layout), engine(engine)
+    {
+        catchTapeFaults();
+        for (int t = 0; t < threads; t++)
+        {
+            workers.emplace_back([this]() { work(); });
+        }
+    }
+    SessionPool(const SessionPool &) = delete;
+    SessionPool &operator=(const SessionPool &) = delete;
+
+    ~SessionPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        queued.notify_all();
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    // input for the session id, which starts on first mention
+    void feed(const std::string &id, const std::string &text)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto &slot = slots[id];
+        slot.pending += text;
+        wake(id, slot);
+    }
+
+    // ends the input of the session id
+    void close(const std::string &id)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto &slot = slots[id];
+        slot.closed = true;
+        wake(id, slot);
+    }
+
+    // ends every input and waits for the sessions to end; false when
+    // any of them failed
+    bool finish()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (auto &[id, slot] : slots)
+        {
+            slot.closed = true;
+            wake(id, slot);
+        }
+        ended.wait(lock, [this]() { return live == 0; });
+        return failures == 0;
+    }
+
+private:
+    struct Slot
+    {
+        std::unique_ptr<Session> session;
+        std::string pending;
+        bool closed = false;
+        bool queued = false;
+        bool running = false;
+        bool done = false;
+    };
+
+    // queues a session that has something new to run on; under the lock
+    void wake(const std::string &id, Slot &slot)
+    {
+        if (slot.queued || slot.running || slot.done)
+        {
+            return;
+        }
+        if (slot.session == nullptr)
+        {
+            live++;
+        }
+        slot.queued = true;
+        queue.emplace_back(id, &slot);
+        queued.notify_one();
+    }
+
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            queued.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty())
+            {
+                return;
+            }
+            const auto [id, slot] = queue.front();
+            queue.pop_front();
+            slot->queued = false;
+            slot->running = true;
+            const auto text = std::move(slot->pending);
+            slot->pending.clear();
+            const bool closed = slot->closed;
+            lock.unlock();
+
+            if (slot->session == nullptr)
+            {
+                slot->session = std::make_unique<Session>(cmds, layout, engine);
+            }
+            auto &session = *slot->session;
+            session.feed(text, closed);
+            const bool finished = session.resume();
+            const bool failed = session.failed();
+            write(session.takeLines(id + " ", finished));
+            if (failed)
+            {
+                std::lock_guard<std::mutex> written(output);
+                std::cerr << "session " << id << ": pointer left the tape" << std::endl;
+            }
+            if (finished)
+            {
+                slot->session.reset();
+            }
+
+            lock.lock();
+            slot->running = false;
+            if (finished)
+            {
+                slot->done = true;
+                failures += failed ? 1 : 0;
+                if (--live == 0)
+                {
+                    ended.notify_all();
+                }
+            }
+            else if (!slot->pending.empty() || (slot->closed && !closed))
+            {
+                wake(id, *slot);
+            }
+        }
+    }
+
+    void write(const std::string &lines)
+    {
+        if (lines.empty())
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(output);
+        ProcessIo out;
+        out.out = lines;
+        out.flush();
+    }
+
+    const std::vector<Command> &cmds;
+    const TapeLayout layout;
+    const Engine engine;
+    std::mutex mutex;
+    std::condition_variable queued;
+    std::condition_variable ended;
+    std::map<std::string, Slot> slots;
+    std::deque<std::pair<std::string, Slot *>> queue;
+    size_t live = 0;
+    size_t failures = 0;
+    bool stopping = false;
+    std::mutex output;
+    std::vector<std::thread> workers;
+};
+
+// Reads lines "<id> <text>" from stdin, each giving the session id the
+// line "<text>", and "<id>" alone, ending its input. Output lines are
+// written as "<id> <line>". False when a session failed.
+bool runSessions(const std::vector<Command> &cmds, const TapeLayout &layout, Engine engine, int threads)
+{
+    SessionPool pool(cmds, layout, engine, threads);
+    std::string line;
+    while (std::getline(std::cin, line))
+    {
+        const auto space = line.find(' ');
+        if (space == std::string::npos)
+        {
+            pool.close(line);
+        }
+        else
+        {
+            pool.feed(line.substr(0, space), line.substr(space + 1) + "\n");
+        }
+    }
+    return pool.finish();
+}
+
+// Static tape extent.
+//
+// The pointer is tracked as an interval of positions from where it
+// starts. A loop whose body moves it keeps growing the interval and is
+// widened to an unbounded side after a few rounds. The cells a program
+// can touch are the pointer interval shifted by each access offset.
+
+const long long unboundedBelow = std::numeric_limits<long long>::min() / 4;
+const long long unboundedAbove = std::numeric_limits<long long>::max() / 4;
+
+struct PointerRange
+{
+    long long lo = 0;
+    long long hi = 0;
+};
+
+struct TapeExtent
+{
+    long long lo = 0;
+    long long hi = 0;
+    // loops that had to be widened
+    std::vector<size_t> unbounded;
+
+    bool bounded() const { return lo > unboundedBelow && hi < unboundedAbove; }
+};
+
+class ExtentAnalysis
+{
+public:
+    explicit ExtentAnalysis(const std::vector<Command> &cmds) : cmds(cmds) {}
+
+    TapeExtent run()
+    {
+        block(0, cmds.size(), PointerRange());
+        std::sort(extent.unbounded.begin(), extent.unbounded.end());
+        extent.unbounded.erase(std::unique(extent.unbounded.begin(), extent.unbounded.end()),
+                               extent.unbounded.end());
+        return extent;
+    }
+
+private:
+    static long long shift(long long at, long long by)
+    {
+        if (at <= unboundedBelow || at >= unboundedAbove)
+            return at;
+        return std::clamp(at + by, unboundedBelow, unboundedAbove);
+    }
+
+    void touch(const PointerRange &p, const Command &cmd)
+    {
+        for (const int offset : touchedCells(cmd))
+        {
+            extent.lo = std::min(extent.lo, shift(p.lo, offset));
+            extent.hi = std::max(extent.hi, shift(p.hi, offset));
+        }
+    }
+
+    PointerRange block(size_t begin, size_t end, PointerRange p)
+    {
+        for (size_t i = begin; i < end; i++)
+        {
+            const auto &cmd = cmds.at(i);
+            touch(p, cmd);
+            if (cmd.inst == RIGHT || cmd.inst == LEFT)
+            {
+                const int by = cmd.inst == RIGHT ? 1 : -1;
+                p = {shift(p.lo, by), shift(p.hi, by)};
+            }
+            else if (cmd.inst == LOOP)
+            {
+                p = loop(i, p);
+                i = cmd.jumpTo;
+            }
+        }
+        return p;
+    }
+
+    PointerRange loop(size_t i, const PointerRange &p)
+    {
+        const auto end = cmds.at(i).jumpTo;
+        size_t body = i;
+        for (size_t j = i + 1; j < end; j = cmds.at(j).inst == LOOP ? cmds.at(j).jumpTo + 1 : j + 1)
+        {
+            if (cmds.at(j).inst == BODY)
+                body = j;
+        }
+
+        PointerRange in = p;
+        if (body != i)
+        {
+            const auto first = block(i + 1, body, p);
+            in = {std::min(p.lo, first.lo), std::max(p.hi, first.hi)};
+        }
+        for (int iteration = 0;; iteration++)
+        {
+            const auto out = block(body + 1, end, in);
+            PointerRange next = {std::min(in.lo, out.lo), std::max(in.hi, out.hi)};
+            if (next.lo == in.lo && next.hi == in.hi)
+                break;
+            if (iteration >= 2)
+            {
+                if (next.lo < in.lo)
+                    next.lo = unboundedBelow;
+                if (next.hi > in.hi)
+                    next.hi = unboundedAbove;
+                extent.unbounded.push_back(i);
+            }
+            in = next;
+        }
+        touch(in, cmds.at(end));
+        return in;
+    }
+
+    const std::vector<Command> &cmds;
+    TapeExtent extent;
+};
+
+TapeExtent tapeExtent(const std::vector<Command> &cmds)
+{
+    return ExtentAnalysis(cmds).run();
+}
+
+// Proven tapes up to this size go on the stack.
+const long long stackTapeLimit = 1 << 20;
+
+TapeLayout tapeLayout(const TapeExtent &extent, bool sparse)
+{
+    TapeLayout tape;
+    if (extent.bounded() && extent.hi - extent.lo + 1 <= stackTapeLimit)
+    {
+        tape.cells = extent.hi - extent.lo + 1;
+        tape.origin = -extent.lo;
+        return tape;
+    }
+    if (sparse)
+    {
+        tape.cells = sparseTapeCells;
+        tape.origin = sparseTapeCells / 2;
+        tape.sparse = true;
+        return tape;
+    }
+    if (extent.bounded())
+    {
+        tape.cells = extent.hi - extent.lo + 1;
+        tape.origin = -extent.lo;
+    }
+    tape.guarded = true;
+    return tape;
+}
+
+// Record transposition.
+//
+// Programs often keep records of k cells and walk one field with loops
+// that move by k. When every loop moves by a multiple of a common k,
+// the field of the current cell is the same at each loop's entry and
+// back edge, so it is known statically at every command. The tape is
+// then laid out field-major, r8 counts records, and each access is a
+// constant displacement from it: a scan with stride k becomes a scan
+// with stride 1.
+
+long long floorDiv(long long a, long long b)
+{
+    return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
+
+long long floorMod(long long a, long long b)
+{
+    return a - floorDiv(a, b) * b;
+}
+
+const int maxRecordStride = 16;
+
+// gcd of what each loop body moves outside its inner loops, or 1 when
+// no loop moves or the gcd is too large to be worth a field each.
+int recordStride(const std::vector<Command> &cmds)
+{
+    std::vector<long long> moves;
+    long long stride = 0;
+    for (const auto &cmd : cmds)
+    {
+        switch (cmd.inst)
+        {
+        case LOOP:
+            moves.push_back(0);
+            break;
+        case RIGHT:
+        case LEFT:
+            if (!moves.empty())
+            {
+                moves.back() += cmd.inst == RIGHT ? 1 : -1;
+            }
+            break;
+        case JMP:
+            stride = std::gcd(stride, moves.back());
+            moves.pop_back();
+            break;
+        default:
+            break;
+        }
+    }
+    return stride >= 2 && stride <= maxRecordStride ? stride : 1;
+}
+
+// Where cell L lives relative to record R.
+long long fieldMajor(long long cell, long long record, const TapeLayout &tape)
+{
+    return floorMod(cell, tape.stride) * fieldSpan(tape) + floorDiv(cell, tape.stride) - record;
+}
+
+// Rewrites cmds for a field-major tape. Pointer moves that stay within
+// a record disappear. There is no field-major DIVMOD or CMP, whose
+// guards read neighbouring cells as one word, so a program with either
+// is not transposed.
+std::optional<std::vector<Command>> transposeTape(const std::vector<Command> &cmds,
+                                                  const TapeLayout &tape)
+{
+    const int k = tape.stride;
+    if (k * fieldSpan(tape) > std::numeric_limits<int>::max())
+    {
+        return std::nullopt;
+    }
+    int phase = floorMod(tape.origin, k);
+    const auto at = [&](int offset)
+    { return static_cast<int>(fieldMajor(phase + offset, 0, tape)); };
+
+    std::vector<Command> out;
+    std::vector<int> phases;
+    for (const auto &cmd : cmds)
+    {
+        auto moved = cmd;
+        switch (cmd.inst)
+        {
+        case RIGHT:
+            if (++phase < k)
+                continue;
+            phase = 0;
+            break;
+        case LEFT:
+            if (phase-- > 0)
+                continue;
+            phase = k - 1;
+            break;
+        case PLUS:
+        case MINUS:
+            moved = Command(ADD, at(0), cmd.inst == PLUS ? 1 : -1);
+            break;
+        case CLEAR:
+            moved = Command(SET, at(0), 0);
+            break;
+        case SET:
+        case ADD:
+            moved.offset = at(cmd.offset);
+            break;
+        case MULADD:
+            moved.offset = at(cmd.offset);
+            moved.args.at(0) = at(0);
+            break;
+        case MUL:
+            moved.offset = at(0);
+            moved.args = {at(cmd.args.at(0)), at(cmd.args.at(1)), at(cmd.args.at(2))};
+            break;
+        case DIVMOD:
+        case CMP:
+            return std::nullopt;
+        case LOOP:
+            phases.push_back(phase);
+            moved.offset = at(0);
+            break;
+        case BODY:
+        case JMP:
+            if (phase != phases.back())
+            {
+                return std::nullopt;
+            }
+            if (cmd.inst == JMP)
+            {
+                phases.pop_back();
+            }
+            moved.offset = at(0);
+            break;
+        case PUT:
+        case GET:
+            moved.offset = at(0);
+            break;
+        }
+        moved.source = cmd.source;
+        out.push_back(moved);
+    }
+    relink(out);
+    return out;
+}
+
+// Checks a transposition against the logical program: the address map
+// must be one-to-one on the tape, the pointer must land on the record
+// holding the logical cell, and every command must touch the cells its
+// logical counterpart does. Returns the problems found.
+std::vector<std::string> verifyTransposition(const std::vector<Command> &logical,
+                                             const std::vector<Command> &physical,
+                                             const TapeLayout &tape)
+{
+    std::vector<std::string> problems;
+    const auto report = [&](size_t i, const std::string &what)
+    {
+        std::ostringstream line;
+        line << "command " << i << " (" << logical.at(i).inst << "): " << what;
+        problems.push_back(line.str());
+    };
+
+    std::vector<bool> used(tape.stride * fieldSpan(tape), false);
+    for (long long cell = 0; cell < tape.cells; cell++)
+    {
+        const auto at = fieldMajor(cell, 0, tape);
+        if (floorDiv(at, fieldSpan(tape)) != floorMod(cell, tape.stride) ||
+            floorMod(at, fieldSpan(tape)) >= tapeRecords(tape))
+        {
+            problems.push_back("cell " + std::to_string(cell) + " is outside its field");
+            return problems;
+        }
+        if (used.at(at))
+        {
+            problems.push_back("cell " + std::to_string(cell) + " shares its address");
+            return problems;
+        }
+        used.at(at) = true;
+    }
+
+    long long pos = tape.origin, record = tape.origin / tape.stride;
+    std::vector<std::pair<long long, long long>> loops;
+    size_t j = 0;
+    for (size_t i = 0; i < logical.size() && problems.empty(); i++)
+    {
+        const auto &cmd = logical.at(i);
+        if (cmd.inst == RIGHT || cmd.inst == LEFT)
+        {
+            pos += cmd.inst == RIGHT ? 1 : -1;
+            if (floorDiv(pos, tape.stride) != record)
+            {
+                if (j == physical.size() || physical.at(j).inst != cmd.inst)
+                {
+                    report(i, "record changes without a pointer move");
+                    break;
+                }
+                record += cmd.inst == RIGHT ? 1 : -1;
+                j++;
+            }
+            if (floorDiv(pos, tape.stride) != record)
+            {
+                report(i, "pointer is not on the record of its cell");
+            }
+            continue;
+        }
+        if ((cmd.inst == DIVMOD || cmd.inst == CMP) &&
+            (j == physical.size() || physical.at(j).inst != cmd.inst))
+        {
+            continue;
+        }
+        if (j == physical.size())
+        {
+            report(i, "missing from the transposed program");
+            break;
+        }
+
+        const auto touched = touchedCells(physical.at(j++));
+        std::vector<int> expected, actual(touched.begin(), touched.end());
+        for (const auto offset : touchedCells(cmd))
+        {
+            expected.push_back(fieldMajor(pos + offset, record, tape));
+        }
+        std::sort(expected.begin(), expected.end());
+        std::sort(actual.begin(), actual.end());
+        if (expected != actual)
+        {
+            report(i, "touches the wrong cells");
+        }
+
+        if (cmd.inst == LOOP)
+        {
+            loops.emplace_back(pos, record);
+        }
+        else if (cmd.inst == BODY || cmd.inst == JMP)
+        {
+            if (floorMod(pos, tape.stride) != floorMod(loops.back().first, tape.stride))
+            {
+                report(i, "loop changes the field of the current cell");
+            }
+            std::tie(pos, record) = loops.back();
+            if (cmd.inst == JMP)
+            {
+                loops.pop_back();
+            }
+        }
+    }
+    if (problems.empty() && j != physical.size())
+    {
+        problems.push_back("transposed program has extra commands");
+    }
+    return problems;
+}
+
+// In-process pipelines.
+//
+// `bfc pipe a.bf b.bf c.bf` runs a | b | c with each stage on its own
+// thread and a ByteRing between neighbouring stages, so what one stage
+// writes is read by the next without a process or a kernel pipe in
+// between. The first stage reads stdin and the last writes stdout. A
+// stage that ends closes its output, which the next reads as end of
+// input, and abandons its input, so the stage before it does not wait
+// on a full ring.
+
+const size_t pipeRingSize = 1 << 16;
+
+int runPipeline(const Options &options)
+{
+    std::vector<std::vector<Command>> programs;
+    std::vector<TapeLayout> tapes;
+    WorkPool pool(jobCount(options));
+    for (const auto &filename : options.stages)
+    {
+        std::ifstream in(filename);
+        if (!in.is_open())
+        {
+            std::cerr << "could not read " << filename << std::endl;
+            return 1;
+        }
+        if (isBytecodeFile(filename))
+        {
+            try
+            {
+                auto code = readBytecode(filename);
+                programs.push_back(std::move(code.program));
+                tapes.push_back(code.tape);
+            }
+            catch (const std::runtime_error &e)
+            {
+                std::cerr << e.what() << std::endl;
+                return 1;
+            }
+            continue;
+        }
+        std::stringstream buffer;
+        buffer << in.rdbuf();
+        const auto text = buffer.str();
+        try
+        {
+            programs.push_back(optimize(buildProgram(readInstructions(text)), pool));
+        }
+        catch (const LoopMismatch &e)
+        {
+            const auto [line, column] = locateInstructions(text).at(e.instruction);
+            std::cerr << filename << ":" << line << ":" << column << ": " << e.what() << std::endl;
+            return 1;
+        }
+        tapes.push_back(tapeLayout(tapeExtent(programs.back()), options.sparseTape));
+    }
+
+    // stages run in process; the interpreter stands in for native code
+    const auto engine = options.engine == ENGINE_NATIVE ? ENGINE_INTERPRETER : options.engine;
+    std::vector<std::unique_ptr<ByteRing>> rings;
+    for (size_t k = 1; k < programs.size(); k++)
+    {
+        rings.push_back(std::make_unique<ByteRing>(pipeRingSize));
+    }
+    std::vector<std::thread> stages;
+    for (size_t k = 0; k < programs.size(); k++)
+    {
+        stages.emplace_back(
+            [&, k]()
+            {
+                ProcessIo io;
+                io.source = k > 0 ? rings.at(k - 1).get() : nullptr;
+                io.sink = k + 1 < programs.size() ? rings.at(k).get() : nullptr;
+                runInProcess(programs.at(k), tapes.at(k), engine, io);
+                if (io.sink != nullptr)
+                {
+                    io.sink->close();
+                }
+                if (io.source != nullptr)
+                {
+                    io.source->abandon();
+                }
+            });
+    }
+    for (auto &stage : stages)
+    {
+        stage.join();
+    }
+    return 0;
+}
+
+// A count from the command line: digits only, few enough to fit a long
+// long. Signs, blanks and anything after the number are refused.
+std::optional<long long> parseCount(const std::string &text)
+{
+    if (text.empty() || text.size() > 18 || text.find_first_not_of("0123456789") != std::string::npos)
+    {
+        return std::nullopt;
+    }
+    return std::stoll(text);
+}
+
+// Seconds from the command line: digits with at most one point, and no
+// more of them than a timer can tell apart.
+std::optional<double> parseSeconds(const std::string &text)
+{
+    const auto point = text.find('.');
+    const auto whole = text.substr(0, point);
+    const auto fraction = point == std::string::npos ? std::string() : text.substr(point + 1);
+    const auto digits = [](const std::string &part)
+    { return part.size() <= 9 && part.find_first_not_of("0123456789") == std::string::npos; };
+    if ((whole.empty() && fraction.empty()) || !digits(whole) || !digits(fraction))
+    {
+        return std::nullopt;
+    }
+    return std::stod(text);
+}
+
+std::optional<Options> parseOptions(int argc, char **argv)
+{
+    Options options;
+    bool cacheNextToSource = false;
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--superopt")
+        {
+            options.superopt = true;
+        }
+        else if (arg == "--sparse-tape")
+        {
+            options.sparseTape = true;
+        }
+        else if (arg == "--interpret")
+        {
+            options.engine = ENGINE_INTERPRETER;
+        }
+        else if (arg == "--jit")
+        {
+            options.engine = ENGINE_STENCIL;
+        }
+        else if (arg == "--trace-jit")
+        {
+            options.engine = ENGINE_TRACING;
+        }
+        else if (arg == "--spec-jit")
+        {
+            options.engine = ENGINE_SPECULATIVE;
+        }
+        else if (arg == "--batch")
+        {
+            options.batch = true;
+        }
+        else if (arg == "--lanes=1" || arg == "--lanes=16" || arg == "--lanes=32" || arg == "--lanes=64")
+        {
+            options.lanes = std::stoi(arg.substr(std::string("--lanes=").size()));
+        }
+        else if (arg == "--fork-server")
+        {
+            options.forkServer = true;
+        }
+        else if (arg == "--sessions")
+        {
+            options.sessions = true;
+        }
+        else if (arg.rfind("--threads=", 0) == 0)
+        {
+            options.threads = std::stoi(arg.substr(std::string("--threads=").size()));
+            if (options.threads < 1)
+            {
+                return std::nullopt;
+            }
+        }
+        else if (arg == "--verify-layout")
+        {
+            options.verifyLayout = true;
+        }
+        else if (arg.rfind("--checkpoint=", 0) == 0)
+        {
+            options.checkpoint = arg.substr(std::string("--checkpoint=").size());
+        }
+        else if (arg.rfind("--checkpoint-every=", 0) == 0)
+        {
+            const auto every = parseCount(arg.substr(std::string("--checkpoint-every=").size()));
+            if (!every.has_value() || every.value() < 1 || every.value() > std::numeric_limits<int>::max())
+            {
+                return std::nullopt;
+            }
+            options.checkpointEvery = static_cast<int>(every.value());
+        }
+        else if (arg == "--memoize")
+        {
+            options.memoBudget = 64 << 20;
+        }
+        else if (arg.rfind("--memoize=", 0) == 0)
+        {
+            // at most 2^24 MiB, so the size in bytes fits
+            const auto mib = parseCount(arg.substr(std::string("--memoize=").size()));
+            if (!mib.has_value() || mib.value() < 1 || mib.value() > (1ll << 24))
+            {
+                return std::nullopt;
+            }
+            options.memoBudget = static_cast<size_t>(mib.value()) << 20;
+        }
+        else if (arg.rfind("--max-steps=", 0) == 0)
+        {
+            const auto steps = parseCount(arg.substr(std::string("--max-steps=").size()));
+            if (!steps.has_value() || steps.value() < 1)
+            {
+                return std::nullopt;
+            }
+            options.maxSteps = steps.value();
+        }
+        else if (arg.rfind("--time-limit=", 0) == 0)
+        {
+            const auto seconds = parseSeconds(arg.substr(std::string("--time-limit=").size()));
+            if (!seconds.has_value() || !(seconds.value() > 0))
+            {
+                return std::nullopt;
+            }
+            options.timeLimit = seconds.value();
+        }
+        else if (arg.rfind("--emit-bytecode=", 0) == 0)
+        {
+            options.emitBytecode = arg.substr(std::string("--emit-bytecode=").size());
+            if (options.emitBytecode.empty())
+            {
+                return std::nullopt;
+            }
+        }
+        else if (arg == "--incremental")
+        {
+            cacheNextToSource = true;
+        }
+        else if (arg.rfind("--incremental=", 0) == 0)
+        {
+            options.incremental = arg.substr(std::string("--incremental=").size());
+            if (options.incremental.empty())
+            {
+                return std::nullopt;
+            }
+        }
+        else if (arg == "--compile-stats")
+        {
+            options.compileStats = true;
+        }
+        else if (arg.rfind("--compile-budget=", 0) == 0)
+        {
+            // seconds, then optionally a comma and MiB
+            const auto budget = arg.substr(std::string("--compile-budget=").size());
+            const auto comma = budget.find(',');
+            const auto seconds = parseSeconds(budget.substr(0, comma));
+            const auto mib =
+                comma == std::string::npos ? std::make_optional(0ll) : parseCount(budget.substr(comma + 1));
+            if (!seconds.has_value() || !(seconds.value() > 0) || !mib.has_value() ||
+                (comma != std::string::npos && mib.value() == 0) || mib.value() > (1ll << 24))
+            {
+                return std::nullopt;
+            }
+            options.compileSeconds = seconds.value();
+            options.compileBytes = static_cast<size_t>(mib.value()) << 20;
+        }
+        else if (arg == "--resume")
+        {
+            options.resume = true;
+        }
+        else if (arg.rfind("--superopt-db=", 0) == 0)
+        {
+            options.superoptDb = arg.substr(std::string("--superopt-db=").size());
+        }
+        else if (arg.rfind("-j", 0) == 0)
+        {
+            // -j<n> or -j <n>, as make takes it
+            const auto count = arg.size() > 2 ? arg.substr(2) : i + 1 < argc ? std::string(argv[++i]) : "";
+            if (count.empty() || count.find_first_not_of("0123456789") != std::string::npos)
+            {
+                return std::nullopt;
+            }
+            options.jobs = std::stoi(count);
+            if (options.jobs < 1)
+            {
+                return std::nullopt;
+            }
+        }
+        else if (arg.rfind("--", 0) == 0)
+        {
+            return std::nullopt;
+        }
+        else if (arg == "pipe" && !options.pipe && options.filename.empty())
+        {
+            options.pipe = true;
+        }
+        else if (options.pipe)
+        {
+            options.stages.push_back(arg);
+        }
+        else if (!options.filename.empty())
+        {
+            return std::nullopt;
+        }
+        else
+        {
+            options.filename = arg;
+        }
+    }
+    if (options.filename.empty() && options.stages.empty())
+    {
+        return std::nullopt;
+    }
+    // the memo sits in the interpreter's dispatch
+    if (options.memoBudget > 0 && (options.engine != ENGINE_INTERPRETER || options.pipe || options.batch ||
+                                   options.sessions || !options.checkpoint.empty()))
+    {
+        return std::nullopt;
+    }
+    // bytecode is compiled from one program and not run
+    if (!options.emitBytecode.empty() && options.pipe)
+    {
+        return std::nullopt;
+    }
+    // stats and budgets are of one compilation
+    if ((options.compileStats || options.compileSeconds > 0) && options.pipe)
+    {
+        return std::nullopt;
+    }
+    if (cacheNextToSource && options.incremental.empty())
+    {
+        options.incremental = options.filename + "_cache";
+    }
+    // incremental builds are of executables, and checkpoints need every
+    // back edge in one table
+    if (!options.incremental.empty() &&
+        (options.engine != ENGINE_NATIVE || options.pipe || options.batch || options.sessions ||
+         !options.checkpoint.empty() || !options.emitBytecode.empty()))
+    {
+        return std::nullopt;
+    }
+    // budgets are for one program run on its own
+    if ((options.maxSteps > 0 || options.timeLimit > 0) &&
+        (options.pipe || options.batch || options.sessions || options.forkServer))
+    {
+        return std::nullopt;
+    }
+    // snapshots are of one program run on its own
+    if (options.checkpoint.empty() ? options.checkpointEvery > 0 || options.resume
+                                   : options.pipe || options.batch || options.sessions || options.forkServer)
+    {
+        return std::nullopt;
+    }
+    if (options.superoptDb.empty())
+    {
+        options.superoptDb = defaultSuperoptDb();
+    }
+    return options;
+}
+
+// Runs the front end: parses and optimizes a source file and plans its
+// tape.
+std::optional<Bytecode> compileSource(const Options &options, CompileStats *stats = nullptr,
+                                      CompileBudget *compileBudget = nullptr)
+{
+    const auto mark = [&](const char *stage)
+    {
+        if (stats != nullptr)
+            stats->mark(stage);
+    };
+    std::ifstream in(options.filename);
+    if (!in.is_open())
+    {
+        std::cerr << "could not read " << options.filename << std::endl;
+        return std::nullopt;
+    }
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    const auto programText = buffer.str();
+    mark("read");
+
+    // positions are kept for bytecode and the memo's report, and
+    // otherwise only worked out when there is something to report
+    Bytecode code;
+    if (!options.emitBytecode.empty() || options.memoBudget > 0)
+    {
+        code.locations = locateInstructions(programText);
+        mark("locate");
+    }
+    const auto locate = [&](size_t instruction)
+    {
+        if (code.locations.empty())
+        {
+            code.locations = locateInstructions(programText);
+        }
+        return code.locations.at(instruction);
+    };
+    auto &program = code.program;
+    try
+    {
+        WorkPool pool(jobCount(options));
+        const auto insts = readInstructions(programText);
+        mark("lex");
+        const auto cmds = buildProgram(insts);
+        mark("match");
+        program = optimize(cmds, pool, stats, compileBudget);
+    }
+    catch (const LoopMismatch &e)
+    {
+        const auto [line, column] = locate(e.instruction);
+        std::cerr << options.filename << ":" << line << ":" << column << ": " << e.what() << std::endl;
+        return std::nullopt;
+    }
+
+    const auto extent = tapeExtent(program);
+    if (!extent.bounded())
+    {
+        std::vector<size_t> reported;
+        for (const auto loop : extent.unbounded)
+        {
+            const auto source = program.at(loop).source;
+            if (std::find(reported.begin(), reported.end(), source) != reported.end())
+            {
+                continue;
+            }
+            reported.push_back(source);
+            const auto [line, column] = locate(source);
+            std::cerr << options.filename << ":" << line << ":" << column
+                      << ": loop moves the pointer by an unbounded amount" << std::endl;
+        }
+        std::cerr << "tape extent not proven, using "
+                  << (options.sparseTape ? "a sparse tape" : "30000 cells with guard pages")
+                  << std::endl;
+    }
+    auto &tape = code.tape;
+    tape = tapeLayout(extent, options.sparseTape);
+
+    auto fieldMajorTape = tape;
+    fieldMajorTape.stride = recordStride(program);
+    const bool inOrder = std::any_of(program.begin(), program.end(), [](const Command &cmd)
+                                     { return cmd.inst == DIVMOD || cmd.inst == CMP; });
+    if (fieldMajorTape.stride > 1 && !tape.sparse && inOrder)
+    {
+        // the scans inside divmod move by 3, which is often where the
+        // stride came from
+        std::cerr << "record stride " << fieldMajorTape.stride
+                  << " not used: divmod and cmp need their cells in tape order" << std::endl;
+    }
+    const auto transposed = fieldMajorTape.stride > 1 && !tape.sparse && !inOrder
+                                ? transposeTape(program, fieldMajorTape)
+                                : std::nullopt;
+    if (transposed.has_value())
+    {
+        if (options.verifyLayout)
+        {
+            const auto problems = verifyTransposition(program, transposed.value(), fieldMajorTape);
+            for (const auto &problem : problems)
+            {
+                std::cerr << "layout verifier: " << problem << std::endl;
+            }
+            if (!problems.empty())
+            {
+                return std::nullopt;
+            }
+            std::cerr << "record stride " << fieldMajorTape.stride << ": layout verified" << std::endl;
+        }
+        program = transposed.value();
+        tape = fieldMajorTape;
+    }
+    mark("layout");
+    return code;
+}
+
+// Objects for the units of an incremental build. A unit whose text
+// matches the copy cached in dir reuses its object; the rest are
+// assembled on the pool. Units left over from earlier builds are removed.
+std::optional<std::vector<std::string>> assembleUnits(const std::vector<NativeUnit> &units,
+                                                      const std::string &dir, int jobs)
+{
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    std::vector<std::string> objects, texts;
+    std::vector<size_t> changed;
+    for (size_t k = 0; k < units.size(); k++)
+    {
+        std::string text;
+        for (const auto &line : units.at(k).asms)
+        {
+            text += line + "\n";
+        }
+        const auto base = (fs::path(dir) / units.at(k).name).string();
+        std::ifstream cached(base + ".asm", std::ios::binary);
+        std::stringstream buffer;
+        buffer << cached.rdbuf();
+        if (!cached.is_open() || buffer.str() != text || !fs::exists(base + ".o"))
+        {
+            changed.push_back(k);
+        }
+        objects.push_back(base + ".o");
+        texts.push_back(std::move(text));
+    }
+
+    // written under temporary names and renamed once assembled, so an
+    // interrupted build never leaves an object that looks current
+    std::vector<std::string> commands;
+    for (const auto k : changed)
+    {
+        const auto base = (fs::path(dir) / units.at(k).name).string();
+        commands.push_back("nasm -felf64 -o \"" + base + ".o.tmp\" \"" + base + ".asm.tmp\"");
+        std::cout << commands.back() << std::endl;
+    }
+    std::vector<bool> assembled(changed.size(), false);
+    WorkPool pool(jobs);
+    pool.run(changed.size(), [&](size_t c)
+             {
+                 const auto base = (fs::path(dir) / units.at(changed.at(c)).name).string();
+                 {
+                     std::ofstream out(base + ".asm.tmp", std::ios::binary | std::ios::trunc);
+                     out << texts.at(changed.at(c));
+                 }
+                 if (system(commands.at(c).c_str()) == 0)
+                 {
+                     std::error_code renamed;
+                     fs::rename(base + ".o.tmp", base + ".o", renamed);
+                     fs::rename(base + ".asm.tmp", base + ".asm", renamed);
+                     assembled.at(c) = !renamed;
+                 }
+             });
+    std::cout << "assembled " << changed.size() << " of " << units.size() << " units" << std::endl;
+    if (std::find(assembled.begin(), assembled.end(), false) != assembled.end())
+    {
+        return std::nullopt;
+    }
+
+    std::set<std::string> current;
+    for (const auto &unit : units)
+    {
+        current.insert(unit.name);
+    }
+    std::vector<fs::path> leftover;
+    for (const auto &entry : fs::directory_iterator(dir, ec))
+    {
+        const auto name = entry.path().filename().string();
+        if (name.rfind("unit_", 0) == 0 && current.count(name.substr(0, name.find('.'))) == 0)
+        {
+            leftover.push_back(entry.path());
+        }
+    }
+    for (const auto &path : leftover)
+    {
+        fs::remove(path, ec);
+    }
+    return objects;
+}
+
+int main(int argc, char **argv)
+{
+    const auto options = parseOptions(argc, argv);
+    if (!options.has_value())
+    {
+        std::cerr << "usage: bfc [-j <n>] [--compile-stats] [--compile-budget=<seconds>[,<MiB>]] [--superopt] [--superopt-db=<file>] [--sparse-tape] [--verify-layout] [--fork-server] [--max-steps=<n>] [--time-limit=<seconds>] [--interpret | --jit | --trace-jit | --spec-jit] [--batch [--lanes=1|16|32|64] | --sessions [--threads=<n>]] <filename>\n"
+                  << "       bfc [--sparse-tape] --interpret --memoize[=<MiB>] <filename>\n"
+                  << "       bfc [--sparse-tape] [--interpret | --jit | --trace-jit | --spec-jit] --checkpoint=<file> [--checkpoint-every=<seconds>] [--resume] <filename>\n"
+                  << "       bfc [--sparse-tape] [--interpret | --jit | --trace-jit | --spec-jit] pipe <filename>...\n"
+                  << "       bfc [-j <n>] [--sparse-tape] [--verify-layout] --emit-bytecode=<file.bfb> <filename>\n"
+                  << "       bfc [-j <n>] [--superopt] [--sparse-tape] [--fork-server] [--max-steps=<n>] [--time-limit=<seconds>] --incremental[=<dir>] <filename>\n"
+                  << "A <filename> ending in .bfb is bytecode and runs without compiling again.\n"
+                  << "A --resume run writes on from the snapshot into its output, so give it the stopped run's output as 1<>file, not >file." << std::endl;
+        return 2;
+    }
+    if (options->pipe)
+    {
+        return runPipeline(options.value());
+    }
+
+    CompileStats stats;
+    auto *statsOut = options->compileStats ? &stats : nullptr;
+    countingAllocations = statsOut != nullptr;
+    const auto markStats = [&](const char *stage, bool report)
+    {
+        if (statsOut != nullptr)
+        {
+            stats.mark(stage);
+        }
+        if (statsOut != nullptr && report)
+        {
+            stats.report(std::cerr);
+        }
+    };
+    std::optional<CompileBudget> compileBudget;
+    if (options->compileSeconds > 0)
+    {
+        compileBudget.emplace(options->compileSeconds, options->compileBytes);
+    }
+    auto *budgetOut = compileBudget.has_value() ? &compileBudget.value() : nullptr;
+    std::optional<Bytecode> compiled;
+    try
+    {
+        compiled = isBytecodeFile(options->filename) ? readBytecode(options->filename)
+                                                     : compileSource(options.value(), statsOut, budgetOut);
+    }
+    catch (const std::runtime_error &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    if (!compiled.has_value())
+    {
+        return 1;
+    }
+    if (isBytecodeFile(options->filename))
+    {
+        markStats("load", false);
+    }
+    if (budgetOut != nullptr)
+    {
+        budgetOut->report(std::cerr);
+    }
+    if (!options->emitBytecode.empty())
+    {
+        try
+        {
+            writeBytecode(options->emitBytecode, compiled.value());
+        }
+        catch (const std::runtime_error &e)
+        {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        markStats("write", true);
+        return 0;
+    }
+    // a native build adds its own stages to the report
+    if (statsOut != nullptr && (options->engine != ENGINE_NATIVE || options->batch || options->sessions))
+    {
+        stats.report(std::cerr);
+    }
+    const auto &[program, tape, locations] = compiled.value();
+    if (options->batch)
+    {
+        return runBatch(program, tape, options->lanes) ? 0 : 1;
+    }
+    if (options->sessions)
+    {
+        const int threads = options->threads > 0 ? options->threads
+                                                  : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+        return runSessions(program, tape, options->engine, threads) ? 0 : 1;
+    }
+    // compiled programs start their budgets themselves
+    auto *budget = options->engine != ENGINE_NATIVE ? startBudget(options->maxSteps, options->timeLimit) : nullptr;
+    if (options->memoBudget > 0)
+    {
+        runMemoized(program, tape, options.value(), locations, budget);
+        return budgetExceeded(std::cerr) ? budgetExitStatus : 0;
+    }
+    if (!options->checkpoint.empty() && options->engine != ENGINE_NATIVE)
+    {
+        try
+        {
+            runCheckpointed(program, tape, options.value(), budget);
+        }
+        catch (const std::runtime_error &e)
+        {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        return budgetExceeded(std::cerr) ? budgetExitStatus : 0;
+    }
+    if (!options->checkpoint.empty() && (tape.sparse || options->resume))
+    {
+        std::cerr << (tape.sparse ? "compiled checkpoints need a bounded tape"
+                                  : "compiled programs resume when run with --resume")
+                  << std::endl;
+        return 1;
+    }
+    if (options->engine != ENGINE_NATIVE)
+    {
+        ProcessIo io;
+        runInProcess(program, tape, options->engine, io, budget);
+        return budgetExceeded(std::cerr) ? budgetExitStatus : 0;
+    }
+    std::vector<NativeUnit> units;
+    const auto asmcode = assembly(program, options.value(), tape, options->incremental.empty() ? nullptr : &units,
+                                  budgetOut);
+    markStats("codegen", false);
+    if (budgetOut != nullptr)
+    {
+        budgetOut->report(std::cerr);
+    }
+
+    const auto asmName = options->filename + "_out.asm.tmp";
+    const auto objName = options->filename + "_obj.o";
+
+    std::ofstream out(asmName);
+    if (!out.is_open())
+    {
+        std::cerr << "could not open out.asm" << std::endl;
+        return 1;
+    }
+
+    for (const auto &sasm : asmcode)
+    {
+        out << sasm << std::endl;
+    }
+
+    const auto nasmCmd = "nasm -felf64 -o \"" + objName + "\" \"" + asmName + "\"";
+    std::cout << nasmCmd << std::endl;
+    int nasmCode = system(nasmCmd.c_str());
+    if (nasmCode != 0) {
+        std::cerr << "NASM failed." << std::endl;
         return 1;
     }
 
-    const auto ldCmd = "ld \"" + objName + "\"";
+    auto ldCmd = "ld \"" + objName + "\"";
+    if (!options->incremental.empty())
+    {
+        const auto objects = assembleUnits(units, options->incremental, jobCount(options.value()));
+        if (!objects.has_value())
+        {
+            std::cerr << "NASM failed." << std::endl;
+            return 1;
+        }
+        // the unit objects go in a response file; there can be many
+        const auto listName = (fs::path(options->incremental) / "objects").string();
+        std::ofstream list(listName);
+        for (const auto &object : objects.value())
+        {
+            list << "\"" << object << "\"\n";
+        }
+        ldCmd += " @\"" + listName + "\"";
+    }
     std::cout << ldCmd << std::endl;
     int ldCode = system(ldCmd.c_str());
     if (ldCode != 0) {
@@ -314,5 +9404,6 @@ int main(int argc, char **argv)
     fs::remove(asmName);
     fs::remove(objName);
 
+    markStats("assemble", true);
     return 0;
 }
@@ -0,0 +1,64 @@
+#!/bin/sh
+# Every engine charges a --max-steps budget the same way, so the fewest
+# steps a program needs are the same in each. Found by bisection with
+# the interpreter, then checked on the others, on the interpreter with
+# loops memoized, and on generated code when nasm and ld are there.
+# usage: budget_engines.sh <bfc>
+set -u
+bfc=$1
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work" || exit 1
+
+# nested and counted loops, scans, and loops hot enough to be traced
+# and specialized
+printf '%s' '>+>+++++++++++++++++++++++++>+>>++++++++++++++++++++++++++++++++++++++++[>>+++++<<<<<[->>>>>>+<<<<<<]>>>>>>[-<<<<<<+>>>>>>>>+<<]>>[<<<--<<<<<->>>>>>>>[-]]<<<[->>+++.<<]>>[-]<<<<<<[<]>[>]>-]' >a.bf
+printf '%s' '++++[>+++++<-]>[<+++++>-]+<+[>[>+>+<<-]++>>[<<+>>-]>>>[-]++>[-]+>>>+[[-]++++++>>>]<<<[[<++++++++<++>>-]+<.<[>----<-]<]<<[>>>>>[>>>[-]+++++++++<[>-<-]+++++++++>[-[<->-]+[<<<]]<[>+<-]>]<<-]<<-]' >b.bf
+# the same inner nest over and over, so memoized runs skip it
+printf '%s' '++++++++++[>+++++[>+++++++[>+>+<[->+<]<-]<-]>>>.[-]>[-]<<<<<-]' >c.bf
+
+# exit status of a run of $2 with a budget of $3 steps on engine $1
+run()
+{
+    if [ "$1" = native ]; then
+        "$bfc" --max-steps="$3" "$2" >/dev/null 2>&1 || return 1
+        ./a.out </dev/null >/dev/null 2>&1
+    elif [ "$1" = memo ]; then
+        "$bfc" --interpret --memoize --max-steps="$3" "$2" </dev/null >/dev/null 2>&1
+    else
+        "$bfc" "$1" --max-steps="$3" "$2" </dev/null >/dev/null 2>&1
+    fi
+}
+
+engines="--interpret --jit --trace-jit --spec-jit memo"
+if command -v nasm >/dev/null && command -v ld >/dev/null; then
+    engines="$engines native"
+fi
+
+status=0
+for prog in a.bf b.bf c.bf; do
+    low=0
+    high=1
+    while run --interpret "$prog" "$high"; [ $? -eq 3 ]; do
+        high=$((high * 2))
+    done
+    while [ $((high - low)) -gt 1 ]; do
+        mid=$(((low + high) / 2))
+        if run --interpret "$prog" "$mid"; [ $? -eq 3 ]; then
+            low=$mid
+        else
+            high=$mid
+        fi
+    done
+    for engine in $engines; do
+        run "$engine" "$prog" "$low"
+        short=$?
+        run "$engine" "$prog" "$high"
+        enough=$?
+        if [ "$short" -ne 3 ] || [ "$enough" -ne 0 ]; then
+            echo "$prog: $engine exits $short at $low steps and $enough at $high, not 3 and 0"
+            status=1
+        fi
+    done
+done
+exit $status
@@ -0,0 +1,83 @@
+#!/bin/sh
+# A run stopped after a SIGUSR1 snapshot and resumed from it writes the
+# same output as one that was never stopped, in process and as a
+# compiled program when nasm and ld are there. The resumed run gets the
+# output file opened read-write, 1<>, so what was written before the
+# snapshot is kept; a > redirect would truncate it. Input comes from a
+# file, which the resumed run seeks past what was read.
+# usage: checkpoint_resume.sh <bfc>
+set -u
+bfc=$1
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work" || exit 1
+
+# prints A to D, each followed by a loop run as many times as the next
+# input byte says; one is about half a second in the interpreter, ten
+# about as long compiled
+printf '%s' '++++++++[>++++++++<-]>+>++++[<.+>>,[>-[>-[>-[>-[>+<-]<-]<-]<-]<-]<-]' >slow.bf
+printf '\001\001\001\001' >slow.in
+printf '\012\012\012\012' >fast.in
+
+# runs the program on engine $1 and input $2, with any further flags,
+# in place of the shell it is called in, so a background run's $! is
+# the program's
+run()
+{
+    engine=$1
+    input=$2
+    shift 2
+    if [ "$engine" = native ]; then
+        exec ./a.out "$@" <"$input"
+    else
+        exec "$bfc" "$engine" --checkpoint=snap "$@" slow.bf <"$input"
+    fi
+}
+
+check()
+{
+    rm -f snap out
+    run "$1" "$2" >out 2>/dev/null &
+    run=$!
+    # the first letter is flushed at the first read, so the snapshot
+    # is taken in the loop after it
+    tries=0
+    while [ ! -s out ] && [ $tries -lt 100 ]; do
+        sleep 0.1
+        tries=$((tries + 1))
+    done
+    kill -USR1 "$run"
+    tries=0
+    while [ ! -f snap ] && [ $tries -lt 100 ]; do
+        sleep 0.1
+        tries=$((tries + 1))
+    done
+    kill -KILL "$run" 2>/dev/null
+    wait "$run" 2>/dev/null
+    if [ ! -f snap ]; then
+        echo "$1: no snapshot after SIGUSR1"
+        return 1
+    fi
+    if ! (run "$1" "$2" --resume) 1<>out 2>/dev/null; then
+        echo "$1: resuming failed"
+        return 1
+    fi
+    if [ "$(cat out)" != ABCD ]; then
+        echo "$1: resumed output differs:"
+        od -c out
+        return 1
+    fi
+}
+
+status=0
+check --interpret slow.in || status=1
+check --jit slow.in || status=1
+if command -v nasm >/dev/null && command -v ld >/dev/null; then
+    if "$bfc" --checkpoint=snap slow.bf >/dev/null 2>&1; then
+        check native fast.in || status=1
+    else
+        echo "could not compile with --checkpoint"
+        status=1
+    fi
+fi
+exit $status
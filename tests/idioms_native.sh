@@ -0,0 +1,58 @@
+#!/bin/sh
+# Programs built on the loops that divmod, mul and cmp replace give the
+# same output compiled as in the interpreter, which runs the loops as
+# written. The inputs include zero divisors and operands, and some
+# layouts break an op's guard so that it falls back to its loop. A
+# divisor of 1 is left out: the divmod loop itself runs off the tape
+# then. Each program is checked to have its op in the generated code.
+# usage: idioms_native.sh <bfc>
+set -u
+bfc=$1
+if ! command -v nasm >/dev/null || ! command -v ld >/dev/null; then
+    echo "skipped: needs nasm and ld"
+    exit 77
+fi
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work" || exit 1
+
+# name, the op's telltale instruction, then the program, which reads
+# its two operands and prints the cells the loop leaves
+cat >programs <<'END'
+divmod div.ecx ,>,<[->-[>+>>]>[+[-<+>]>+>>]<<<<<]>.>.>.
+divmod_guard div.ecx ,>,>>>+<<<<[->-[>+>>]>[+[-<+>]>+>>]<<<<<]>.>.>.>.
+divmod_copy div.ecx ,>>,<<[->+>-[>+>>]>[+[-<+>]>+>>]<<<<<<]>.>.>.>.>.
+mul mul.byte ,>,<[>[->+>+<<]>>[-<<+>>]<<<-]>.>.>.
+mul_guard mul.byte ,>,>>+<<<[>[->+>+<<]>>[-<<+>>]<<<-]>.>.>.
+cmp_left cmp.word ,>>,>+<<<[>>-[>-]>[<<+<[-]+>>>->]<+<<<-]>.>.>.>.
+cmp_left_down cmp.word ,>>,>+<<<[>>-[>-]>[<<-<[-]+>>>->]<+<<<-]>.>.>.>.
+cmp_right cmp.word ,>,>+<<[>-[>-]>[>>+<<<<[-]+>>->]<+<<-]>.>.>.>.
+cmp_right_down cmp.word ,>,>+<<[>-[>-]>[>>-<<<<[-]+>>->]<+<<-]>.>.>.>.
+cmp_guard cmp.word ,>,>+>+<<<[>-[>-]>[>>+<<<<[-]+>>->]<+<<-]>.>.>.>.
+END
+
+status=0
+while read -r name op program; do
+    printf '%s' "$program" >"$name.bf"
+    rm -rf units
+    if ! "$bfc" --incremental=units "$name.bf" >/dev/null 2>&1; then
+        echo "$name: does not compile"
+        status=1
+        continue
+    fi
+    if ! cat units/*.asm | grep -q "$op"; then
+        echo "$name: no $op in the generated code"
+        status=1
+    fi
+    for operands in '0 0' '0 5' '5 0' '1 2' '17 2' '17 5' '5 17' '7 7' '255 3' '3 255' '200 100'; do
+        set -- $operands
+        printf "\\$(printf %o "$1")\\$(printf %o "$2")" >in
+        ./a.out <in >native
+        "$bfc" --interpret "$name.bf" <in >interpreted 2>/dev/null
+        if ! cmp -s native interpreted; then
+            echo "$name on $operands: compiled $(od -An -tu1 native), interpreted $(od -An -tu1 interpreted)"
+            status=1
+        fi
+    done
+done <programs
+exit $status
@@ -0,0 +1,54 @@
+#!/bin/sh
+# A session or batch record whose pointer leaves the tape fails alone:
+# the others run to their end with all their output, and the failure is
+# reported.
+# usage: tape_fault.sh <bfc>
+set -u
+bfc=$1
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work" || exit 1
+
+# echoes a line, stepping left from cell 300 at each character, so a
+# line of more than 301 characters runs off the start of the tape; the
+# loop runs often enough to be traced and specialized
+long=$(printf '%400s' '' | tr ' ' x)
+{ printf '%300s' '' | tr ' ' '>'; printf '%s' ',----------[++++++++++.<,----------]'; } >p.bf
+printf 'a ok\nb %s\nc fine\na\nb\nc\n' "$long" >in
+printf 'a ok\nb %s\nc fine\n' "$(printf '%s' "$long" | cut -c1-301)" >expected
+
+status=0
+for engine in --interpret --trace-jit --spec-jit; do
+    "$bfc" "$engine" --sessions --threads=2 p.bf <in >out 2>err
+    code=$?
+    sort out >sorted
+    if [ "$code" -ne 1 ] || ! cmp -s sorted expected || ! grep -q '^session b: pointer left the tape$' err ||
+        [ "$(grep -c '^session' err)" -ne 1 ]; then
+        echo "$engine --sessions: exit $code"
+        cat out err
+        status=1
+    fi
+done
+
+# Records run in lockstep leave the tape together, or one at a time once
+# peeled off. In q.bf, lines other than "A" enter a loop that reaches
+# three cells left of the start, while the rest wait at enclosing loops.
+printf 'ok\n%s\n%s\nfine\n%s\n' "$long" "$long" "$long" >in1
+printf 'ok\n%s\nfine\nab\n' "$long" >in2
+printf 'A\nB\n\nB\nA\nB\n' >in3
+{ printf '%s' ',----------[' ; printf '%55s' '' | tr ' ' -; printf '%s' '[<<<+>>>-.][-]]>';
+  printf '%48s' '' | tr ' ' +; printf '%s' '.>,----------[>,----------]'; } >q.bf
+part=$(printf '%s' "$long" | cut -c1-301)
+for lanes in 1 16 32 64; do
+    for test in "p.bf in1 ok${part}${part}fine${part} 2,3,5" "p.bf in2 ok${part}fineab 2" "q.bf in3 000 2,4,6"; do
+        set -- $test
+        "$bfc" --batch --lanes="$lanes" "$1" <"$2" >out 2>err
+        code=$?
+        failed=$(sed -n 's/^record \([0-9]*\): pointer left the tape$/\1/p' err | paste -sd, -)
+        if [ "$code" -ne 1 ] || [ "$(cat out)" != "$3" ] || [ "$failed" != "$4" ]; then
+            echo "--batch --lanes=$lanes $1 <$2: exit $code, records $failed failed"
+            status=1
+        fi
+    done
+done
+exit $status